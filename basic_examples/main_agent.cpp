@@ -0,0 +1,412 @@
+#include <iostream>
+#include <algorithm>
+#include <csignal>
+#include <cstdlib>
+#include <cstdint>
+#include <ctime>
+#include <set>
+#include <string>
+
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-id128.h>
+
+#include "bus_reactor.h"
+#include "typed_bus.h"
+#include "unix_listener.h"
+
+/*
+ * dbus_server, dbus_publisher and dbus_listener in one process and one thread, each role keeping its own
+ * connection, all of them in a BusReactor (see bus_reactor.h) instead of one sd_bus_wait loop per connection:
+ * - server: org.nicolas.ServerExample on the user bus, dbus_client works against it
+ * - publisher: org.nicolas.PublisherExample on the user bus, HeartBeat at --rate per second (a timerfd)
+ * - listener: its own user bus connection, counts HeartBeat signals and missed beats, ours or not
+ * - with --system, a system bus connection counting NameOwnerChanged
+ * - with --listen PATH, peer to peer connections on a unix socket served like the user bus one
+ *   (dbus_client --address unix:path=PATH)
+ * Counters are printed every second on stderr, SIGINT/SIGTERM (a signalfd) stops the agent.
+ *
+ * dbus_agent --rate 10 --listen /tmp/agent.sock
+ */
+
+struct AgentOptions {
+    double rate = 1.0;
+    bool system = false;
+    const char *listenPath = nullptr;
+};
+
+struct Agent {
+    BusReactor reactor;
+    AgentOptions options;
+    sd_bus *serverBus = NULL;
+    sd_bus *publisherBus = NULL;
+    sd_bus *listenerBus = NULL;
+    sd_bus *systemBus = NULL;
+    std::set<sd_bus*> peers;
+    int listenFd = -1;
+
+    uint64_t greatings = 0;
+    uint64_t beatIndex = 0;
+    bool listening = false;
+    uint64_t expectedIndex = 0;
+    uint64_t received = 0;
+    uint64_t missed = 0;
+    uint64_t nameChanges = 0;
+};
+
+using GreatingCall = typed_bus::Call<std::string>;
+
+static int method_greating(const GreatingCall& call, const char *name) {
+    Agent *agent = static_cast<Agent*>(call.userdata());
+
+    agent->greatings++;
+    return call.reply(std::string("hello ") + name);
+}
+
+static const sd_bus_vtable server_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        typed_bus::method<method_greating>("Greating", SD_BUS_PARAM(caller_name) SD_BUS_PARAM(response)),
+        SD_BUS_VTABLE_END
+};
+
+static constexpr typed_bus::Signal<uint64_t, int64_t> heartBeat{"HeartBeat"};
+
+static const sd_bus_vtable publisher_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        heartBeat.entry(SD_BUS_PARAM(index) SD_BUS_PARAM(timestamp)),
+        SD_BUS_VTABLE_END
+};
+
+static int on_heart_beat(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    Agent *agent = static_cast<Agent*>(userdata);
+    uint64_t index;
+    int64_t time;
+
+    if(heartBeat.read(m, index, time) <= 0)
+        return 0;
+
+    agent->received++;
+    if(agent->listening && index > agent->expectedIndex)
+        agent->missed += index - agent->expectedIndex;
+    agent->listening = true;
+    if(index >= agent->expectedIndex || index == 0)
+        agent->expectedIndex = index + 1;
+
+    return 0;
+}
+
+static int on_name_owner_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    static_cast<Agent*>(userdata)->nameChanges++;
+    return 0;
+}
+
+/* the timer fires every 1/rate second, expirations counts the ticks we were late for */
+static int on_beat_timer(Agent *agent, int fd) {
+    uint64_t expirations = 0;
+
+    if(read(fd, &expirations, sizeof(expirations)) < 0)
+        return errno == EAGAIN ? 0 : -errno;
+
+    for(uint64_t i = 0; i < expirations; i++) {
+        int r = heartBeat.emit(agent->publisherBus,
+                               "/org/nicolas/PublisherExample",
+                               "org.nicolas.PublisherExample",
+                               agent->beatIndex,
+                               int64_t(std::time(NULL)));
+        /* an error would end run() and every role with it, a dropped beat (ENOBUFS on a congested bus)
+         * is only logged. Only a dead connection stops the agent. */
+        if(r < 0) {
+            std::cerr << "Failed to send signal message: " << strerror(-r) << std::endl;
+            if(sd_bus_is_open(agent->publisherBus) <= 0)
+                return r;
+            break;
+        }
+        agent->beatIndex++;
+    }
+
+    return 0;
+}
+
+static void print_stats(const Agent *agent) {
+    std::cerr << "connections=" << agent->reactor.connections()
+              << " peers=" << agent->peers.size()
+              << " greatings=" << agent->greatings
+              << " sent=" << agent->beatIndex
+              << " received=" << agent->received
+              << " missed=" << agent->missed;
+    if(agent->systemBus)
+        std::cerr << " name_changes=" << agent->nameChanges;
+    std::cerr << std::endl;
+}
+
+static int on_stats_timer(Agent *agent, int fd) {
+    uint64_t expirations;
+
+    if(read(fd, &expirations, sizeof(expirations)) >= 0)
+        print_stats(agent);
+    return 0;
+}
+
+static int on_peer_disconnected(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    Agent *agent = static_cast<Agent*>(userdata);
+    sd_bus *bus = sd_bus_message_get_bus(m);
+
+    /* the reactor keeps its own reference until the end of the iteration */
+    if(agent->peers.erase(bus) > 0) {
+        agent->reactor.remove(bus);
+        sd_bus_unref(bus);
+    }
+
+    return 0;
+}
+
+static int add_peer(Agent *agent, int fd) {
+    sd_bus *bus = NULL;
+    sd_id128_t id;
+    int r;
+
+    r = sd_bus_new(&bus);
+    if(r < 0) {
+        close(fd);
+        return r;
+    }
+
+    /* once set the fd belongs to the bus, not when sd_bus_set_fd failed */
+    r = sd_bus_set_fd(bus, fd, fd);
+    if(r < 0) {
+        close(fd);
+        sd_bus_unref(bus);
+        return r;
+    }
+
+    r = sd_id128_randomize(&id);
+    if(r >= 0)
+        r = sd_bus_set_server(bus, 1, id);
+    if(r >= 0)
+        r = sd_bus_add_object_vtable(bus, NULL, "/org/nicolas/ServerExample", "org.nicolas.ServerExample", server_vtable, agent);
+    if(r >= 0)
+        r = sd_bus_match_signal(bus, NULL, NULL, "/org/freedesktop/DBus/Local", "org.freedesktop.DBus.Local", "Disconnected",
+                                on_peer_disconnected, agent);
+    if(r >= 0)
+        r = sd_bus_start(bus);
+    if(r >= 0)
+        r = agent->reactor.add(bus);
+    if(r < 0) {
+        sd_bus_unref(bus);
+        return r;
+    }
+
+    agent->peers.insert(bus);
+    return 0;
+}
+
+static int on_connection(Agent *agent, int fd) {
+    int peerFd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if(peerFd < 0) {
+        if(errno != EAGAIN && errno != EINTR)
+            std::cerr << "Failed to accept peer connection: " << strerror(errno) << std::endl;
+        return 0;
+    }
+
+    int r = add_peer(agent, peerFd);
+    if(r < 0)
+        std::cerr << "Failed to setup peer connection: " << strerror(-r) << std::endl;
+
+    return 0;
+}
+
+static int timer_fd(uint64_t periodNsec) {
+    struct itimerspec spec = {};
+
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(fd < 0)
+        return -errno;
+
+    spec.it_interval.tv_sec = time_t(periodNsec / 1000000000);
+    spec.it_interval.tv_nsec = long(periodNsec % 1000000000);
+    spec.it_value = spec.it_interval;
+    if(timerfd_settime(fd, 0, &spec, NULL) < 0) {
+        int r = -errno;
+        close(fd);
+        return r;
+    }
+
+    return fd;
+}
+
+static int setup_roles(Agent *agent) {
+    int r;
+
+    r = sd_bus_open_user(&agent->serverBus);
+    if(r >= 0)
+        r = sd_bus_add_object_vtable(agent->serverBus, NULL, "/org/nicolas/ServerExample", "org.nicolas.ServerExample",
+                                     server_vtable, agent);
+    if(r >= 0)
+        r = sd_bus_request_name(agent->serverBus, "org.nicolas.ServerExample", 0);
+    if(r >= 0)
+        r = agent->reactor.add(agent->serverBus);
+    if(r < 0) {
+        std::cerr << "Failed to setup the server role: " << strerror(-r) << std::endl;
+        return r;
+    }
+
+    r = sd_bus_open_user(&agent->publisherBus);
+    if(r >= 0)
+        r = sd_bus_add_object_vtable(agent->publisherBus, NULL, "/org/nicolas/PublisherExample", "org.nicolas.PublisherExample",
+                                     publisher_vtable, agent);
+    if(r >= 0)
+        r = sd_bus_request_name(agent->publisherBus, "org.nicolas.PublisherExample", 0);
+    if(r >= 0)
+        r = agent->reactor.add(agent->publisherBus);
+    if(r < 0) {
+        std::cerr << "Failed to setup the publisher role: " << strerror(-r) << std::endl;
+        return r;
+    }
+
+    r = sd_bus_open_user(&agent->listenerBus);
+    if(r >= 0)
+        r = sd_bus_match_signal(agent->listenerBus,
+                                NULL,
+                                "org.nicolas.PublisherExample",
+                                "/org/nicolas/PublisherExample",
+                                "org.nicolas.PublisherExample",
+                                "HeartBeat",
+                                on_heart_beat,
+                                agent);
+    if(r >= 0)
+        r = agent->reactor.add(agent->listenerBus);
+    if(r < 0) {
+        std::cerr << "Failed to setup the listener role: " << strerror(-r) << std::endl;
+        return r;
+    }
+
+    if(agent->options.system) {
+        r = sd_bus_open_system(&agent->systemBus);
+        if(r >= 0)
+            r = sd_bus_match_signal(agent->systemBus,
+                                    NULL,
+                                    "org.freedesktop.DBus",
+                                    "/org/freedesktop/DBus",
+                                    "org.freedesktop.DBus",
+                                    "NameOwnerChanged",
+                                    on_name_owner_changed,
+                                    agent);
+        if(r >= 0)
+            r = agent->reactor.add(agent->systemBus);
+        if(r < 0) {
+            std::cerr << "Failed to connect to system bus: " << strerror(-r) << std::endl;
+            return r;
+        }
+    }
+
+    if(agent->options.listenPath) {
+        agent->listenFd = listen_unix(agent->options.listenPath);
+        r = agent->listenFd;
+        if(r >= 0)
+            r = agent->reactor.addFd(agent->listenFd, EPOLLIN, [agent](uint32_t) { return on_connection(agent, agent->listenFd); });
+        if(r < 0) {
+            std::cerr << "Failed to serve peer connections on " << agent->options.listenPath << ": " << strerror(-r) << std::endl;
+            return r;
+        }
+    }
+
+    return 0;
+}
+
+static bool parse_options(int argc, char *argv[], AgentOptions& options) {
+    static const struct option longOptions[] = {
+        {"rate",   required_argument, NULL, 'r'},
+        {"system", no_argument,       NULL, 's'},
+        {"listen", required_argument, NULL, 'l'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+
+    while((c = getopt_long(argc, argv, "r:sl:", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'r':
+            options.rate = strtod(optarg, NULL);
+            break;
+        case 's':
+            options.system = true;
+            break;
+        case 'l':
+            options.listenPath = optarg;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return optind == argc && options.rate > 0;
+}
+
+int main(int argc, char *argv[]) {
+    Agent agent;
+    int beatFd = -1, statsFd = -1, signalFd = -1;
+    sigset_t mask;
+    int r;
+
+    if(!parse_options(argc, argv, agent.options)) {
+        std::cerr << "usage: " << argv[0] << " [--rate BEATS_PER_SECOND] [--system] [--listen SOCKET_PATH]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    r = agent.reactor.open();
+    if(r < 0) {
+        std::cerr << "Failed to create epoll set: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+
+    r = setup_roles(&agent);
+    if(r < 0)
+        goto finish;
+
+    beatFd = r = timer_fd(std::max<uint64_t>(1000, uint64_t(1e9 / agent.options.rate)));
+    if(r >= 0)
+        r = agent.reactor.addFd(beatFd, EPOLLIN, [&agent, beatFd](uint32_t) { return on_beat_timer(&agent, beatFd); });
+    if(r >= 0)
+        statsFd = r = timer_fd(1000000000);
+    if(r >= 0)
+        r = agent.reactor.addFd(statsFd, EPOLLIN, [&agent, statsFd](uint32_t) { return on_stats_timer(&agent, statsFd); });
+    if(r >= 0) {
+        signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        r = signalFd < 0 ? -errno : 0;
+    }
+    if(r >= 0)
+        r = agent.reactor.addFd(signalFd, EPOLLIN, [&agent](uint32_t) { agent.reactor.exit(0); return 0; });
+    if(r < 0) {
+        std::cerr << "Failed to setup timers and signals: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+
+    r = agent.reactor.run();
+    if(r < 0)
+        std::cerr << "Failed to run reactor: " << strerror(-r) << std::endl;
+    print_stats(&agent);
+
+finish:
+    for(sd_bus *peer : agent.peers)
+        sd_bus_flush_close_unref(peer);
+    sd_bus_flush_close_unref(agent.serverBus);
+    sd_bus_flush_close_unref(agent.publisherBus);
+    sd_bus_flush_close_unref(agent.listenerBus);
+    sd_bus_flush_close_unref(agent.systemBus);
+    for(int fd : {beatFd, statsFd, signalFd, agent.listenFd})
+        if(fd >= 0)
+            close(fd);
+    if(agent.listenFd >= 0)
+        unlink(agent.options.listenPath);
+
+    return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
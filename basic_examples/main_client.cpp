@@ -1,18 +1,685 @@
 #include <iostream>
+#include <iomanip>
+#include <csignal>
 #include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
 
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <systemd/sd-bus.h>
 
-int main() {
+#include "bulk_transfer.h"
+#include "bus_coro.h"
+#include "latency_histogram.h"
+#include "unix_listener.h"
+
+/*
+ * Without arguments, this does a single blocking call to Greating and print the response.
+ *
+ * With --pipeline N, we keep N calls in flight using sd_bus_call_method_async instead of waiting
+ * for each reply before sending the next request. This runs for --duration seconds (default 10)
+ * or until --count calls completed, then print calls/s and round trip latency percentiles.
+ * dbus_client --pipeline 1 gives the strict request/response baseline to compare against:
+ * dbus_client --pipeline 1 --duration 5
+ * dbus_client --pipeline 64 --duration 5
+ *
+ * With --coroutines N, the same load comes from N coroutines (bus_coro.h) each doing call, wait for the reply,
+ * call again, as straight-line code, all of them on this thread. It should match --pipeline N, the difference
+ * is the cost of the coroutine frames and awaiters:
+ * dbus_client --coroutines 64 --duration 5
+ *
+ * With --stdin, we read caller names from stdin, one per line, and write the Greating responses to stdout
+ * in the same order, one per line, all on this one connection with up to --pipeline calls in flight
+ * (default 64). Scripts pay for connect, auth and Hello once instead of once per call:
+ * cat names.txt | dbus_client --stdin
+ * --serve PATH does the same for every client connecting to the unix socket PATH, until SIGINT/SIGTERM:
+ * dbus_client --serve /tmp/client.sock & echo patate | socat - UNIX-CONNECT:/tmp/client.sock
+ *
+ * With --bulk SIZE, we send --count buffers (default 10) of SIZE bytes to the server, either as a sealed memfd
+ * passed as unix fd (--bulk-mode memfd, the default) or copied in the message as "ay" (--bulk-mode array),
+ * check the checksum the server computed, and print MB/s and the cpu time this process used per GB.
+ *
+ * With --address, we connect directly to a dbus_server started with --listen instead of going through
+ * the user bus (e.g. --address unix:path=/tmp/server_example.sock). All the modes above work the same way.
+ */
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    unsigned pipeline = 0;
+    unsigned coroutines = 0;
+    uint64_t count = 0;
+    double duration = 10.0;
+    const char *name = "client";
+    uint64_t bulkSize = 0;
+    bool bulkArray = false;
+    const char *address = nullptr;
+    bool stdinBatch = false;
+    const char *servePath = nullptr;
+};
+
+struct Pipeline;
+
+struct PendingCall {
+    Pipeline *pipeline;
+    Clock::time_point start;
+};
+
+struct Pipeline {
+    sd_bus *bus;
+    const Options *options;
+    Clock::time_point deadline;
+    std::vector<PendingCall> calls;
+    LatencyHistogram latency;
+    uint64_t issued = 0;
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    unsigned inFlight = 0;
+    int lastError = 0;
+};
+
+static int issue_call(PendingCall *call);
+
+static bool can_issue(const Pipeline *p) {
+    if(p->options->count > 0)
+        return p->issued < p->options->count;
+    return Clock::now() < p->deadline;
+}
+
+static int on_greating_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    PendingCall *call = static_cast<PendingCall*>(userdata);
+    Pipeline *p = call->pipeline;
+
+    p->latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - call->start).count());
+    p->completed++;
+    p->inFlight--;
+
+    if(sd_bus_message_is_method_error(m, NULL)) {
+        /* only print the first one, we do not want to flood the terminal at 100k calls/s */
+        if(p->errors++ == 0)
+            std::cerr << "Method call failed: " << sd_bus_message_get_error(m)->message << std::endl;
+    }
+
+    if(can_issue(p)) {
+        int r = issue_call(call);
+        if(r < 0)
+            p->lastError = r;
+    }
+
+    return 0;
+}
+
+static int issue_call(PendingCall *call) {
+    Pipeline *p = call->pipeline;
+
+    call->start = Clock::now();
+    int r = sd_bus_call_method_async(p->bus,
+                                     NULL,                                  /* floating slot, owned by the bus */
+                                     "org.nicolas.ServerExample",           /* service to contact */
+                                     "/org/nicolas/ServerExample",          /* object path */
+                                     "org.nicolas.ServerExample",           /* interface name */
+                                     "Greating",                            /* method name */
+                                     on_greating_reply,                     /* called with the reply or error */
+                                     call,                                  /* userdata */
+                                     "s",                                   /* input signature */
+                                     p->options->name);                     /* first argument */
+    if(r < 0) {
+        std::cerr << "Failed to issue async method call: " << strerror(-r) << std::endl;
+        return r;
+    }
+
+    p->issued++;
+    p->inFlight++;
+    return r;
+}
+
+static void print_results(const Pipeline& p, double elapsed) {
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << " calls: " << p.completed
+              << " errors: " << p.errors << " elapsed: " << std::setprecision(3) << elapsed << " s" << std::endl;
+    std::cout << std::setprecision(1);
+    std::cout << "throughput: " << double(p.completed) / elapsed << " calls/s" << std::endl;
+    std::cout << "latency (us): p50=" << p.latency.percentile(50) / 1e3
+              << " p90=" << p.latency.percentile(90) / 1e3
+              << " p99=" << p.latency.percentile(99) / 1e3
+              << " p999=" << p.latency.percentile(99.9) / 1e3
+              << " max=" << p.latency.max() / 1e3 << std::endl;
+}
+
+static int run_pipelined(sd_bus *bus, const Options& options) {
+    Pipeline p;
+    int r = 0;
+
+    p.bus = bus;
+    p.options = &options;
+    p.calls.resize(options.pipeline, PendingCall{&p, {}});
+
+    Clock::time_point begin = Clock::now();
+    p.deadline = begin + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+
+    for(PendingCall& call : p.calls) {
+        if(!can_issue(&p))
+            break;
+        r = issue_call(&call);
+        if(r < 0)
+            return r;
+    }
+
+    while(p.inFlight > 0 && p.lastError == 0) {
+        r = sd_bus_process(bus, NULL);
+        if (r < 0) {
+            std::cerr << "Failed to process bus: " << strerror(-r) << std::endl;
+            return r;
+        }
+        if (r > 0)
+            continue;
+
+        r = sd_bus_wait(bus, (uint64_t) -1);
+        if (r < 0 && r != -EINTR) {
+            std::cerr << "Failed to wait on bus: " << strerror(-r) << std::endl;
+            return r;
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    std::cout << "pipeline depth: " << options.pipeline;
+    print_results(p, elapsed);
+    return p.lastError < 0 ? p.lastError : 0;
+}
+
+/* one of the --coroutines callers: the pipelined loop above, without the callbacks */
+static bus_coro::Task<void> greating_loop(bus_coro::Scheduler& scheduler, Pipeline& p) {
+    while(p.lastError == 0 && can_issue(&p)) {
+        Clock::time_point start = Clock::now();
+
+        p.issued++;
+        bus_coro::Message reply = co_await scheduler.call("org.nicolas.ServerExample", "/org/nicolas/ServerExample",
+                                                          "org.nicolas.ServerExample", "Greating", p.options->name);
+        if(!reply.get()) {
+            std::cerr << "Failed to issue async method call: " << reply.errorText() << std::endl;
+            p.lastError = reply.error();
+            break;
+        }
+
+        p.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+        p.completed++;
+        if(reply.error() < 0 && p.errors++ == 0)
+            std::cerr << "Method call failed: " << reply.errorText() << std::endl;
+    }
+}
+
+static int run_coroutines(sd_bus *bus, const Options& options) {
+    bus_coro::Scheduler scheduler(bus);
+    Pipeline p;
+
+    p.bus = bus;
+    p.options = &options;
+
+    Clock::time_point begin = Clock::now();
+    p.deadline = begin + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(options.duration));
+
+    for(unsigned i = 0; i < options.coroutines; i++)
+        scheduler.spawn(greating_loop(scheduler, p));
+    int r = scheduler.run();
+    if(r < 0) {
+        std::cerr << "Failed to process bus: " << strerror(-r) << std::endl;
+        return r;
+    }
+
+    double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+
+    std::cout << "coroutines: " << options.coroutines;
+    print_results(p, elapsed);
+    return p.lastError < 0 ? p.lastError : 0;
+}
+
+static double cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+         + double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static int run_bulk(sd_bus *bus, const Options& options) {
+    uint64_t count = options.count ? options.count : 10;
+    LatencyHistogram latency;
+    int r = 0;
+
+    double cpuBegin = cpu_seconds();
+    Clock::time_point begin = Clock::now();
+    for(uint64_t i = 0; i < count && r >= 0; i++) {
+        Clock::time_point start = Clock::now();
+        r = bulk_transfer_call(bus, options.bulkArray, options.bulkSize, i);
+        latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+    double cpu = cpu_seconds() - cpuBegin;
+    if(r < 0)
+        return r;
+
+    double gigabytes = double(count * options.bulkSize) / 1e9;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "bulk " << (options.bulkArray ? "array" : "memfd") << ": " << count << " x " << options.bulkSize
+              << " bytes in " << std::setprecision(3) << elapsed << " s" << std::endl;
+    std::cout << std::setprecision(1);
+    std::cout << "throughput: " << gigabytes * 1e3 / elapsed << " MB/s, client cpu: "
+              << std::setprecision(3) << cpu / gigabytes << " s/GB" << std::endl;
+    std::cout << "transfer time (ms): p50=" << latency.percentile(50) / 1e6
+              << " p99=" << latency.percentile(99) / 1e6 << " max=" << latency.max() / 1e6 << std::endl;
+
+    return 0;
+}
+
+/*
+ * --stdin and --serve: one Greating call per input line, the caller name being the line, reusing this
+ * connection for all of them. Up to --pipeline calls (default 64) are in flight, replies are written back
+ * in input order, one line each: the response, or "error: " and the error message.
+ * --serve sockets are nonblocking and polled for POLLOUT while replies wait in their output buffer, so a client
+ * that stops reading only stalls itself. Above batchOutputLimit bytes waiting, we stop reading its input.
+ */
+struct Batch;
+
+struct BatchRequest {
+    Batch *batch;
+    bool done = false;
+    std::string text;
+};
+
+/* stdin/stdout, or one client of the --serve socket */
+struct BatchSession {
+    int inFd;
+    int outFd;
+    bool socket;
+    bool eof = false;
+    bool broken = false;
+    std::string input;
+    std::deque<BatchRequest> pending;   /* deque: pointers stay valid while we push and pop at the ends */
+    std::string output;                 /* replies outFd had no room for yet */
+};
+
+static const size_t batchOutputLimit = 1 << 20;
+
+struct Batch {
+    sd_bus *bus;
+    unsigned limit;
+    unsigned inFlight = 0;
+    std::list<BatchSession> sessions;
+};
+
+static int on_batch_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    BatchRequest *request = static_cast<BatchRequest*>(userdata);
+    const char *response;
+
+    request->batch->inFlight--;
+    request->done = true;
+    if(sd_bus_message_is_method_error(m, NULL))
+        request->text = std::string("error: ") + sd_bus_message_get_error(m)->message;
+    else if(sd_bus_message_read(m, "s", &response) > 0)
+        request->text = response;
+    else
+        request->text = "error: unexpected reply";
+
+    return 0;
+}
+
+static void batch_issue(Batch *batch, BatchSession *session, const std::string& name) {
+    session->pending.push_back(BatchRequest{batch});
+    BatchRequest *request = &session->pending.back();
+
+    int r = sd_bus_call_method_async(batch->bus, NULL,
+                                     "org.nicolas.ServerExample", "/org/nicolas/ServerExample",
+                                     "org.nicolas.ServerExample", "Greating",
+                                     on_batch_reply, request, "s", name.c_str());
+    if(r < 0) {
+        /* e.g. a line that is not valid UTF-8, still answered in order */
+        request->done = true;
+        request->text = std::string("error: ") + strerror(-r);
+    }
+    else
+        batch->inFlight++;
+}
+
+/* issue calls for the complete lines we have, as long as the pipeline has room */
+static void batch_consume(Batch *batch, BatchSession *session) {
+    size_t begin = 0, end;
+
+    while(batch->inFlight < batch->limit && (end = session->input.find('\n', begin)) != std::string::npos) {
+        batch_issue(batch, session, session->input.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    session->input.erase(0, begin);
+
+    /* last line without newline */
+    if(session->eof && !session->input.empty() && batch->inFlight < batch->limit) {
+        batch_issue(batch, session, session->input);
+        session->input.clear();
+    }
+}
+
+/* write the replies that are done, up to the first one still in flight, as much as outFd takes without blocking */
+static void batch_flush(BatchSession *session) {
+    std::string& out = session->output;
+    size_t written = 0;
+
+    while(!session->pending.empty() && session->pending.front().done) {
+        out += session->pending.front().text;
+        out += '\n';
+        session->pending.pop_front();
+    }
+
+    while(written < out.size() && !session->broken) {
+        ssize_t n = session->socket ? send(session->outFd, out.data() + written, out.size() - written, MSG_NOSIGNAL)
+                                    : write(session->outFd, out.data() + written, out.size() - written);
+        if(n < 0 && errno == EINTR)
+            continue;
+        /* the rest goes out on POLLOUT */
+        if(n < 0 && errno == EAGAIN)
+            break;
+        if(n <= 0)
+            session->broken = true;
+        else
+            written += size_t(n);
+    }
+    if(session->broken)
+        out.clear();
+    else
+        out.erase(0, written);
+}
+
+static bool batch_finished(const BatchSession& session) {
+    return (session.eof || session.broken) && session.pending.empty()
+           && ((session.input.empty() && session.output.empty()) || session.broken);
+}
+
+static void batch_read(BatchSession *session) {
+    char buffer[65536];
+
+    ssize_t n = read(session->inFd, buffer, sizeof(buffer));
+    if(n < 0 && (errno == EINTR || errno == EAGAIN))
+        return;
+    if(n <= 0) {
+        session->eof = true;
+        session->broken |= n < 0;
+        return;
+    }
+    session->input.append(buffer, size_t(n));
+}
+
+static int run_batch(sd_bus *bus, const Options& options) {
+    Batch batch;
+    std::vector<struct pollfd> pfds;
+    int listenFd = -1, signalFd = -1;
+    sigset_t mask;
+    int r = 0;
+
+    batch.bus = bus;
+    batch.limit = options.pipeline > 0 ? options.pipeline : 64;
+
+    if(options.servePath) {
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        signalFd = signalfd(-1, &mask, SFD_CLOEXEC);
+        listenFd = signalFd < 0 ? -errno : listen_unix(options.servePath);
+        if(listenFd < 0) {
+            std::cerr << "Failed to serve on " << options.servePath << ": " << strerror(-listenFd) << std::endl;
+            if(signalFd >= 0)
+                close(signalFd);
+            return listenFd;
+        }
+    }
+    else
+        batch.sessions.push_back(BatchSession{STDIN_FILENO, STDOUT_FILENO, false});
+
+    for(;;) {
+        do
+            r = sd_bus_process(bus, NULL);
+        while(r > 0);
+        if(r < 0) {
+            std::cerr << "Failed to process bus: " << strerror(-r) << std::endl;
+            break;
+        }
+
+        for(auto it = batch.sessions.begin(); it != batch.sessions.end();) {
+            batch_consume(&batch, &*it);
+            batch_flush(&*it);
+            if(!batch_finished(*it)) {
+                ++it;
+                continue;
+            }
+            if(it->socket)
+                close(it->inFd);
+            it = batch.sessions.erase(it);
+        }
+        if(!options.servePath && batch.sessions.empty())
+            break;
+
+        /* the bus first, then the signal and listening fds, then the sessions we can read from or write to */
+        uint64_t deadline = UINT64_MAX;
+        int timeoutMs = -1;
+        if(sd_bus_get_timeout(bus, &deadline) > 0 && deadline != UINT64_MAX) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            uint64_t now = uint64_t(ts.tv_sec) * 1000000 + uint64_t(ts.tv_nsec) / 1000;
+            timeoutMs = deadline > now ? int((deadline - now + 999) / 1000) : 0;
+        }
+        pfds.assign(1, {sd_bus_get_fd(bus), short(sd_bus_get_events(bus)), 0});
+        if(options.servePath) {
+            pfds.push_back({signalFd, POLLIN, 0});
+            pfds.push_back({listenFd, POLLIN, 0});
+        }
+        std::vector<BatchSession*> polled;
+        for(BatchSession& session : batch.sessions) {
+            if(session.broken)
+                continue;
+            /* stdin and stdout are two fds, a socket is one fd for both directions */
+            if(!session.eof && batch.inFlight < batch.limit && session.output.size() < batchOutputLimit) {
+                pfds.push_back({session.inFd, POLLIN, 0});
+                polled.push_back(&session);
+            }
+            if(!session.output.empty()) {
+                pfds.push_back({session.outFd, POLLOUT, 0});
+                polled.push_back(&session);
+            }
+        }
+
+        r = poll(pfds.data(), pfds.size(), timeoutMs);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r < 0) {
+            r = -errno;
+            std::cerr << "Failed to wait: " << strerror(-r) << std::endl;
+            break;
+        }
+
+        size_t first = 1;
+        if(options.servePath) {
+            first = 3;
+            if(pfds[1].revents) {
+                r = 0;
+                break;
+            }
+            if(pfds[2].revents) {
+                int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if(fd >= 0)
+                    batch.sessions.push_back(BatchSession{fd, fd, true});
+                else if(errno != EINTR && errno != EAGAIN)
+                    std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
+            }
+        }
+        for(size_t i = 0; i < polled.size(); i++) {
+            const struct pollfd& pfd = pfds[first + i];
+            if(!pfd.revents)
+                continue;
+            /* on POLLHUP/POLLERR the read or write reports the error */
+            if(pfd.events & POLLIN)
+                batch_read(polled[i]);
+            else
+                batch_flush(polled[i]);
+        }
+    }
+
+    /* with --serve, calls still in flight are dropped along with their clients */
+    for(BatchSession& session : batch.sessions)
+        if(session.socket)
+            close(session.inFd);
+    batch.sessions.clear();
+    sd_bus_close(bus);
+    if(listenFd >= 0) {
+        close(listenFd);
+        unlink(options.servePath);
+    }
+    if(signalFd >= 0)
+        close(signalFd);
+
+    return r < 0 ? r : 0;
+}
+
+/* peer to peer connection: no bus client, so no Hello, and the server ignores the destination */
+static int open_peer(const char *address, sd_bus **ret) {
+    sd_bus *bus = NULL;
+    int r;
+
+    r = sd_bus_new(&bus);
+    if(r < 0)
+        return r;
+
+    r = sd_bus_set_address(bus, address);
+    if(r >= 0)
+        r = sd_bus_start(bus);
+    if(r < 0) {
+        sd_bus_unref(bus);
+        return r;
+    }
+
+    *ret = bus;
+    return 0;
+}
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [--pipeline N | --coroutines N] [--duration SECONDS | --count CALLS] [--name CALLER]\n"
+              << "       " << prog << " --stdin | --serve SOCKET_PATH [--pipeline N]\n"
+              << "       " << prog << " --bulk BYTES [--bulk-mode memfd|array] [--count TRANSFERS]\n"
+              << "       add --address ADDRESS to connect directly to dbus_server --listen" << std::endl;
+}
+
+static bool parse_options(int argc, char *argv[], Options& options) {
+    static const struct option longOptions[] = {
+        {"pipeline", required_argument, NULL, 'p'},
+        {"coroutines", required_argument, NULL, 'k'},
+        {"duration", required_argument, NULL, 'd'},
+        {"count",    required_argument, NULL, 'c'},
+        {"name",     required_argument, NULL, 'n'},
+        {"bulk",      required_argument, NULL, 'b'},
+        {"bulk-mode", required_argument, NULL, 'm'},
+        {"address",   required_argument, NULL, 'a'},
+        {"stdin",     no_argument,       NULL, 'i'},
+        {"serve",     required_argument, NULL, 'S'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+
+    while((c = getopt_long(argc, argv, "p:k:d:c:n:b:m:a:iS:h", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'p':
+            options.pipeline = unsigned(strtoul(optarg, NULL, 10));
+            break;
+        case 'k':
+            options.coroutines = unsigned(strtoul(optarg, NULL, 10));
+            break;
+        case 'd':
+            options.duration = strtod(optarg, NULL);
+            break;
+        case 'c':
+            options.count = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            options.name = optarg;
+            break;
+        case 'b':
+            options.bulkSize = strtoull(optarg, NULL, 0);
+            break;
+        case 'a':
+            options.address = optarg;
+            break;
+        case 'i':
+            options.stdinBatch = true;
+            break;
+        case 'S':
+            options.servePath = optarg;
+            break;
+        case 'm':
+            if(std::string(optarg) == "array")
+                options.bulkArray = true;
+            else if(std::string(optarg) != "memfd")
+                return false;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return optind == argc;
+}
+
+int main(int argc, char *argv[]) {
     sd_bus_error error = SD_BUS_ERROR_NULL;
     sd_bus_message *m = NULL;
     sd_bus *bus = NULL;
     const char *response;
+    Options options;
     int r;
 
-    r = sd_bus_open_user(&bus);
-    if (r < 0) {
-        std::cerr << "Failed to connect to user bus: " << strerror(-r) << std::endl;
+    if(!parse_options(argc, argv, options)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(options.address) {
+        r = open_peer(options.address, &bus);
+        if (r < 0) {
+            std::cerr << "Failed to connect to " << options.address << ": " << strerror(-r) << std::endl;
+            goto finish;
+        }
+    }
+    else {
+        r = sd_bus_open_user(&bus);
+        if (r < 0) {
+            std::cerr << "Failed to connect to user bus: " << strerror(-r) << std::endl;
+            goto finish;
+        }
+    }
+
+    if(options.bulkSize > 0) {
+        r = run_bulk(bus, options);
+        goto finish;
+    }
+
+    if(options.stdinBatch || options.servePath) {
+        r = run_batch(bus, options);
+        goto finish;
+    }
+
+    if(options.pipeline > 0) {
+        r = run_pipelined(bus, options);
+        goto finish;
+    }
+
+    if(options.coroutines > 0) {
+        r = run_coroutines(bus, options);
         goto finish;
     }
 
@@ -25,7 +692,7 @@ int main() {
                             &error,                               /* object to return error in */
                             &m,                                   /* return message on success */
                             "s",                                 /* input signature */
-                            "client");                           /* first argument */
+                            options.name);                       /* first argument */
     if (r < 0) {
         std::cerr << "Failed to issue method call: " << error.message << std::endl;
         goto finish;
@@ -37,7 +704,7 @@ int main() {
         std::cerr << "Failed to parse response message: " << strerror(-r) << std::endl;
         goto finish;
     }
-    
+
     std::cout << "response: " << response << std::endl;
 
 finish:
@@ -1,68 +1,447 @@
 #include <iostream>
 #include <cstdlib>
+#include <csignal>
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <ctime>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
 
+#include <errno.h>
+#include <getopt.h>
 #include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
 
-std::atomic_bool stop_process = false;
+#include "latency_histogram.h"
+#include "spsc_ring.h"
 
-void sighandler(int signum) {
-    stop_process = true;
+/*
+ * The signal callbacks run in the bus thread and must stay cheap: they only check the beat index
+ * and push a small record in a lock-free ring buffer. A separate thread drains the ring, formats
+ * the records and writes them out, flushing only when the ring is empty.
+ * When the output is slower than the signals (slow terminal, disk...), the ring fills up and
+ * we count overflows instead of blocking the bus connection.
+ *
+ * Beat indexes are checked on reception to count missed beats (index jumps forward),
+ * reordered or duplicated ones (index goes back) and publisher restarts (index back to 0).
+ * The indexes we jumped over are kept as ranges, a late beat filling one is no longer missed, only reordered.
+ * Only the latest maxHoles ranges are kept, beats arriving later than that stay counted as missed.
+ * Counters are printed every --interval seconds (default 1) on stderr, --quiet skips printing every beat.
+ *
+ * HeartBeatPrecise signals (dbus_publisher --precise) carry the send time in nanoseconds: the callback takes
+ * the receive time on the same clock, CLOCK_MONOTONIC by default which is only meaningful when both run on
+ * the same host, or CLOCK_REALTIME with --realtime (then the clocks have to be synchronized).
+ * The consumer thread records the one-way latency in a histogram, and prints the percentiles of the last
+ * interval with the counters, so broker jitter under load shows up as it happens, then the whole run at exit.
+ *
+ * With --topic NAME we only follow that topic of dbus_publisher --topics: the match rule has arg0='NAME',
+ * so the broker only sends us TopicHeartBeat signals whose first argument is NAME, the other topics never
+ * wake us up. --client-filter subscribes to every TopicHeartBeat instead and drops the other topics here,
+ * counted as filtered, which is what a plain member match costs:
+ * dbus_listener --quiet --topic topic3
+ */
+
+struct BeatRecord {
+    uint64_t heartBeatIndex;
+    int64_t time;
+    uint64_t sentNs;        /* 0 for HeartBeat, which has no precise timestamp */
+    uint64_t receivedNs;
+};
+
+struct ListenerStats {
+    std::atomic<uint64_t> received = 0;
+    std::atomic<uint64_t> missed = 0;
+    std::atomic<uint64_t> reordered = 0;
+    std::atomic<uint64_t> restarts = 0;
+    std::atomic<uint64_t> overflows = 0;
+    std::atomic<uint64_t> filtered = 0;
+};
+
+struct ListenerOptions {
+    bool quiet = false;
+    bool realtime = false;
+    double interval = 1.0;
+    const char *topic = nullptr;
+    bool clientFilter = false;
+};
+
+struct Listener {
+    SpscRing<BeatRecord, 65536> ring;
+    ListenerStats stats;
+    ListenerOptions options;
+    bool started = false;
+    uint64_t expectedIndex = 0;
+    std::map<uint64_t, uint64_t> holes;     /* [first, end) of missed indexes, bus thread only */
+    std::atomic_bool stopping = false;
+};
+
+static const size_t maxHoles = 4096;
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000u + uint64_t(ts.tv_nsec);
+}
+
+static void trim_holes(Listener *listener) {
+    while(listener->holes.size() > maxHoles)
+        listener->holes.erase(listener->holes.begin());
+}
+
+/* true when index was counted as missed, it is not anymore */
+static bool fill_hole(Listener *listener, uint64_t index) {
+    auto it = listener->holes.upper_bound(index);
+    if(it == listener->holes.begin())
+        return false;
+    --it;
+
+    uint64_t first = it->first, end = it->second;
+    if(index >= end)
+        return false;
+
+    listener->holes.erase(it);
+    if(first < index)
+        listener->holes.emplace(first, index);
+    if(index + 1 < end)
+        listener->holes.emplace(index + 1, end);
+    trim_holes(listener);
+    return true;
+}
+
+/* bus thread, only relaxed counters and one ring push per beat */
+static void onBeat(Listener *listener, uint64_t heartBeatIndex, int64_t time, uint64_t sentNs = 0, uint64_t receivedNs = 0) {
+    ListenerStats& stats = listener->stats;
+
+    stats.received.fetch_add(1, std::memory_order_relaxed);
+
+    if(!listener->started)
+        listener->started = true;
+    else if(heartBeatIndex == 0 && listener->expectedIndex > 0) {
+        stats.restarts.fetch_add(1, std::memory_order_relaxed);
+        listener->holes.clear();
+    }
+    else if(heartBeatIndex > listener->expectedIndex) {
+        stats.missed.fetch_add(heartBeatIndex - listener->expectedIndex, std::memory_order_relaxed);
+        listener->holes.emplace(listener->expectedIndex, heartBeatIndex);
+        trim_holes(listener);
+    }
+    else if(heartBeatIndex < listener->expectedIndex) {
+        stats.reordered.fetch_add(1, std::memory_order_relaxed);
+        if(fill_hole(listener, heartBeatIndex))
+            stats.missed.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    /* a late beat does not move the expected index back */
+    if(heartBeatIndex >= listener->expectedIndex || heartBeatIndex == 0)
+        listener->expectedIndex = heartBeatIndex + 1;
+
+    if(!listener->ring.try_push(BeatRecord{heartBeatIndex, time, sentNs, receivedNs}))
+        stats.overflows.fetch_add(1, std::memory_order_relaxed);
 }
 
 int signalCallback(sd_bus_message *msg, void *userData, sd_bus_error *err) {
     uint64_t heartBeatIndex;
     int64_t time;
-    time_t t;
-    
+
     int r = sd_bus_message_read(msg, "tx", &heartBeatIndex, &time);
-    if(r >= 0) {
-        t = time;
-        //ctime use internal array, not thread safe!!!
-        std::cout << "received heart beat: index=" << heartBeatIndex << " " << ctime(&t) << std::endl;
-    }
-    else {
+    if(r >= 0)
+        onBeat(static_cast<Listener*>(userData), heartBeatIndex, time);
+    else
         std::cerr << "Failed to read signal message" << std::endl;
+
+    return 1;
+}
+
+int batchSignalCallback(sd_bus_message *msg, void *userData, sd_bus_error *err) {
+    uint64_t heartBeatIndex;
+    int64_t time;
+
+    int r = sd_bus_message_enter_container(msg, SD_BUS_TYPE_ARRAY, "(tx)");
+    while(r > 0) {
+        r = sd_bus_message_read(msg, "(tx)", &heartBeatIndex, &time);
+        if(r > 0)
+            onBeat(static_cast<Listener*>(userData), heartBeatIndex, time);
     }
-    
+    if(r < 0)
+        std::cerr << "Failed to read signal message" << std::endl;
+
+    return 1;
+}
+
+/* TopicHeartBeat(s topic, t index, x timestamp), other topics only get here with --client-filter */
+int topicSignalCallback(sd_bus_message *msg, void *userData, sd_bus_error *err) {
+    Listener *listener = static_cast<Listener*>(userData);
+    const char *topic;
+    uint64_t heartBeatIndex;
+    int64_t time;
+
+    int r = sd_bus_message_read(msg, "stx", &topic, &heartBeatIndex, &time);
+    if(r < 0)
+        std::cerr << "Failed to read signal message" << std::endl;
+    else if(strcmp(topic, listener->options.topic) != 0)
+        listener->stats.filtered.fetch_add(1, std::memory_order_relaxed);
+    else
+        onBeat(listener, heartBeatIndex, time);
+
+    return 1;
+}
+
+/* HeartBeatPrecise(t index, t monotonic_ns, t realtime_ns), the receive time is taken first thing */
+static int readPreciseBeat(Listener *listener, sd_bus_message *msg, const char *type, uint64_t receivedNs) {
+    uint64_t heartBeatIndex, monotonicNs, realtimeNs;
+
+    int r = sd_bus_message_read(msg, type, &heartBeatIndex, &monotonicNs, &realtimeNs);
+    if(r > 0)
+        onBeat(listener, heartBeatIndex, int64_t(realtimeNs / 1000000000u),
+               listener->options.realtime ? realtimeNs : monotonicNs, receivedNs);
+    return r;
+}
+
+int preciseSignalCallback(sd_bus_message *msg, void *userData, sd_bus_error *err) {
+    Listener *listener = static_cast<Listener*>(userData);
+    uint64_t receivedNs = clock_ns(listener->options.realtime ? CLOCK_REALTIME : CLOCK_MONOTONIC);
+
+    if(readPreciseBeat(listener, msg, "ttt", receivedNs) < 0)
+        std::cerr << "Failed to read signal message" << std::endl;
+
+    return 1;
+}
+
+int preciseBatchSignalCallback(sd_bus_message *msg, void *userData, sd_bus_error *err) {
+    Listener *listener = static_cast<Listener*>(userData);
+    uint64_t receivedNs = clock_ns(listener->options.realtime ? CLOCK_REALTIME : CLOCK_MONOTONIC);
+
+    int r = sd_bus_message_enter_container(msg, SD_BUS_TYPE_ARRAY, "(ttt)");
+    while(r > 0)
+        r = readPreciseBeat(listener, msg, "(ttt)", receivedNs);
+    if(r < 0)
+        std::cerr << "Failed to read signal message" << std::endl;
+
     return 1;
 }
 
-int main() {
+static void printStats(const ListenerStats& stats) {
+    std::cerr << "received=" << stats.received
+              << " missed=" << stats.missed
+              << " reordered=" << stats.reordered
+              << " restarts=" << stats.restarts
+              << " overflows=" << stats.overflows
+              << " filtered=" << stats.filtered << std::endl;
+}
+
+static void printLatency(const char *what, const LatencyHistogram& latency, uint64_t negative) {
+    if(latency.count() == 0 && negative == 0)
+        return;
+
+    std::cerr << what << " latency (us): n=" << latency.count()
+              << " p50=" << double(latency.percentile(50)) / 1e3
+              << " p90=" << double(latency.percentile(90)) / 1e3
+              << " p99=" << double(latency.percentile(99)) / 1e3
+              << " p999=" << double(latency.percentile(99.9)) / 1e3
+              << " max=" << double(latency.max()) / 1e3;
+    if(negative > 0)
+        std::cerr << " negative=" << negative;
+    std::cerr << std::endl;
+}
+
+/* consumer thread, formatting happens here with the reentrant localtime_r instead of ctime.
+ * Latencies are recorded here too, so the histograms belong to this thread only */
+static void consume(Listener *listener) {
+    auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(listener->options.interval));
+    auto nextStats = std::chrono::steady_clock::now() + interval;
+    LatencyHistogram window, total;
+    uint64_t windowNegative = 0, totalNegative = 0;
+    BeatRecord record;
+    char timeText[64];
+
+    for(;;) {
+        bool any = false;
+        while(listener->ring.try_pop(record)) {
+            any = true;
+
+            /* a send time after the receive time means the clocks are not in sync (--realtime across hosts) */
+            if(record.sentNs > record.receivedNs)
+                windowNegative++;
+            else if(record.sentNs > 0)
+                window.record(record.receivedNs - record.sentNs);
+
+            if(listener->options.quiet)
+                continue;
+
+            time_t t = record.time;
+            struct tm tm;
+            localtime_r(&t, &tm);
+            strftime(timeText, sizeof(timeText), "%a %b %e %H:%M:%S %Y", &tm);
+            std::cout << "received heart beat: index=" << record.heartBeatIndex << " " << timeText;
+            if(record.sentNs > 0)
+                std::cout << " latency=" << (int64_t(record.receivedNs) - int64_t(record.sentNs)) / 1000 << "us";
+            std::cout << '\n';
+        }
+
+        if(std::chrono::steady_clock::now() >= nextStats) {
+            printStats(listener->stats);
+            printLatency("interval", window, windowNegative);
+            total.merge(window);
+            totalNegative += windowNegative;
+            window.reset();
+            windowNegative = 0;
+            nextStats += interval;
+        }
+
+        /* nothing more to format for now, good time to flush and let the ring fill a bit */
+        if(!any) {
+            std::cout.flush();
+            if(listener->stopping) {
+                total.merge(window);
+                printLatency("total", total, totalNegative + windowNegative);
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+static bool parse_options(int argc, char *argv[], ListenerOptions& options) {
+    static const struct option longOptions[] = {
+        {"quiet",    no_argument,       NULL, 'q'},
+        {"realtime", no_argument,       NULL, 'R'},
+        {"interval", required_argument, NULL, 'i'},
+        {"topic",    required_argument, NULL, 't'},
+        {"client-filter", no_argument,  NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+
+    while((c = getopt_long(argc, argv, "qRi:t:c", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'q':
+            options.quiet = true;
+            break;
+        case 'R':
+            options.realtime = true;
+            break;
+        case 'i':
+            options.interval = strtod(optarg, NULL);
+            break;
+        case 't':
+            /* goes in a match rule between quotes */
+            if(strchr(optarg, '\'') || strchr(optarg, '\\'))
+                return false;
+            options.topic = optarg;
+            break;
+        case 'c':
+            options.clientFilter = true;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    return optind == argc && options.interval > 0 && (options.topic || !options.clientFilter);
+}
+
+int main(int argc, char *argv[]) {
+    auto listener = std::make_unique<Listener>();
     sd_bus *bus = NULL;
+    sd_event *event = NULL;
+    std::thread consumer;
+    sigset_t mask;
     int r;
 
+    if(!parse_options(argc, argv, listener->options)) {
+        std::cerr << "usage: " << argv[0] << " [--quiet] [--realtime] [--interval SECONDS] [--topic NAME [--client-filter]]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    r = sd_event_default(&event);
+    if (r < 0) {
+        std::cerr << "Failed to setup event loop: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+    sd_event_add_signal(event, NULL, SIGINT, NULL, NULL);
+    sd_event_add_signal(event, NULL, SIGTERM, NULL, NULL);
+
     r = sd_bus_open_user(&bus);
     if (r < 0) {
         std::cerr << "Failed to connect to user bus: " << strerror(-r) << std::endl;
-        stop_process = true;
+        goto finish;
+    }
+
+    if(listener->options.topic) {
+        std::string rule = "type='signal',sender='org.nicolas.PublisherExample',path='/org/nicolas/PublisherExample',"
+                           "interface='org.nicolas.PublisherExample',member='TopicHeartBeat'";
+        if(!listener->options.clientFilter)
+            rule += std::string(",arg0='") + listener->options.topic + "'";
+
+        r = sd_bus_add_match(bus, NULL, rule.c_str(), topicSignalCallback, listener.get());
     }
-    
-    r = sd_bus_match_signal(bus,
-                            NULL,
-                            "org.nicolas.PublisherExample",
-                            "/org/nicolas/PublisherExample",
-                            "org.nicolas.PublisherExample",
-                            "HeartBeat",
-                            signalCallback,
-                            NULL);
-    
-    while(!stop_process) {
-        r = sd_bus_process(bus, NULL);
-        if (r < 0)
-            std::cerr << "Failed to process bus: " << strerror(-r) << std::endl;
-        if (r > 0)
-            continue;
-
-        /* Wait for the next request to process */
-        r = sd_bus_wait(bus, (uint64_t) -1);
-        if (r < 0)
-            std::cerr << "Failed to wait on bus: " << strerror(-r) << std::endl;
+    else {
+        r = sd_bus_match_signal(bus,
+                                NULL,
+                                "org.nicolas.PublisherExample",
+                                "/org/nicolas/PublisherExample",
+                                "org.nicolas.PublisherExample",
+                                "HeartBeat",
+                                signalCallback,
+                                listener.get());
+        if(r >= 0)
+            r = sd_bus_match_signal(bus,
+                                    NULL,
+                                    "org.nicolas.PublisherExample",
+                                    "/org/nicolas/PublisherExample",
+                                    "org.nicolas.PublisherExample",
+                                    "HeartBeatBatch",
+                                    batchSignalCallback,
+                                    listener.get());
+        if(r >= 0)
+            r = sd_bus_match_signal(bus,
+                                    NULL,
+                                    "org.nicolas.PublisherExample",
+                                    "/org/nicolas/PublisherExample",
+                                    "org.nicolas.PublisherExample",
+                                    "HeartBeatPrecise",
+                                    preciseSignalCallback,
+                                    listener.get());
+        if(r >= 0)
+            r = sd_bus_match_signal(bus,
+                                    NULL,
+                                    "org.nicolas.PublisherExample",
+                                    "/org/nicolas/PublisherExample",
+                                    "org.nicolas.PublisherExample",
+                                    "HeartBeatPreciseBatch",
+                                    preciseBatchSignalCallback,
+                                    listener.get());
     }
+    if (r < 0) {
+        std::cerr << "Failed to add signal match: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+
+    consumer = std::thread(consume, listener.get());
 
+    r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
+    if(r >= 0)
+        r = sd_event_loop(event);
+    if(r < 0)
+        std::cerr << "Failed to run event loop: " << strerror(-r) << std::endl;
+
+finish:
+    if(consumer.joinable()) {
+        listener->stopping = true;
+        consumer.join();
+        printStats(listener->stats);
+    }
     sd_bus_unref(bus);
+    sd_event_unref(event);
 
     return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
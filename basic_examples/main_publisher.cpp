@@ -1,21 +1,94 @@
 #include <iostream>
-#include <atomic>
+#include <algorithm>
+#include <deque>
 #include <string>
+#include <vector>
 #include <csignal>
 #include <cstdlib>
 #include <cstdint>
 #include <ctime>
 
 #include <errno.h>
+#include <getopt.h>
 #include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
 
-std::atomic_bool stop_process = false;
+#include "bus_stats.h"
+#include "typed_bus.h"
 
-void sighandler(int signum) {
-    stop_process = true;
-}
+/*
+ * HeartBeat signals are driven by an sd_event timer, at --rate beats per second (default 1).
+ * We keep track of how many beats are due since we started, instead of sending one per timer tick,
+ * so the average rate stays exact even when the timer fires late or the rate is higher than what
+ * a timer can tick at. Timer ticks are never closer than 1 ms, beats due in between go out together.
+ *
+ * With --batch N, beats are packed by up to N in a single HeartBeatBatch signal carrying a(tx),
+ * so at high rates we pay one message header, one marshal and one broker hop per batch instead of per beat:
+ * dbus_publisher --rate 100000 --batch 100
+ *
+ * sd_bus_send never blocks: when the broker stops reading from us (because a subscriber does not read
+ * its messages and the broker hit its limits), messages pile up in the sd-bus write queue and memory grows.
+ * So we look at sd_bus_get_n_queued_write and sd_bus_get_n_queued_read before sending: above --high-watermark
+ * messages we consider the connection congested and stop handing messages to sd-bus until the queues
+ * are back under --low-watermark. What happens to the beats due meanwhile depends on --flow:
+ * - block (default): nothing is produced, beats are only delayed and go out once the queue drained.
+ * - drop-oldest: beats are kept in a local outbox of --outbox beats, the oldest are dropped when it is full.
+ * - coalesce: only the latest beat is kept, older ones are replaced.
+ * Messages already queued in sd-bus can not be taken back, which is why the policy applies in front of it.
+ * Dropped and coalesced beats are counted and exported in org.nicolas.Stats.
+ *
+ * The HeartBeat timestamp is time(NULL), one second resolution. With --precise we send HeartBeatPrecise
+ * (or HeartBeatPreciseBatch) instead, carrying CLOCK_MONOTONIC and CLOCK_REALTIME nanoseconds taken when the message
+ * is built, so dbus_listener can measure the one-way latency through the broker.
+ *
+ * With --topics N, every beat goes out once per topic as TopicHeartBeat(s topic, t index, x timestamp) instead of
+ * HeartBeat, topics being "topic0" to "topicN-1". The topic comes first so a subscriber can ask the broker for a single
+ * topic with an arg0 match rule (dbus_listener --topic topic3) instead of receiving all of them:
+ * dbus_publisher --rate 100 --topics 100
+ */
+
+enum class FlowMode { Block, DropOldest, Coalesce };
+
+struct PublisherOptions {
+    double rate = 1.0;
+    unsigned batch = 1;
+    FlowMode flow = FlowMode::Block;
+    uint64_t highWatermark = 1024;
+    uint64_t lowWatermark = 0;      /* 0 means highWatermark / 4 */
+    size_t outboxSize = 4096;
+    bool precise = false;
+    unsigned topics = 0;
+};
+
+struct Beat {
+    uint64_t index;
+    int64_t time;
+};
+
+struct Publisher {
+    sd_bus *bus;
+    PublisherOptions options;
+    std::vector<std::string> topics;
+    uint64_t startUsec = 0;
+    uint64_t periodUsec = 0;
+    uint64_t ticks = 0;
+    uint64_t beatIndex = 0;
+    uint64_t messages = 0;
+    std::deque<Beat> outbox;
+    bool congested = false;
+    uint64_t congestions = 0;
+    uint64_t dropped = 0;
+    uint64_t coalesced = 0;
+};
+
+static const uint64_t minimumPeriodUsec = 1000;
+
+/* exported as org.nicolas.Stats next to the example interface, see bus_stats.h */
+enum StatsMethod { StatsGreating };
+static BusStats stats{"Greating"};
 
 static int method_greating(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    BusStats::CallTimer timer(stats, StatsGreating);
     int r;
     const char* name = nullptr;
     std::string response = "hello ";
@@ -28,12 +101,21 @@ static int method_greating(sd_bus_message* m, void* userdata, sd_bus_error* ret_
     }
     else {
         std::cerr << "Failed to parse parameters: " << strerror(-r) << std::endl;
-        return r;
+        return timer.done(r);
     }
     
-    return sd_bus_reply_method_return(m, "s", response.c_str());
+    return timer.done(sd_bus_reply_method_return(m, "s", response.c_str()));
 }
 
+/* HeartBeat(t index, x timestamp), the vtable entry and the marshalling both come from this declaration */
+static constexpr typed_bus::Signal<uint64_t, int64_t> heartBeat{"HeartBeat"};
+
+/* HeartBeatPrecise(t index, t monotonic_ns, t realtime_ns) */
+static constexpr typed_bus::Signal<uint64_t, uint64_t, uint64_t> heartBeatPrecise{"HeartBeatPrecise"};
+
+/* TopicHeartBeat(s topic, t index, x timestamp) */
+static constexpr typed_bus::Signal<std::string, uint64_t, int64_t> topicHeartBeat{"TopicHeartBeat"};
+
 static const sd_bus_vtable example_vtable[] = {
         SD_BUS_VTABLE_START(0),
         SD_BUS_METHOD_WITH_ARGS("Greating",
@@ -41,47 +123,319 @@ static const sd_bus_vtable example_vtable[] = {
             SD_BUS_RESULT("s", response),
             method_greating,
             SD_BUS_VTABLE_UNPRIVILEGED),
+        heartBeat.entry(SD_BUS_PARAM(index) SD_BUS_PARAM(timestamp)),
+        SD_BUS_SIGNAL_WITH_ARGS("HeartBeatBatch",
+            SD_BUS_ARGS("a(tx)", beats),
+            0),
+        heartBeatPrecise.entry(SD_BUS_PARAM(index) SD_BUS_PARAM(monotonic_ns) SD_BUS_PARAM(realtime_ns)),
+        SD_BUS_SIGNAL_WITH_ARGS("HeartBeatPreciseBatch",
+            SD_BUS_ARGS("a(ttt)", beats),
+            0),
+        topicHeartBeat.entry(SD_BUS_PARAM(topic) SD_BUS_PARAM(index) SD_BUS_PARAM(timestamp)),
         SD_BUS_VTABLE_END
 };
 
-static int sendSignal(sd_bus *bus) {
-    static uint64_t beatIndex = 0;
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000u + uint64_t(ts.tv_nsec);
+}
+
+/* the same beat on every topic */
+static int sendTopicSignals(Publisher *publisher, const Beat& beat) {
+    for(const std::string& topic : publisher->topics) {
+        int r = topicHeartBeat.emit(publisher->bus,
+                                    "/org/nicolas/PublisherExample",
+                                    "org.nicolas.PublisherExample",
+                                    topic,
+                                    beat.index,
+                                    beat.time);
+        if(r < 0) {
+            std::cerr << "Failed to send signal message" << std::endl;
+            return r;
+        }
+    }
+
+    publisher->messages += publisher->topics.size();
+    stats.signalsEmitted(publisher->topics.size());
+
+    return 0;
+}
+
+static int sendSignal(Publisher *publisher, const Beat& beat) {
+    int r;
+
+    if(!publisher->topics.empty())
+        return sendTopicSignals(publisher, beat);
+
+    if(publisher->options.precise)
+        r = heartBeatPrecise.emit(publisher->bus,
+                                  "/org/nicolas/PublisherExample",
+                                  "org.nicolas.PublisherExample",
+                                  beat.index,
+                                  clock_ns(CLOCK_MONOTONIC),
+                                  clock_ns(CLOCK_REALTIME));
+    else
+        r = heartBeat.emit(publisher->bus,
+                           "/org/nicolas/PublisherExample",    /* Signal emitter path */
+                           "org.nicolas.PublisherExample",     /* Signal emitter interface */
+                           beat.index,
+                           beat.time);
+    if(r < 0) {
+        std::cerr << "Failed to send signal message" << std::endl;
+        return r;
+    }
+    
+    publisher->messages++;
+    stats.signalsEmitted();
+    
+    return r;
+}
+
+/* the first count beats of the outbox */
+static int sendBatchSignal(Publisher *publisher, size_t count) {
     sd_bus_message* msg;
-    int r = sd_bus_message_new_signal(bus,
+    int r = sd_bus_message_new_signal(publisher->bus,
                                   &msg,
-                                  "/org/nicolas/PublisherExample",    /* Signal emitter path */
-                                  "org.nicolas.PublisherExample", /* Signal emitter interface */
-                                  "HeartBeat");
+                                  "/org/nicolas/PublisherExample",
+                                  "org.nicolas.PublisherExample",
+                                  publisher->options.precise ? "HeartBeatPreciseBatch" : "HeartBeatBatch");
     if(r < 0) {
         std::cerr << "Failed to create new signal" << std::endl;
         return r;
     }
-    
-    r = sd_bus_message_append(msg, "tx", beatIndex, int64_t(std::time(NULL)));
+
+    if(publisher->options.precise) {
+        /* one send time for the whole message */
+        uint64_t monotonicNs = clock_ns(CLOCK_MONOTONIC);
+        uint64_t realtimeNs = clock_ns(CLOCK_REALTIME);
+
+        r = sd_bus_message_open_container(msg, SD_BUS_TYPE_ARRAY, "(ttt)");
+        for(size_t i = 0; i < count && r >= 0; i++)
+            r = sd_bus_message_append(msg, "(ttt)", publisher->outbox[i].index, monotonicNs, realtimeNs);
+    }
+    else {
+        r = sd_bus_message_open_container(msg, SD_BUS_TYPE_ARRAY, "(tx)");
+        for(size_t i = 0; i < count && r >= 0; i++)
+            r = sd_bus_message_append(msg, "(tx)", publisher->outbox[i].index, publisher->outbox[i].time);
+    }
+    if(r >= 0)
+        r = sd_bus_message_close_container(msg);
     if(r < 0) {
         std::cerr << "Failed to append data to signal message" << std::endl;
+        sd_bus_message_unref(msg);
         return r;
     }
-    
-    r = sd_bus_send(bus, msg, NULL);
+
+    r = sd_bus_send(publisher->bus, msg, NULL);
+    sd_bus_message_unref(msg);
     if(r < 0) {
         std::cerr << "Failed to send signal message" << std::endl;
         return r;
     }
-    
-    beatIndex++;
-    
+
+    publisher->messages++;
+    stats.signalsEmitted();
+
+    return r;
+}
+
+/* hysteresis between the watermarks, so we do not flip at every message */
+static bool update_congestion(Publisher *publisher) {
+    uint64_t queuedWrite = 0, queuedRead = 0;
+
+    sd_bus_get_n_queued_write(publisher->bus, &queuedWrite);
+    sd_bus_get_n_queued_read(publisher->bus, &queuedRead);
+    uint64_t queued = std::max(queuedWrite, queuedRead);
+
+    if(!publisher->congested && queued >= publisher->options.highWatermark) {
+        publisher->congested = true;
+        publisher->congestions++;
+    }
+    else if(publisher->congested && queued <= publisher->options.lowWatermark)
+        publisher->congested = false;
+
+    return publisher->congested;
+}
+
+/* one message from the head of the outbox */
+static int flush_one(Publisher *publisher) {
+    size_t count = std::min<size_t>(publisher->outbox.size(), publisher->options.batch);
+    int r = publisher->options.batch > 1 ? sendBatchSignal(publisher, count) : sendSignal(publisher, publisher->outbox.front());
+    if(r >= 0)
+        publisher->outbox.erase(publisher->outbox.begin(), publisher->outbox.begin() + count);
     return r;
 }
 
-int main() {
+/* a beat produced while congested, in drop-oldest or coalesce mode */
+static void hold_beat(Publisher *publisher, const Beat& beat) {
+    if(publisher->options.flow == FlowMode::Coalesce) {
+        publisher->coalesced += publisher->outbox.size();
+        stats.signalsCoalesced(publisher->outbox.size());
+        publisher->outbox.clear();
+    }
+    else if(publisher->outbox.size() >= publisher->options.outboxSize) {
+        publisher->outbox.pop_front();
+        publisher->dropped++;
+        stats.signalsDropped();
+    }
+    publisher->outbox.push_back(beat);
+}
+
+static int on_timer(sd_event_source *source, uint64_t usec, void *userdata) {
+    Publisher *publisher = static_cast<Publisher*>(userdata);
+    uint64_t now;
+    int r = 0;
+
+    sd_event_now(sd_event_source_get_event(source), CLOCK_MONOTONIC, &now);
+    int64_t beatTime = int64_t(std::time(NULL));
+
+    /* beat 0 goes out at start, then one every 1/rate second */
+    uint64_t due = uint64_t(double(now - publisher->startUsec) * publisher->options.rate / 1e6) + 1;
+    update_congestion(publisher);
+    while(r >= 0) {
+        if(!publisher->congested && !publisher->outbox.empty()) {
+            r = flush_one(publisher);
+            update_congestion(publisher);
+        }
+        else if(publisher->beatIndex >= due)
+            break;
+        else if(!publisher->congested) {
+            /* fill one message worth of beats */
+            while(publisher->beatIndex < due && publisher->outbox.size() < publisher->options.batch)
+                publisher->outbox.push_back(Beat{publisher->beatIndex++, beatTime});
+        }
+        else if(publisher->options.flow == FlowMode::Block)
+            break;
+        else
+            hold_beat(publisher, Beat{publisher->beatIndex++, beatTime});
+    }
+
+    /* next deadline is computed from the start time, so late ticks do not make the rate drift */
+    publisher->ticks++;
+    uint64_t next = publisher->startUsec + publisher->ticks * publisher->periodUsec;
+    if(next <= now) {
+        publisher->ticks = (now - publisher->startUsec) / publisher->periodUsec + 1;
+        next = publisher->startUsec + publisher->ticks * publisher->periodUsec;
+    }
+
+    /* returning an error would disable the timer for good, a failed send (ENOBUFS on a congested bus) is only
+     * logged and the beats still in the outbox go out at the next tick. Only a dead connection stops the loop. */
+    if(r < 0) {
+        std::cerr << "Failed to send heart beats: " << strerror(-r) << std::endl;
+        if(sd_bus_is_open(publisher->bus) <= 0)
+            return sd_event_exit(sd_event_source_get_event(source), r);
+    }
+    return sd_event_source_set_time(source, next);
+}
+
+/* sd_bus_attach_event flushes the bus when the loop exits, which never returns if the broker stopped reading
+ * from us, so a congested bus is detached first and what is still queued is lost */
+static int on_exit_signal(sd_event_source *source, const struct signalfd_siginfo *si, void *userdata) {
+    Publisher *publisher = static_cast<Publisher*>(userdata);
+
+    if(update_congestion(publisher))
+        sd_bus_detach_event(publisher->bus);
+    return sd_event_exit(sd_event_source_get_event(source), 0);
+}
+
+static bool parse_options(int argc, char *argv[], PublisherOptions& options) {
+    static const struct option longOptions[] = {
+        {"rate",           required_argument, NULL, 'r'},
+        {"batch",          required_argument, NULL, 'b'},
+        {"flow",           required_argument, NULL, 'f'},
+        {"high-watermark", required_argument, NULL, 'H'},
+        {"low-watermark",  required_argument, NULL, 'L'},
+        {"outbox",         required_argument, NULL, 'o'},
+        {"precise",        no_argument,       NULL, 'p'},
+        {"topics",         required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+
+    while((c = getopt_long(argc, argv, "r:b:f:H:L:o:pt:", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'r':
+            options.rate = strtod(optarg, NULL);
+            break;
+        case 'b':
+            options.batch = std::max(1u, unsigned(strtoul(optarg, NULL, 10)));
+            break;
+        case 'f':
+            if(std::string(optarg) == "block")
+                options.flow = FlowMode::Block;
+            else if(std::string(optarg) == "drop-oldest")
+                options.flow = FlowMode::DropOldest;
+            else if(std::string(optarg) == "coalesce")
+                options.flow = FlowMode::Coalesce;
+            else
+                return false;
+            break;
+        case 'H':
+            options.highWatermark = std::max<uint64_t>(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'L':
+            options.lowWatermark = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            options.outboxSize = std::max<size_t>(1, strtoull(optarg, NULL, 10));
+            break;
+        case 'p':
+            options.precise = true;
+            break;
+        case 't':
+            options.topics = unsigned(strtoul(optarg, NULL, 10));
+            break;
+        default:
+            return false;
+        }
+    }
+
+    if(options.lowWatermark == 0 || options.lowWatermark >= options.highWatermark)
+        options.lowWatermark = options.highWatermark / 4;
+
+    /* topics have their own signal, not batched and without precise timestamps */
+    if(options.topics > 0 && (options.batch > 1 || options.precise))
+        return false;
+
+    return optind == argc && options.rate > 0;
+}
+
+int main(int argc, char *argv[]) {
     sd_bus_slot *slot = NULL;
     sd_bus *bus = NULL;
+    sd_event *event = NULL;
+    sd_event_source *timer = NULL;
+    Publisher publisher;
+    sigset_t mask;
     int r;
     int ret = EXIT_SUCCESS;
-    
-    signal(SIGINT, sighandler);
-    signal(SIGTERM, sighandler);
+
+    if(!parse_options(argc, argv, publisher.options)) {
+        std::cerr << "usage: " << argv[0] << " [--rate BEATS_PER_SECOND] [--batch N] [--precise] [--topics N]\n"
+                  << "       [--flow block|drop-oldest|coalesce] [--high-watermark MESSAGES] [--low-watermark MESSAGES] [--outbox BEATS]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    for(unsigned i = 0; i < publisher.options.topics; i++)
+        publisher.topics.push_back("topic" + std::to_string(i));
+
+    /* one tick per message at low rates, but never more than one tick per millisecond */
+    publisher.periodUsec = std::max(minimumPeriodUsec,
+                                    uint64_t(1e6 * double(publisher.options.batch) / publisher.options.rate));
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    r = sd_event_default(&event);
+    if(r < 0) {
+        std::cerr << "Failed to setup event loop: " << strerror(-r) << std::endl;
+        return EXIT_FAILURE;
+    }
+    sd_event_add_signal(event, NULL, SIGINT, on_exit_signal, &publisher);
+    sd_event_add_signal(event, NULL, SIGTERM, on_exit_signal, &publisher);
     
     r = sd_bus_open_user(&bus);
     if(r >= 0) {
@@ -91,38 +445,53 @@ int main() {
                                      "org.nicolas.PublisherExample",   /* interface name */
                                      example_vtable,
                                      NULL);
+        if(r >= 0)
+            r = stats.attach(bus, NULL, "/org/nicolas/PublisherExample");
         if(r >= 0) {
             r = sd_bus_request_name(bus, "org.nicolas.PublisherExample", 0);
             if (r < 0) {
                 std::cerr << "Failed to acquire service name: " << strerror(-r) << std::endl;
-                stop_process = true;
                 ret = EXIT_FAILURE;
             }
         }
         else {
             std::cerr << "Failed to add example object: " << strerror(-r) << std::endl;
-            stop_process = true;
             ret = EXIT_FAILURE;
         }
     }
-    
-    while(!stop_process) {
-        r = sd_bus_process(bus, NULL);
-        sendSignal(bus);
-        if (r < 0)
-            std::cerr << "Failed to process bus: " << strerror(-r) << std::endl;
-        if (r > 0)
-            continue;
-
-        /* Wait for the next request to process */
-        r = sd_bus_wait(bus, 1000 * 1000);
-        if (r < 0)
-            std::cerr << "Failed to wait on bus: " << strerror(-r) << std::endl;
+    else {
+        std::cerr << "Failed to connect to user bus: " << strerror(-r) << std::endl;
+        ret = EXIT_FAILURE;
     }
-    
+
+    if(ret == EXIT_SUCCESS) {
+        publisher.bus = bus;
+        sd_event_now(event, CLOCK_MONOTONIC, &publisher.startUsec);
+
+        /* accuracy 0 would mean the default 250 ms slack, we want the timer on time */
+        r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
+        if(r >= 0)
+            r = sd_event_add_time(event, &timer, CLOCK_MONOTONIC, publisher.startUsec, 1, on_timer, &publisher);
+        if(r >= 0)
+            r = sd_event_source_set_enabled(timer, SD_EVENT_ON);
+        if(r >= 0)
+            r = sd_event_loop(event);
+        if(r < 0) {
+            std::cerr << "Failed to run event loop: " << strerror(-r) << std::endl;
+            ret = EXIT_FAILURE;
+        }
+
+        std::cout << "sent " << publisher.beatIndex - publisher.dropped - publisher.coalesced - publisher.outbox.size()
+                  << " heart beats in " << publisher.messages << " messages, dropped " << publisher.dropped
+                  << ", coalesced " << publisher.coalesced << ", congested " << publisher.congestions << " times" << std::endl;
+    }
+
+    if(bus && !publisher.congested)
+        sd_bus_flush(bus);
+    sd_event_source_unref(timer);
     sd_bus_slot_unref(slot);
     sd_bus_unref(bus);
+    sd_event_unref(event);
     
     return ret;
 }
-
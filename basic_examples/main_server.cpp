@@ -3,9 +3,29 @@
 #include <string>
 #include <csignal>
 #include <cstdlib>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include <set>
 
 #include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include "bulk_transfer.h"
+#include "bus_stats.h"
+#include "completion_queue.h"
+#include "property_notifier.h"
+#include "reply_cache.h"
+#include "typed_bus.h"
+#include "unix_listener.h"
 
 /*
  * I changed the vtable to make sure we can introspect arguments name
@@ -50,6 +70,12 @@
    <arg type="s" name="caller_name" direction="in"/>
    <arg type="s" name="response" direction="out"/>
   </method>
+  <property name="Greeting" type="s" access="readwrite">
+  </property>
+  <property name="CallCount" type="t" access="read">
+  </property>
+  <property name="LastCaller" type="s" access="read">
+  </property>
  </interface>
 </node>
  *
@@ -57,95 +83,729 @@
  * busctl --user call org.nicolas.ServerExample /org/nicolas/ServerExample org.nicolas.ServerExample Greating s patate
 s "hello patate"
  * 
+ * By default Greating runs inline in the bus thread, so one slow call stalls every other caller.
+ * With --workers N, the bus thread only parses the call, keeps a reference on the message and hands it
+ * to a pool of N threads. Workers never touch sd-bus objects (libsystemd is not thread safe), they only
+ * build the response string and push the finished job on a lock-free completion queue, then wake up the bus thread
+ * through an eventfd. The bus thread sends the deferred reply and drops its reference on the call message.
+ * --work-us simulates handler cost, so we can see throughput scale with the number of workers:
+ * dbus_server --workers 4 --work-us 200
+ * dbus_client --pipeline 64 --duration 5
+ *
+ * BulkTransfer takes a sealed memfd as a unix fd argument ("h"): only the descriptor goes through the broker,
+ * we map the pages the client wrote. BulkTransferArray takes the same data as "ay" for comparison,
+ * the buffer is then copied into the message, through the broker and out again (and "ay" is capped at 64 MiB).
+ * Both reply with the size and a checksum of what they read:
+ * dbus_client --bulk 16777216 --bulk-mode memfd
+ * dbus_client --bulk 16777216 --bulk-mode array
+ *
+ * With --listen PATH, the server does not use the user bus: it accepts direct peer to peer connections
+ * on a unix socket, one sd_bus per client in server mode (sd_bus_set_server/sd_bus_set_fd), with the same
+ * example_vtable. No broker means one socket hop per message instead of two and no routing step.
+ * There is no Hello and no name ownership on such connections, clients connect with sd_bus_set_address:
+ * dbus_server --listen /tmp/server_example.sock
+ * dbus_client --address unix:path=/tmp/server_example.sock --pipeline 1 --duration 5
+ *
+ * Greating only depends on its argument, with --memo-size N the last N distinct replies are kept
+ * (typed_bus::pure_method, see reply_cache.h) and a repeated caller name is answered with a copy of
+ * the cached reply, without running the handler or going through the workers.
+ * Hits and misses are properties of org.nicolas.ReplyCache:
+ * dbus_server --memo-size 1024 --work-us 200
+ * busctl --user introspect org.nicolas.ServerExample /org/nicolas/ServerExample org.nicolas.ReplyCache
+ *
+ * Greeting is the word before the caller name (setting it clears the reply cache), CallCount and LastCaller
+ * change with every Greating call. Clients can watch them instead of polling:
+ * busctl --user set-property org.nicolas.ServerExample /org/nicolas/ServerExample org.nicolas.ServerExample Greeting s bonjour
+ * dbus-monitor --session "type='signal',interface='org.freedesktop.DBus.Properties'"
+ * PropertiesChanged is not sent for every call: changes are collected for --notify-window-us (100 ms by default)
+ * and sent as one signal per interface (see property_notifier.h), --notify-window-us 0 sends one per change.
+ *
+ * The server does not have to run all the time, the broker can start it on the first call to
+ * org.nicolas.ServerExample (org.nicolas.ServerExample.service, installed with the systemd user unit
+ * dbus-examples-server.service). With --idle-exit SECONDS it leaves once no method call came in for that long:
+ * it releases the name first, calls the broker had already routed to us arrive before the ReleaseName reply
+ * and are answered, calls sent after that start a new instance. When started by the broker we connect to the
+ * address it gives us (DBUS_STARTER_ADDRESS), which is not always the user bus.
+ * dbus_bench --workload activation measures cold start latency against a warm server.
 */
 
-std::atomic_bool stop_process = false;
+struct ServerOptions {
+    unsigned workers = 0;
+    unsigned workUsec = 0;
+    const char *listenPath = nullptr;
+    size_t memoSize = 0;
+    uint64_t notifyWindowUsec = 100000;
+    uint64_t idleExitUsec = 0;
+};
+
+static ServerOptions options;
+
+/* replies of Greating, capacity set from --memo-size */
+static ReplyCache greatingCache;
+
+/* exported as org.nicolas.Stats next to the example interface, see bus_stats.h */
+enum StatsMethod { StatsGreating, StatsBulkTransfer, StatsBulkTransferArray };
+static BusStats stats{"Greating", "BulkTransfer", "BulkTransferArray"};
+
+/* properties of org.nicolas.ServerExample, bus thread only */
+struct ServerProperties {
+    std::string greeting = "hello";
+    uint64_t callCount = 0;
+    std::string lastCaller;
+};
+
+static ServerProperties properties;
+
+/* PropertiesChanged for the above, coalesced over --notify-window-us */
+static PropertyNotifier notifier;
+
+/* greeting is a copy, workers must not read properties */
+static std::string make_greating(const std::string& greeting, const char *name) {
+    std::string response = greeting;
+    response.append(" ");
+    response.append(name);
 
-void sighandler(int signum) {
-    stop_process = true;
+    /* pretend the handler has real work to do, busy wait so it also costs cpu */
+    if(options.workUsec > 0) {
+        auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(options.workUsec);
+        while(std::chrono::steady_clock::now() < end)
+            ;
+    }
+
+    return response;
 }
 
-static int method_greating(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
-    int r;
-    const char* name = nullptr;
-    std::string response = "hello ";
-    
-    r = sd_bus_message_read(m, "s", &name);
-    if(r >= 0 && name) {
-        if(name) {
-            response.append(name);
+using GreatingCall = typed_bus::Call<std::string>;
+
+struct GreatingJob {
+    sd_bus_message *call;
+    std::string name;
+    std::string greeting;
+    std::string response;
+    uint64_t startNs = 0;
+    ReplyCache *cache = nullptr;
+    std::string cacheKey;
+    GreatingJob *next = nullptr;
+};
+
+class WorkerPool {
+public:
+    int start(sd_event *event, unsigned count);
+    void stop();
+    void submit(GreatingJob *job);
+    bool idle() const { return inFlight == 0; }
+
+private:
+    static int on_completions(sd_event_source *source, int fd, uint32_t revents, void *userdata);
+    void reply_completed();
+    void work();
+
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<GreatingJob*> pending;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+    unsigned inFlight = 0;  /* bus thread only */
+
+    CompletionQueue<GreatingJob> completed;
+    int completionFd = -1;
+    sd_event_source *completionSource = NULL;
+};
+
+int WorkerPool::start(sd_event *event, unsigned count) {
+    completionFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(completionFd < 0)
+        return -errno;
+
+    int r = sd_event_add_io(event, &completionSource, completionFd, EPOLLIN, on_completions, this);
+    if(r < 0)
+        return r;
+
+    for(unsigned i = 0; i < count; i++)
+        threads.emplace_back(&WorkerPool::work, this);
+
+    return 0;
+}
+
+void WorkerPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for(std::thread& thread : threads)
+        thread.join();
+    threads.clear();
+
+    /* workers finished what was queued, send the last replies */
+    reply_completed();
+
+    completionSource = sd_event_source_unref(completionSource);
+    if(completionFd >= 0) {
+        close(completionFd);
+        completionFd = -1;
+    }
+}
+
+/* called from the bus thread */
+void WorkerPool::submit(GreatingJob *job) {
+    inFlight++;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(job);
+    }
+    wakeup.notify_one();
+}
+
+void WorkerPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for(;;) {
+        wakeup.wait(lock, [this]() { return stopping || !pending.empty(); });
+        if(pending.empty())
+            return;
+
+        GreatingJob *job = pending.front();
+        pending.pop_front();
+        lock.unlock();
+
+        job->response = make_greating(job->greeting, job->name.c_str());
+
+        /* only the first completion of a batch needs to wake up the bus thread */
+        if(completed.push(job)) {
+            uint64_t one = 1;
+            if(write(completionFd, &one, sizeof(one)) < 0)
+                std::cerr << "Failed to signal completion: " << strerror(errno) << std::endl;
         }
+
+        lock.lock();
     }
-    else {
+}
+
+int WorkerPool::on_completions(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+    WorkerPool *pool = static_cast<WorkerPool*>(userdata);
+    uint64_t count;
+
+    /* reset the eventfd before draining, a push after this point will wake us up again */
+    if(read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        std::cerr << "Failed to read completion eventfd: " << strerror(errno) << std::endl;
+
+    pool->reply_completed();
+    return 0;
+}
+
+void WorkerPool::reply_completed() {
+    GreatingJob *job = completed.drain();
+
+    while(job) {
+        GreatingJob *next = job->next;
+        /* Greeting was set while the job was running, the cache was cleared and this reply is stale */
+        ReplyCache *cache = job->greeting == properties.greeting ? job->cache : nullptr;
+        int r = GreatingCall::reply_to_cached(cache, job->cacheKey, job->call, job->response);
+        if(r < 0)
+            std::cerr << "Failed to send deferred reply: " << strerror(-r) << std::endl;
+        /* handler time of a deferred call runs until its reply is sent */
+        stats.record(StatsGreating, BusStats::now_ns() - job->startNs, r < 0);
+        sd_bus_message_unref(job->call);
+        delete job;
+        inFlight--;
+        job = next;
+    }
+}
+
+/* every Greating call, including the ones answered from the reply cache, so it is not part of method_greating */
+static void on_greating(const char *name) {
+    properties.callCount++;
+    properties.lastCaller = name;
+    notifier.changed("/org/nicolas/ServerExample", "org.nicolas.ServerExample", "CallCount");
+    notifier.changed("/org/nicolas/ServerExample", "org.nicolas.ServerExample", "LastCaller");
+}
+
+/* signature comes from the types: "s" in, "s" out, see typed_bus.h */
+static int method_greating(const GreatingCall& call, const char *name) {
+    WorkerPool *pool = static_cast<WorkerPool*>(call.userdata());
+    BusStats::CallTimer timer(stats, StatsGreating);
+
+    if(!pool)
+        return timer.done(call.reply(make_greating(properties.greeting, name)));
+
+    /* name points into the message, copy it since only the bus thread may touch the message */
+    pool->submit(new GreatingJob{sd_bus_message_ref(call.message()), name, properties.greeting, {}, timer.defer(),
+                                 call.cache(), call.cacheKey()});
+
+    /* returning without a reply tells sd-bus the reply is deferred */
+    return 1;
+}
+
+/* the fd belongs to the message, it is closed when the message is freed */
+static int method_bulk_transfer(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    BusStats::CallTimer timer(stats, StatsBulkTransfer);
+    uint64_t size, checksum;
+    int fd;
+
+    int r = sd_bus_message_read(m, "h", &fd);
+    if(r < 0) {
         std::cerr << "Failed to parse parameters: " << strerror(-r) << std::endl;
-        return r;
+        return timer.done(r);
     }
-    
-    return sd_bus_reply_method_return(m, "s", response.c_str());
+
+    r = bulk_read_sealed_memfd(fd, &size, &checksum);
+    if(r == -EPERM)
+        return timer.done(sd_bus_error_set(ret_error, SD_BUS_ERROR_INVALID_ARGS, "memfd must be sealed against write, shrink and grow"));
+    if(r < 0)
+        return timer.done(sd_bus_error_set_errnof(ret_error, -r, "Failed to map memfd: %s", strerror(-r)));
+
+    return timer.done(sd_bus_reply_method_return(m, "tt", size, checksum));
+}
+
+static int method_bulk_transfer_array(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    BusStats::CallTimer timer(stats, StatsBulkTransferArray);
+    const void *data;
+    size_t size;
+
+    /* points into the message buffer, no extra copy on our side */
+    int r = sd_bus_message_read_array(m, 'y', &data, &size);
+    if(r < 0) {
+        std::cerr << "Failed to parse parameters: " << strerror(-r) << std::endl;
+        return timer.done(r);
+    }
+
+    return timer.done(sd_bus_reply_method_return(m, "tt", uint64_t(size), bulk_checksum(data, size)));
+}
+
+static int get_string_property(sd_bus *bus, const char *path, const char *interface, const char *property,
+                               sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+    const std::string& value = strcmp(property, "Greeting") == 0 ? properties.greeting : properties.lastCaller;
+    return sd_bus_message_append_basic(reply, 's', value.c_str());
+}
+
+static int get_call_count(sd_bus *bus, const char *path, const char *interface, const char *property,
+                          sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+    return sd_bus_message_append_basic(reply, 't', &properties.callCount);
+}
+
+static int set_greeting(sd_bus *bus, const char *path, const char *interface, const char *property,
+                        sd_bus_message *value, void *userdata, sd_bus_error *ret_error) {
+    const char *greeting;
+
+    int r = sd_bus_message_read_basic(value, 's', &greeting);
+    if(r < 0)
+        return r;
+    if(properties.greeting == greeting)
+        return 0;
+
+    /* cached replies were built with the old greeting */
+    properties.greeting = greeting;
+    greatingCache.clear();
+    notifier.changed(path, interface, property);
+    return 0;
 }
 
 static const sd_bus_vtable example_vtable[] = {
         SD_BUS_VTABLE_START(0),
-        SD_BUS_METHOD_WITH_ARGS("Greating",
-            SD_BUS_ARGS("s", caller_name),
-            SD_BUS_RESULT("s", response),
-            method_greating,
+        typed_bus::pure_method<method_greating, greatingCache, on_greating>("Greating", SD_BUS_PARAM(caller_name) SD_BUS_PARAM(response)),
+        SD_BUS_WRITABLE_PROPERTY("Greeting", "s", get_string_property, set_greeting, 0,
+                                 SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE | SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_PROPERTY("CallCount", "t", get_call_count, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+        SD_BUS_PROPERTY("LastCaller", "s", get_string_property, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+        SD_BUS_METHOD_WITH_ARGS("BulkTransfer",
+            SD_BUS_ARGS("h", data),
+            SD_BUS_RESULT("t", size, "t", checksum),
+            method_bulk_transfer,
+            SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD_WITH_ARGS("BulkTransferArray",
+            SD_BUS_ARGS("ay", data),
+            SD_BUS_RESULT("t", size, "t", checksum),
+            method_bulk_transfer_array,
             SD_BUS_VTABLE_UNPRIVILEGED),
         SD_BUS_VTABLE_END
 };
 
-int main() {
+/* Accept peer to peer connections on a unix socket, each one gets its own sd_bus attached to our event loop */
+class PeerServer {
+public:
+    int start(sd_event *event, const char *path, void *vtableUserdata);
+    void stop();
+
+private:
+    static int on_connection(sd_event_source *source, int fd, uint32_t revents, void *userdata);
+    static int on_disconnected(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    int add_peer(int fd);
+
+    sd_event *event = NULL;
+    sd_event_source *listenSource = NULL;
+    int listenFd = -1;
+    std::string socketPath;
+    void *vtableUserdata = NULL;
+    std::set<sd_bus*> peers;
+};
+
+int PeerServer::start(sd_event *e, const char *path, void *userdata) {
+    event = e;
+    vtableUserdata = userdata;
+    socketPath = path;
+
+    /* fails rather than taking over the socket of another live server, see unix_listener.h */
+    listenFd = listen_unix(path);
+    if(listenFd < 0)
+        return listenFd;
+
+    return sd_event_add_io(event, &listenSource, listenFd, EPOLLIN, on_connection, this);
+}
+
+void PeerServer::stop() {
+    for(sd_bus *peer : peers) {
+        notifier.removeBus(peer);
+        sd_bus_flush_close_unref(peer);
+    }
+    peers.clear();
+
+    listenSource = sd_event_source_unref(listenSource);
+    /* listenFd is only set once we bound socketPath, otherwise the path may be another server's */
+    if(listenFd >= 0) {
+        close(listenFd);
+        listenFd = -1;
+        unlink(socketPath.c_str());
+    }
+}
+
+int PeerServer::on_connection(sd_event_source *source, int fd, uint32_t revents, void *userdata) {
+    PeerServer *server = static_cast<PeerServer*>(userdata);
+
+    int peerFd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if(peerFd < 0) {
+        if(errno != EAGAIN && errno != EINTR)
+            std::cerr << "Failed to accept peer connection: " << strerror(errno) << std::endl;
+        return 0;
+    }
+
+    int r = server->add_peer(peerFd);
+    if(r < 0)
+        std::cerr << "Failed to setup peer connection: " << strerror(-r) << std::endl;
+
+    return 0;
+}
+
+int PeerServer::add_peer(int fd) {
+    sd_bus *bus = NULL;
+    sd_id128_t id;
+    int r;
+
+    r = sd_bus_new(&bus);
+    if(r < 0) {
+        close(fd);
+        return r;
+    }
+
+    /* once set the fd belongs to the bus, not when sd_bus_set_fd failed */
+    r = sd_bus_set_fd(bus, fd, fd);
+    if(r < 0) {
+        close(fd);
+        sd_bus_unref(bus);
+        return r;
+    }
+
+    r = sd_id128_randomize(&id);
+    if(r >= 0)
+        r = sd_bus_set_server(bus, 1, id);
+    if(r >= 0)
+        r = sd_bus_add_object_vtable(bus,
+                                     NULL,
+                                     "/org/nicolas/ServerExample",
+                                     "org.nicolas.ServerExample",
+                                     example_vtable,
+                                     vtableUserdata);
+    if(r >= 0)
+        r = stats.attach(bus, NULL, "/org/nicolas/ServerExample");
+    if(r >= 0 && greatingCache.enabled())
+        r = greatingCache.attach(bus, NULL, "/org/nicolas/ServerExample");
+    /* sd-bus synthesizes this local signal when the peer goes away */
+    if(r >= 0)
+        r = sd_bus_match_signal(bus,
+                                NULL,
+                                NULL,
+                                "/org/freedesktop/DBus/Local",
+                                "org.freedesktop.DBus.Local",
+                                "Disconnected",
+                                on_disconnected,
+                                this);
+    if(r >= 0)
+        r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
+    if(r >= 0)
+        r = sd_bus_start(bus);
+    if(r < 0) {
+        sd_bus_unref(bus);
+        return r;
+    }
+
+    peers.insert(bus);
+    notifier.addBus(bus);
+    return 0;
+}
+
+int PeerServer::on_disconnected(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    PeerServer *server = static_cast<PeerServer*>(userdata);
+    sd_bus *bus = sd_bus_message_get_bus(m);
+
+    /* sd_bus_process holds a reference while dispatching, dropping ours here is fine */
+    if(server->peers.erase(bus) > 0) {
+        notifier.removeBus(bus);
+        sd_bus_detach_event(bus);
+        sd_bus_unref(bus);
+    }
+
+    return 0;
+}
+
+/* --idle-exit: leave the event loop once no method call came in for idleUsec */
+class IdleExit {
+public:
+    int start(sd_bus *bus, sd_event *event, uint64_t idleUsec, const WorkerPool *pool);
+    ~IdleExit() { sd_event_source_unref(timer); }
+
+private:
+    static int on_message(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int on_timer(sd_event_source *source, uint64_t usec, void *userdata);
+    static int on_name_released(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+
+    sd_bus *bus = NULL;
+    sd_event *event = NULL;
+    sd_event_source *timer = NULL;
+    const WorkerPool *pool = NULL;
+    uint64_t idleUsec = 0;
+    uint64_t lastCallUsec = 0;
+};
+
+int IdleExit::start(sd_bus *b, sd_event *e, uint64_t idle, const WorkerPool *workers) {
+    bus = b;
+    event = e;
+    idleUsec = idle;
+    pool = workers;
+
+    int r = sd_event_now(event, CLOCK_MONOTONIC, &lastCallUsec);
+    /* filters see every incoming message before it is dispatched */
+    if(r >= 0)
+        r = sd_bus_add_filter(bus, NULL, on_message, this);
+    if(r >= 0)
+        r = sd_event_add_time(event, &timer, CLOCK_MONOTONIC, lastCallUsec + idleUsec, 0, on_timer, this);
+    return r;
+}
+
+int IdleExit::on_message(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    IdleExit *idle = static_cast<IdleExit*>(userdata);
+
+    if(sd_bus_message_is_method_call(m, NULL, NULL))
+        sd_event_now(idle->event, CLOCK_MONOTONIC, &idle->lastCallUsec);
+
+    /* not handled, dispatch it as usual */
+    return 0;
+}
+
+int IdleExit::on_timer(sd_event_source *source, uint64_t usec, void *userdata) {
+    IdleExit *idle = static_cast<IdleExit*>(userdata);
+    uint64_t next = idle->lastCallUsec + idle->idleUsec;
+
+    /* deferred replies are traffic too */
+    if(idle->pool && !idle->pool->idle())
+        next = usec + idle->idleUsec;
+
+    if(next > usec) {
+        sd_event_source_set_time(source, next);
+        return sd_event_source_set_enabled(source, SD_EVENT_ONESHOT);
+    }
+
+    int r = sd_bus_release_name_async(idle->bus, NULL, "org.nicolas.ServerExample", on_name_released, idle);
+    if(r < 0) {
+        std::cerr << "Failed to release service name: " << strerror(-r) << std::endl;
+        return sd_event_exit(idle->event, r);
+    }
+    return 0;
+}
+
+int IdleExit::on_name_released(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    IdleExit *idle = static_cast<IdleExit*>(userdata);
+
+    /* everything routed to us before the broker handled ReleaseName came in before this reply and was dispatched,
+     * deferred replies still running on workers are sent by WorkerPool::stop */
+    if(sd_bus_message_is_method_error(m, NULL))
+        std::cerr << "Failed to release service name: " << sd_bus_message_get_error(m)->message << std::endl;
+
+    return sd_event_exit(idle->event, 0);
+}
+
+/* when the broker started us, connect back to the bus it gave us */
+static int open_bus(sd_bus **ret) {
+    const char *starter = getenv("DBUS_STARTER_ADDRESS");
+    sd_bus *bus = NULL;
+
+    if(!starter)
+        return sd_bus_open_user(ret);
+
+    int r = sd_bus_new(&bus);
+    if(r < 0)
+        return r;
+
+    r = sd_bus_set_address(bus, starter);
+    if(r >= 0)
+        r = sd_bus_set_bus_client(bus, 1);
+    if(r >= 0)
+        r = sd_bus_start(bus);
+    if(r < 0) {
+        sd_bus_unref(bus);
+        return r;
+    }
+
+    *ret = bus;
+    return 0;
+}
+
+static bool parse_options(int argc, char *argv[]) {
+    static const struct option longOptions[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"work-us", required_argument, NULL, 'u'},
+        {"listen",  required_argument, NULL, 'l'},
+        {"memo-size", required_argument, NULL, 'm'},
+        {"notify-window-us", required_argument, NULL, 'n'},
+        {"idle-exit", required_argument, NULL, 'i'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+
+    while((c = getopt_long(argc, argv, "w:u:l:m:n:i:", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'w':
+            options.workers = unsigned(strtoul(optarg, NULL, 10));
+            break;
+        case 'u':
+            options.workUsec = unsigned(strtoul(optarg, NULL, 10));
+            break;
+        case 'l':
+            options.listenPath = optarg;
+            break;
+        case 'm':
+            options.memoSize = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            options.notifyWindowUsec = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            options.idleExitUsec = uint64_t(strtod(optarg, NULL) * 1e6);
+            break;
+        default:
+            return false;
+        }
+    }
+
+    /* peers do not come from activation */
+    return optind == argc && !(options.listenPath && options.idleExitUsec > 0);
+}
+
+int main(int argc, char *argv[]) {
     sd_bus_slot *slot = NULL;
     sd_bus *bus = NULL;
+    sd_event *event = NULL;
+    WorkerPool pool;
+    PeerServer peerServer;
+    IdleExit idleExit;
+    sigset_t mask;
     int r;
     int ret = EXIT_SUCCESS;
-    
-    signal(SIGINT, sighandler);
-    signal(SIGTERM, sighandler);
-    
-    r = sd_bus_open_user(&bus);
+
+    if(!parse_options(argc, argv)) {
+        std::cerr << "usage: " << argv[0] << " [--workers N] [--work-us MICROSECONDS] [--listen SOCKET_PATH] [--memo-size ENTRIES] [--notify-window-us MICROSECONDS] [--idle-exit SECONDS]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    greatingCache.setCapacity(options.memoSize);
+
+    /* signals are delivered through a signalfd by sd-event, they need to be blocked first */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    r = sd_event_default(&event);
+    if(r >= 0) {
+        /* no callback means exit the event loop */
+        sd_event_add_signal(event, NULL, SIGINT, NULL, NULL);
+        sd_event_add_signal(event, NULL, SIGTERM, NULL, NULL);
+        r = notifier.start(event, options.notifyWindowUsec);
+        if(r >= 0 && options.workers > 0)
+            r = pool.start(event, options.workers);
+    }
+    if(r < 0) {
+        std::cerr << "Failed to setup event loop: " << strerror(-r) << std::endl;
+        ret = EXIT_FAILURE;
+        goto finish;
+    }
+
+    if(options.listenPath) {
+        r = peerServer.start(event, options.listenPath, options.workers > 0 ? &pool : NULL);
+        if(r >= 0)
+            r = sd_event_loop(event);
+        if(r < 0) {
+            std::cerr << "Failed to serve peer connections on " << options.listenPath << ": " << strerror(-r) << std::endl;
+            ret = EXIT_FAILURE;
+        }
+        goto finish;
+    }
+
+    r = open_bus(&bus);
     if(r >= 0) {
         r = sd_bus_add_object_vtable(bus,
                                      &slot,
                                      "/org/nicolas/ServerExample",  /* object path */
                                      "org.nicolas.ServerExample",   /* interface name */
                                      example_vtable,
-                                     NULL);
+                                     options.workers > 0 ? &pool : NULL);
+        if(r >= 0)
+            r = stats.attach(bus, NULL, "/org/nicolas/ServerExample");
+        if(r >= 0 && greatingCache.enabled())
+            r = greatingCache.attach(bus, NULL, "/org/nicolas/ServerExample");
         if(r >= 0) {
+            notifier.addBus(bus);
             r = sd_bus_request_name(bus, "org.nicolas.ServerExample", 0);
             if (r < 0) {
                 std::cerr << "Failed to acquire service name: " << strerror(-r) << std::endl;
-                stop_process = true;
                 ret = EXIT_FAILURE;
             }
         }
         else {
             std::cerr << "Failed to add example object: " << strerror(-r) << std::endl;
-            stop_process = true;
             ret = EXIT_FAILURE;
         }
     }
     else {
         std::cerr << "Failed to connect to user bus: " << strerror(-r) << std::endl;
-        stop_process = true;
         ret = EXIT_FAILURE;
     }
-    
-    while(!stop_process) {
-        r = sd_bus_process(bus, NULL);
-        if (r < 0)
-            std::cerr << "Failed to process bus: " << strerror(-r) << std::endl;
-        if (r > 0)
-            continue;
-
-        /* Wait for the next request to process */
-        r = sd_bus_wait(bus, (uint64_t) -1);
-        if (r < 0)
-            std::cerr << "Failed to wait on bus: " << strerror(-r) << std::endl;
+
+    if(ret == EXIT_SUCCESS) {
+        r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
+        /* the broker went away, nobody can call us anymore */
+        if(r >= 0)
+            r = sd_bus_set_exit_on_disconnect(bus, 1);
+        if(r >= 0 && options.idleExitUsec > 0)
+            r = idleExit.start(bus, event, options.idleExitUsec, options.workers > 0 ? &pool : NULL);
+        if(r >= 0)
+            r = sd_event_loop(event);
+        if(r < 0) {
+            std::cerr << "Failed to run event loop: " << strerror(-r) << std::endl;
+            ret = EXIT_FAILURE;
+        }
     }
-    
+
+finish:
+    if(options.workers > 0)
+        pool.stop();
+    /* last changes, while the connections are still there */
+    notifier.stop();
+    peerServer.stop();
+    if(bus)
+        sd_bus_flush(bus);
     sd_bus_slot_unref(slot);
     sd_bus_unref(bus);
+    sd_event_unref(event);
     
     return ret;
 }
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <systemd/sd-bus.h>
+
+#include "latency_histogram.h"
+#include "private_bus.h"
+
+using Clock = std::chrono::steady_clock;
+
+/* Minimal JSON object builder, values are serialized when added and kept in insertion order */
+class JsonObject {
+public:
+    JsonObject& add(const std::string& key, const std::string& value);
+    JsonObject& add(const std::string& key, const char *value) { return add(key, std::string(value)); }
+    JsonObject& add(const std::string& key, double value);
+    JsonObject& add(const std::string& key, uint64_t value);
+    JsonObject& add(const std::string& key, int64_t value) { return addRaw(key, std::to_string(value)); }
+    JsonObject& add(const std::string& key, unsigned value) { return add(key, uint64_t(value)); }
+    JsonObject& add(const std::string& key, int value) { return add(key, int64_t(value)); }
+    JsonObject& add(const std::string& key, bool value) { return addRaw(key, value ? "true" : "false"); }
+    JsonObject& add(const std::string& key, const JsonObject& value) { return addRaw(key, value.str()); }
+    JsonObject& addRaw(const std::string& key, const std::string& json);
+
+    std::string str() const;
+
+private:
+    std::vector<std::pair<std::string, std::string>> fields;
+};
+
+std::string json_quote(const std::string& s);
+
+/* {count, min, mean, p50, p90, p99, p999, max} in nanoseconds */
+JsonObject latency_json(const LatencyHistogram& histogram);
+
+/* cpu consumed by this process and by the private daemon between two samples */
+struct CpuSample {
+    double self = 0.0;
+    double broker = 0.0;
+
+    static CpuSample take(const PrivateBus& bus);
+};
+
+/* fills bench_cpu_s and broker_cpu_s in result */
+void add_cpu_json(JsonObject& result, const CpuSample& begin, const CpuSample& end);
+
+struct BenchOptions {
+    double duration = 2.0;
+    std::vector<uint64_t> payloadSizes = {16, 256, 4096, 65536, 262144};
+    std::vector<uint64_t> rates = {1000, 10000, 50000, 0};
+    std::vector<uint64_t> clients = {1, 2, 4, 8, 16};
+    std::vector<uint64_t> bulkSizes = {1 << 20, 4 << 20, 16 << 20, 32 << 20};
+    std::vector<uint64_t> depths = {1, 32};
+    std::vector<uint64_t> unitCounts = {10000, 100000};
+    std::vector<uint64_t> topicRates = {1000, 5000};
+    unsigned coldStarts = 10;
+};
+
+struct BenchContext {
+    PrivateBus& bus;
+    const BenchOptions& options;
+    std::vector<JsonObject>& results;
+};
+
+/*
+ * One private bus connection processed by its own thread, this is how we run the
+ * dbus_server / dbus_listener side of a workload inside the benchmark process.
+ * setup() runs on the bus thread before start() returns, to add vtables and matches.
+ * sd_bus objects are not thread safe, everything touching that connection must happen
+ * from setup() or from callbacks dispatched by the thread.
+ */
+class BusThread {
+public:
+    using Setup = std::function<int(sd_bus*)>;
+
+    BusThread() = default;
+    BusThread(const BusThread&) = delete;
+    BusThread& operator=(const BusThread&) = delete;
+    ~BusThread();
+
+    int start(const PrivateBus& privateBus, Setup setup);
+    /* takes ownership of bus, e.g. the server side of a peer to peer connection */
+    int start(sd_bus *bus, Setup setup);
+    void stop();
+
+private:
+    void run(sd_bus *bus);
+
+    std::thread thread;
+    int wakeFd = -1;
+    std::atomic_bool stopping = false;
+};
+
+/* wait until the bus has something to do, or fd becomes readable */
+int bus_wait_with_fd(sd_bus *bus, int fd, uint64_t timeoutUsec);
+
+/* steady clock, as nanoseconds since its epoch */
+uint64_t now_ns();
+Clock::time_point deadline_after(double seconds);
+
+/* vtable equivalent to the one of dbus_server, to be used with BusThread */
+int add_server_object(sd_bus *bus);
+/* same without requesting the service name, for peer to peer connections */
+int add_server_vtable(sd_bus *bus);
+
+/* keep depth Greating calls in flight for duration seconds, returns the number of completed calls or -errno */
+int64_t run_pipelined_greating(sd_bus *bus, unsigned depth, double duration, LatencyHistogram& latency);
+
+void parse_size_list(const char *arg, std::vector<uint64_t>& out);
+
+/* address of the user bus like sd_bus_open_user finds it, empty when there is none */
+std::string default_bus_address();
+
+/* VmRSS of a process in kB, -1 when it is gone */
+int64_t rss_kb(pid_t pid);
+/* pid of the connection owning name, from the broker, -1 on error */
+pid_t owner_pid(sd_bus *bus, const char *name);
+
+/* workloads, each one adds its results to context.results */
+int bench_greating_payload(BenchContext& context);
+int bench_heartbeat_rate(BenchContext& context);
+int bench_concurrent_clients(BenchContext& context);
+int bench_bulk_transfer(BenchContext& context);
+int bench_peer_to_peer(BenchContext& context);
+int bench_marshal(BenchContext& context);
+int bench_unit_list(BenchContext& context);
+int bench_reactor(BenchContext& context);
+int bench_topics(BenchContext& context);
+int bench_activation(BenchContext& context);
@@ -0,0 +1,135 @@
+#include "bench.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+
+#include <errno.h>
+
+/*
+ * Cost of starting dbus_server on demand. We put an org.nicolas.ServerExample.service in the servicedir
+ * of the private broker, starting the dbus_server of this build with --idle-exit 0.2, then --cold-starts times:
+ * - cold: one Greating while nobody owns the name, from sending it to the reply, the broker execs the server
+ *   which connects, says Hello and requests the name in between
+ * - warm: 100 Greating one after the other to the server just started
+ * - the RSS of the server after that, what keeping it running costs
+ * - idle exit: from the last reply until the name is released
+ */
+
+static const char *serviceName = "org.nicolas.ServerExample";
+static const double idleExitSeconds = 0.2;
+static const unsigned warmCalls = 100;
+
+static int write_service_file(BenchContext& context, std::string& path) {
+    path = context.bus.serviceDirectory() + "/org.nicolas.ServerExample.service";
+
+    std::ofstream file(path);
+    file << "[D-BUS Service]\n"
+         << "Name=" << serviceName << "\n"
+         << "Exec=" << DBUS_SERVER_PATH << " --idle-exit " << idleExitSeconds << "\n";
+    file.close();
+    return file ? 0 : -EIO;
+}
+
+static int call_greating(sd_bus *bus) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+
+    int r = sd_bus_call_method(bus, serviceName, "/org/nicolas/ServerExample", serviceName,
+                               "Greating", &error, &reply, "s", "activation");
+    if(r < 0)
+        std::cerr << "Failed to call Greating: " << (error.message ? error.message : strerror(-r)) << std::endl;
+
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    return r;
+}
+
+static int name_has_owner(sd_bus *bus) {
+    sd_bus_message *reply = NULL;
+    int owned = 0;
+
+    int r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                               "NameHasOwner", NULL, &reply, "s", serviceName);
+    if(r >= 0)
+        r = sd_bus_message_read(reply, "b", &owned);
+
+    sd_bus_message_unref(reply);
+    return r < 0 ? r : owned;
+}
+
+/* polls, a few ms of resolution is plenty next to the idle timeout */
+static int wait_name_released(sd_bus *bus, double timeout) {
+    Clock::time_point deadline = deadline_after(timeout);
+    int r;
+
+    while((r = name_has_owner(bus)) > 0 && Clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    return r > 0 ? -ETIMEDOUT : r;
+}
+
+int bench_activation(BenchContext& context) {
+    LatencyHistogram cold, warm, idleExit;
+    sd_bus *client = NULL;
+    std::string servicePath;
+    int64_t rssKb = -1;
+    int r;
+
+    std::cerr << "activation: " << context.options.coldStarts << " cold starts of " << DBUS_SERVER_PATH << std::endl;
+
+    r = write_service_file(context, servicePath);
+    if(r >= 0)
+        r = context.bus.connect(&client);
+    /* makes the broker read the new service file */
+    if(r >= 0)
+        r = sd_bus_call_method(client, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                               "ReloadConfig", NULL, NULL, "");
+    if(r >= 0)
+        r = wait_name_released(client, 5.0);
+
+    CpuSample cpuBegin = CpuSample::take(context.bus);
+    for(unsigned i = 0; i < context.options.coldStarts && r >= 0; i++) {
+        uint64_t start = now_ns();
+        r = call_greating(client);
+        if(r < 0)
+            break;
+        cold.record(now_ns() - start);
+
+        for(unsigned j = 0; j < warmCalls && r >= 0; j++) {
+            start = now_ns();
+            r = call_greating(client);
+            warm.record(now_ns() - start);
+        }
+        if(r < 0)
+            break;
+
+        pid_t pid = owner_pid(client, serviceName);
+        if(pid > 0)
+            rssKb = std::max(rssKb, rss_kb(pid));
+
+        start = now_ns();
+        r = wait_name_released(client, 10 * idleExitSeconds + 5.0);
+        idleExit.record(now_ns() - start);
+    }
+    CpuSample cpuEnd = CpuSample::take(context.bus);
+
+    sd_bus_flush_close_unref(client);
+    unlink(servicePath.c_str());
+    if(r < 0)
+        return r;
+
+    JsonObject result;
+    result.add("workload", "activation")
+          .add("cold_starts", uint64_t(cold.count()))
+          .add("cold_us_min", double(cold.min()) / 1000.0)
+          .add("cold_us_p50", double(cold.percentile(50)) / 1000.0)
+          .add("cold_us_max", double(cold.max()) / 1000.0)
+          .add("warm_us_p50", double(warm.percentile(50)) / 1000.0)
+          .add("warm_us_p99", double(warm.percentile(99)) / 1000.0)
+          .add("server_rss_kb", rssKb)
+          .add("idle_exit_setting_s", idleExitSeconds)
+          .add("idle_exit_s_p50", double(idleExit.percentile(50)) / 1e9);
+    add_cpu_json(result, cpuBegin, cpuEnd);
+    context.results.push_back(result);
+    return 0;
+}
@@ -0,0 +1,436 @@
+#include "bench.h"
+#include "bulk_transfer.h"
+
+#include <iostream>
+#include <memory>
+#include <cstring>
+#include <algorithm>
+
+/*
+ * The dbus_server and dbus_publisher workloads: Greating calls with growing payloads,
+ * HeartBeat signals at a target rate, and many clients calling Greating at the same time.
+ */
+
+static int method_greating(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    int r;
+    const char* name = nullptr;
+    std::string response = "hello ";
+
+    r = sd_bus_message_read(m, "s", &name);
+    if(r < 0)
+        return r;
+    response.append(name);
+
+    return sd_bus_reply_method_return(m, "s", response.c_str());
+}
+
+static int method_bulk_transfer(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    uint64_t size, checksum;
+    int fd;
+
+    int r = sd_bus_message_read(m, "h", &fd);
+    if(r >= 0)
+        r = bulk_read_sealed_memfd(fd, &size, &checksum);
+    if(r < 0)
+        return r;
+
+    return sd_bus_reply_method_return(m, "tt", size, checksum);
+}
+
+static int method_bulk_transfer_array(sd_bus_message* m, void* userdata, sd_bus_error* ret_error) {
+    const void *data;
+    size_t size;
+
+    int r = sd_bus_message_read_array(m, 'y', &data, &size);
+    if(r < 0)
+        return r;
+
+    return sd_bus_reply_method_return(m, "tt", uint64_t(size), bulk_checksum(data, size));
+}
+
+static const sd_bus_vtable server_vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_METHOD_WITH_ARGS("Greating",
+            SD_BUS_ARGS("s", caller_name),
+            SD_BUS_RESULT("s", response),
+            method_greating,
+            SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD_WITH_ARGS("BulkTransfer",
+            SD_BUS_ARGS("h", data),
+            SD_BUS_RESULT("t", size, "t", checksum),
+            method_bulk_transfer,
+            SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD_WITH_ARGS("BulkTransferArray",
+            SD_BUS_ARGS("ay", data),
+            SD_BUS_RESULT("t", size, "t", checksum),
+            method_bulk_transfer_array,
+            SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_VTABLE_END
+};
+
+int add_server_vtable(sd_bus *bus) {
+    int r = sd_bus_add_object_vtable(bus,
+                                     NULL,
+                                     "/org/nicolas/ServerExample",
+                                     "org.nicolas.ServerExample",
+                                     server_vtable,
+                                     NULL);
+    if(r < 0)
+        std::cerr << "Failed to add example object: " << strerror(-r) << std::endl;
+    return r;
+}
+
+int add_server_object(sd_bus *bus) {
+    int r = add_server_vtable(bus);
+    if(r < 0)
+        return r;
+
+    r = sd_bus_request_name(bus, "org.nicolas.ServerExample", 0);
+    if(r < 0)
+        std::cerr << "Failed to acquire service name: " << strerror(-r) << std::endl;
+    return r;
+}
+
+static int call_greating(sd_bus *bus, const char *name, LatencyHistogram& latency) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+
+    uint64_t start = now_ns();
+    int r = sd_bus_call_method(bus,
+                               "org.nicolas.ServerExample",
+                               "/org/nicolas/ServerExample",
+                               "org.nicolas.ServerExample",
+                               "Greating",
+                               &error,
+                               &reply,
+                               "s",
+                               name);
+    latency.record(now_ns() - start);
+    if(r < 0)
+        std::cerr << "Failed to issue method call: " << (error.message ? error.message : strerror(-r)) << std::endl;
+
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    return r;
+}
+
+struct PipelinedCall {
+    struct PipelinedGreating *pipeline;
+    uint64_t start;
+};
+
+struct PipelinedGreating {
+    sd_bus *bus;
+    LatencyHistogram *latency;
+    Clock::time_point deadline;
+    uint64_t completed = 0;
+    unsigned inFlight = 0;
+    int error = 0;
+};
+
+static int issue_pipelined_call(PipelinedCall *call);
+
+static int on_pipelined_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    PipelinedCall *call = static_cast<PipelinedCall*>(userdata);
+    PipelinedGreating *p = call->pipeline;
+
+    p->latency->record(now_ns() - call->start);
+    p->inFlight--;
+    if(sd_bus_message_is_method_error(m, NULL))
+        p->error = -sd_bus_message_get_errno(m);
+    else
+        p->completed++;
+
+    if(p->error == 0 && Clock::now() < p->deadline)
+        p->error = std::min(issue_pipelined_call(call), 0);
+    return 0;
+}
+
+static int issue_pipelined_call(PipelinedCall *call) {
+    call->start = now_ns();
+    int r = sd_bus_call_method_async(call->pipeline->bus, NULL,
+                                     "org.nicolas.ServerExample",
+                                     "/org/nicolas/ServerExample",
+                                     "org.nicolas.ServerExample",
+                                     "Greating",
+                                     on_pipelined_reply,
+                                     call,
+                                     "s",
+                                     "client");
+    if(r >= 0)
+        call->pipeline->inFlight++;
+    return r;
+}
+
+int64_t run_pipelined_greating(sd_bus *bus, unsigned depth, double duration, LatencyHistogram& latency) {
+    PipelinedGreating p;
+    std::vector<PipelinedCall> calls(depth, PipelinedCall{&p, 0});
+    int r = 0;
+
+    p.bus = bus;
+    p.latency = &latency;
+    p.deadline = deadline_after(duration);
+
+    for(PipelinedCall& call : calls) {
+        r = issue_pipelined_call(&call);
+        if(r < 0)
+            return r;
+    }
+
+    while(p.inFlight > 0 && r >= 0) {
+        r = sd_bus_process(bus, NULL);
+        if(r == 0)
+            r = sd_bus_wait(bus, UINT64_MAX);
+        if(r == -EINTR)
+            r = 0;
+    }
+
+    if(r < 0)
+        return r;
+    return p.error < 0 ? p.error : int64_t(p.completed);
+}
+
+int bench_greating_payload(BenchContext& context) {
+    BusThread server;
+    sd_bus *bus = NULL;
+
+    int r = server.start(context.bus, add_server_object);
+    if(r < 0)
+        return r;
+
+    r = context.bus.connect(&bus);
+    if(r < 0)
+        return r;
+
+    for(uint64_t size : context.options.payloadSizes) {
+        std::string payload(size, 'x');
+        LatencyHistogram latency;
+        uint64_t calls = 0;
+
+        std::cerr << "greating: payload " << size << " bytes" << std::endl;
+
+        CpuSample cpuBegin = CpuSample::take(context.bus);
+        Clock::time_point begin = Clock::now();
+        Clock::time_point deadline = deadline_after(context.options.duration);
+        while(Clock::now() < deadline && r >= 0) {
+            r = call_greating(bus, payload.c_str(), latency);
+            calls++;
+        }
+        double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+        CpuSample cpuEnd = CpuSample::take(context.bus);
+        if(r < 0)
+            break;
+
+        JsonObject result;
+        result.add("workload", "greating_payload")
+              .add("payload_bytes", size)
+              .add("calls", calls)
+              .add("elapsed_s", elapsed)
+              .add("calls_per_s", double(calls) / elapsed)
+              .add("payload_mb_per_s", double(calls * size) / elapsed / 1e6)
+              .add("latency_ns", latency_json(latency));
+        add_cpu_json(result, cpuBegin, cpuEnd);
+        context.results.push_back(result);
+    }
+
+    sd_bus_flush_close_unref(bus);
+    return r < 0 ? r : 0;
+}
+
+struct HeartBeatListener {
+    LatencyHistogram latency;
+    std::atomic<uint64_t> received = 0;
+};
+
+static int on_heartbeat(sd_bus_message *msg, void *userData, sd_bus_error *err) {
+    HeartBeatListener *listener = static_cast<HeartBeatListener*>(userData);
+    uint64_t heartBeatIndex;
+    int64_t sentNs;
+
+    int r = sd_bus_message_read(msg, "tx", &heartBeatIndex, &sentNs);
+    if(r >= 0) {
+        listener->latency.record(now_ns() - uint64_t(sentNs));
+        listener->received.fetch_add(1, std::memory_order_relaxed);
+    }
+    return 1;
+}
+
+/* The benchmark owns both ends, so HeartBeat carries the steady clock send time instead of time(NULL) */
+static int run_heartbeat_rate(BenchContext& context, sd_bus *publisher, uint64_t rate) {
+    auto listener = std::make_unique<HeartBeatListener>();
+    BusThread listenerThread;
+    uint64_t sent = 0;
+    int r;
+
+    r = listenerThread.start(context.bus, [&listener](sd_bus *bus) {
+        return sd_bus_match_signal(bus, NULL, NULL,
+                                   "/org/nicolas/PublisherExample",
+                                   "org.nicolas.PublisherExample",
+                                   "HeartBeat",
+                                   on_heartbeat,
+                                   listener.get());
+    });
+    if(r < 0)
+        return r;
+
+    std::cerr << "heartbeat: rate " << (rate ? std::to_string(rate) + "/s" : std::string("unbounded")) << std::endl;
+
+    CpuSample cpuBegin = CpuSample::take(context.bus);
+    Clock::time_point begin = Clock::now();
+    Clock::time_point deadline = deadline_after(context.options.duration);
+    for(Clock::time_point now = begin; now < deadline && r >= 0; now = Clock::now()) {
+        double elapsed = std::chrono::duration<double>(now - begin).count();
+        uint64_t due = rate ? uint64_t(elapsed * double(rate)) + 1 : sent + 64;
+
+        while(sent < due && r >= 0) {
+            r = sd_bus_emit_signal(publisher,
+                                   "/org/nicolas/PublisherExample",
+                                   "org.nicolas.PublisherExample",
+                                   "HeartBeat",
+                                   "tx",
+                                   sent,
+                                   int64_t(now_ns()));
+            sent++;
+        }
+
+        /* writes the queue when the socket was full, and reads the Hello/NameAcquired noise */
+        while(r >= 0 && (r = sd_bus_process(publisher, NULL)) > 0)
+            ;
+
+        uint64_t queued = 0;
+        sd_bus_get_n_queued_write(publisher, &queued);
+        if(queued > 1024)
+            r = sd_bus_flush(publisher);
+        else if(rate) {
+            std::this_thread::sleep_until(begin + std::chrono::duration_cast<Clock::duration>(
+                                              std::chrono::duration<double>(double(sent) / double(rate))));
+        }
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+    if(r >= 0)
+        r = sd_bus_flush(publisher);
+
+    /* let the listener catch up, give up after one second without progress */
+    uint64_t lastReceived = 0;
+    Clock::time_point lastProgress = Clock::now();
+    while(listener->received < sent && Clock::now() - lastProgress < std::chrono::seconds(1)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        if(listener->received != lastReceived) {
+            lastReceived = listener->received;
+            lastProgress = Clock::now();
+        }
+    }
+    CpuSample cpuEnd = CpuSample::take(context.bus);
+    listenerThread.stop();
+    if(r < 0)
+        return r;
+
+    uint64_t received = listener->received;
+    JsonObject result;
+    result.add("workload", "heartbeat_rate")
+          .add("target_rate", rate)
+          .add("sent", sent)
+          .add("received", received)
+          .add("lost", sent - received)
+          .add("elapsed_s", elapsed)
+          .add("sent_per_s", double(sent) / elapsed)
+          .add("latency_ns", latency_json(listener->latency));
+    add_cpu_json(result, cpuBegin, cpuEnd);
+    context.results.push_back(result);
+
+    return 0;
+}
+
+int bench_heartbeat_rate(BenchContext& context) {
+    sd_bus *publisher = NULL;
+    int r;
+
+    r = context.bus.connect(&publisher);
+    if(r < 0)
+        return r;
+
+    r = sd_bus_request_name(publisher, "org.nicolas.PublisherExample", 0);
+    for(uint64_t rate : context.options.rates) {
+        if(r < 0)
+            break;
+        r = run_heartbeat_rate(context, publisher, rate);
+    }
+
+    sd_bus_flush_close_unref(publisher);
+    return r < 0 ? r : 0;
+}
+
+int bench_concurrent_clients(BenchContext& context) {
+    BusThread server;
+
+    int r = server.start(context.bus, add_server_object);
+    if(r < 0)
+        return r;
+
+    for(uint64_t clientCount : context.options.clients) {
+        std::vector<std::thread> clients;
+        std::vector<LatencyHistogram> latencies(clientCount);
+        std::vector<uint64_t> calls(clientCount, 0);
+        std::atomic<uint64_t> ready = 0;
+        std::atomic_bool go = false;
+        std::atomic_int failure = 0;
+        Clock::time_point deadline;
+
+        std::cerr << "clients: " << clientCount << " concurrent clients" << std::endl;
+
+        for(uint64_t i = 0; i < clientCount; i++) {
+            clients.emplace_back([&, i]() {
+                sd_bus *bus = NULL;
+                int r = context.bus.connect(&bus);
+                if(r < 0)
+                    failure = r;
+                ready++;
+                while(!go)
+                    std::this_thread::yield();
+
+                while(r >= 0 && Clock::now() < deadline) {
+                    r = call_greating(bus, "client", latencies[i]);
+                    calls[i]++;
+                }
+                if(r < 0)
+                    failure = r;
+                sd_bus_flush_close_unref(bus);
+            });
+        }
+
+        /* connection setup is not part of the measurement */
+        while(ready < clientCount)
+            std::this_thread::yield();
+
+        CpuSample cpuBegin = CpuSample::take(context.bus);
+        Clock::time_point begin = Clock::now();
+        deadline = deadline_after(context.options.duration);
+        go = true;
+        for(std::thread& client : clients)
+            client.join();
+        double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+        CpuSample cpuEnd = CpuSample::take(context.bus);
+
+        if(failure < 0)
+            return failure;
+
+        LatencyHistogram latency;
+        uint64_t totalCalls = 0;
+        for(uint64_t i = 0; i < clientCount; i++) {
+            latency.merge(latencies[i]);
+            totalCalls += calls[i];
+        }
+
+        JsonObject result;
+        result.add("workload", "concurrent_clients")
+              .add("clients", clientCount)
+              .add("calls", totalCalls)
+              .add("elapsed_s", elapsed)
+              .add("calls_per_s", double(totalCalls) / elapsed)
+              .add("latency_ns", latency_json(latency));
+        add_cpu_json(result, cpuBegin, cpuEnd);
+        context.results.push_back(result);
+    }
+
+    return 0;
+}
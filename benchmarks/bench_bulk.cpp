@@ -0,0 +1,65 @@
+#include "bench.h"
+#include "bulk_transfer.h"
+
+#include <iostream>
+
+/*
+ * BulkTransfer (sealed memfd passed as unix fd) against BulkTransferArray ("ay" copied in the message).
+ * Both paths fill the buffer on the client side and checksum it on the server side, the difference is
+ * what the bus does with the data. Cpu per GB counts this process (client and server threads) and the broker.
+ */
+int bench_bulk_transfer(BenchContext& context) {
+    BusThread server;
+    sd_bus *bus = NULL;
+
+    int r = server.start(context.bus, add_server_object);
+    if(r < 0)
+        return r;
+
+    r = context.bus.connect(&bus);
+    if(r < 0)
+        return r;
+
+    for(uint64_t size : context.options.bulkSizes) {
+        for(bool asArray : {false, true}) {
+            LatencyHistogram latency;
+            uint64_t transfers = 0;
+
+            std::cerr << "bulk: " << size << " bytes as " << (asArray ? "ay" : "memfd") << std::endl;
+
+            CpuSample cpuBegin = CpuSample::take(context.bus);
+            Clock::time_point begin = Clock::now();
+            Clock::time_point deadline = deadline_after(context.options.duration);
+            /* a few transfers at least, large buffers can take longer than the duration */
+            while(r >= 0 && (transfers < 3 || Clock::now() < deadline)) {
+                uint64_t start = now_ns();
+                r = bulk_transfer_call(bus, asArray, size, transfers);
+                latency.record(now_ns() - start);
+                transfers++;
+            }
+            double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+            CpuSample cpuEnd = CpuSample::take(context.bus);
+            if(r < 0)
+                break;
+
+            double gigabytes = double(transfers * size) / 1e9;
+            JsonObject result;
+            result.add("workload", "bulk_transfer")
+                  .add("mode", asArray ? "ay" : "memfd")
+                  .add("bytes", size)
+                  .add("transfers", transfers)
+                  .add("elapsed_s", elapsed)
+                  .add("mb_per_s", gigabytes * 1e3 / elapsed)
+                  .add("bench_cpu_s_per_gb", (cpuEnd.self - cpuBegin.self) / gigabytes)
+                  .add("broker_cpu_s_per_gb", (cpuEnd.broker - cpuBegin.broker) / gigabytes)
+                  .add("latency_ns", latency_json(latency));
+            add_cpu_json(result, cpuBegin, cpuEnd);
+            context.results.push_back(result);
+        }
+        if(r < 0)
+            break;
+    }
+
+    sd_bus_flush_close_unref(bus);
+    return r < 0 ? r : 0;
+}
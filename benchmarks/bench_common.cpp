@@ -0,0 +1,251 @@
+#include "bench.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <future>
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+std::string json_quote(const std::string& s) {
+    std::string out = "\"";
+    for(char c : s) {
+        switch(c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if((unsigned char) c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            }
+            else
+                out += c;
+        }
+    }
+    return out + "\"";
+}
+
+JsonObject& JsonObject::addRaw(const std::string& key, const std::string& json) {
+    fields.emplace_back(key, json);
+    return *this;
+}
+
+JsonObject& JsonObject::add(const std::string& key, const std::string& value) {
+    return addRaw(key, json_quote(value));
+}
+
+JsonObject& JsonObject::add(const std::string& key, double value) {
+    if(!std::isfinite(value))
+        return addRaw(key, "null");
+    std::ostringstream s;
+    s << std::setprecision(6) << value;
+    return addRaw(key, s.str());
+}
+
+JsonObject& JsonObject::add(const std::string& key, uint64_t value) {
+    return addRaw(key, std::to_string(value));
+}
+
+std::string JsonObject::str() const {
+    std::string out = "{";
+    for(size_t i = 0; i < fields.size(); i++) {
+        out += i ? ", " : "";
+        out += json_quote(fields[i].first) + ": " + fields[i].second;
+    }
+    return out + "}";
+}
+
+JsonObject latency_json(const LatencyHistogram& histogram) {
+    JsonObject latency;
+    latency.add("count", histogram.count())
+           .add("min", histogram.min())
+           .add("mean", histogram.mean())
+           .add("p50", histogram.percentile(50))
+           .add("p90", histogram.percentile(90))
+           .add("p99", histogram.percentile(99))
+           .add("p999", histogram.percentile(99.9))
+           .add("max", histogram.max());
+    return latency;
+}
+
+CpuSample CpuSample::take(const PrivateBus& bus) {
+    struct rusage usage;
+    CpuSample sample;
+
+    getrusage(RUSAGE_SELF, &usage);
+    sample.self = double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+                + double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    sample.broker = bus.cpuSeconds();
+    return sample;
+}
+
+void add_cpu_json(JsonObject& result, const CpuSample& begin, const CpuSample& end) {
+    result.add("bench_cpu_s", end.self - begin.self);
+    result.add("broker_cpu_s", end.broker - begin.broker);
+}
+
+int bus_wait_with_fd(sd_bus *bus, int fd, uint64_t timeoutUsec) {
+    struct pollfd pfds[2] = {
+        {sd_bus_get_fd(bus), short(sd_bus_get_events(bus)), 0},
+        {fd, POLLIN, 0},
+    };
+    uint64_t busTimeout = UINT64_MAX;
+    int timeoutMs = timeoutUsec == UINT64_MAX ? -1 : int((timeoutUsec + 999) / 1000);
+
+    if(pfds[0].events < 0)
+        return pfds[0].events;
+
+    /* sd_bus_get_timeout gives an absolute CLOCK_MONOTONIC deadline, e.g. for pending method calls */
+    if(sd_bus_get_timeout(bus, &busTimeout) > 0 && busTimeout != UINT64_MAX) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t now = uint64_t(ts.tv_sec) * 1000000 + uint64_t(ts.tv_nsec) / 1000;
+        int busMs = busTimeout > now ? int((busTimeout - now + 999) / 1000) : 0;
+        if(timeoutMs < 0 || busMs < timeoutMs)
+            timeoutMs = busMs;
+    }
+
+    int r = poll(pfds, fd >= 0 ? 2 : 1, timeoutMs);
+    if(r < 0)
+        return errno == EINTR ? 0 : -errno;
+    return r;
+}
+
+BusThread::~BusThread() {
+    stop();
+}
+
+int BusThread::start(const PrivateBus& privateBus, Setup setup) {
+    sd_bus *bus = NULL;
+
+    int r = privateBus.connect(&bus);
+    if(r < 0)
+        return r;
+
+    return start(bus, setup);
+}
+
+int BusThread::start(sd_bus *bus, Setup setup) {
+    std::promise<int> setupDone;
+    std::future<int> setupResult = setupDone.get_future();
+    int r;
+
+    wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(wakeFd < 0) {
+        sd_bus_unref(bus);
+        return -errno;
+    }
+
+    stopping = false;
+    thread = std::thread([this, bus, setup, &setupDone]() {
+        int r = setup(bus);
+        setupDone.set_value(r < 0 ? r : 0);
+        if(r >= 0)
+            run(bus);
+        sd_bus_flush_close_unref(bus);
+    });
+
+    r = setupResult.get();
+    if(r < 0)
+        stop();
+    return r;
+}
+
+void BusThread::stop() {
+    if(thread.joinable()) {
+        stopping = true;
+        uint64_t one = 1;
+        if(write(wakeFd, &one, sizeof(one)) < 0)
+            std::cerr << "Failed to wake bus thread: " << strerror(errno) << std::endl;
+        thread.join();
+    }
+    if(wakeFd >= 0) {
+        close(wakeFd);
+        wakeFd = -1;
+    }
+}
+
+void BusThread::run(sd_bus *bus) {
+    while(!stopping) {
+        int r = sd_bus_process(bus, NULL);
+        if(r < 0) {
+            std::cerr << "Failed to process bus: " << strerror(-r) << std::endl;
+            break;
+        }
+        if(r > 0)
+            continue;
+
+        r = bus_wait_with_fd(bus, wakeFd, UINT64_MAX);
+        if(r < 0) {
+            std::cerr << "Failed to wait on bus: " << strerror(-r) << std::endl;
+            break;
+        }
+    }
+}
+
+uint64_t now_ns() {
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count());
+}
+
+Clock::time_point deadline_after(double seconds) {
+    return Clock::now() + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(seconds));
+}
+
+void parse_size_list(const char *arg, std::vector<uint64_t>& out) {
+    std::istringstream s(arg);
+    std::string item;
+
+    out.clear();
+    while(std::getline(s, item, ','))
+        out.push_back(strtoull(item.c_str(), NULL, 0));
+}
+
+std::string default_bus_address() {
+    const char *address = getenv("DBUS_SESSION_BUS_ADDRESS");
+    const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+
+    if(address)
+        return address;
+    if(runtimeDir)
+        return std::string("unix:path=") + runtimeDir + "/bus";
+    return {};
+}
+
+int64_t rss_kb(pid_t pid) {
+    std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+    std::string line;
+
+    while(std::getline(status, line))
+        if(line.compare(0, 6, "VmRSS:") == 0)
+            return strtoll(line.c_str() + 6, NULL, 10);
+    return -1;
+}
+
+pid_t owner_pid(sd_bus *bus, const char *name) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *reply = NULL;
+    uint32_t pid = 0;
+
+    int r = sd_bus_call_method(bus, "org.freedesktop.DBus", "/org/freedesktop/DBus", "org.freedesktop.DBus",
+                               "GetConnectionUnixProcessID", &error, &reply, "s", name);
+    if(r >= 0)
+        r = sd_bus_message_read(reply, "u", &pid);
+    if(r < 0)
+        std::cerr << "Failed to get the pid of " << name << ": " << (error.message ? error.message : strerror(-r)) << std::endl;
+
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(reply);
+    return r < 0 ? -1 : pid_t(pid);
+}
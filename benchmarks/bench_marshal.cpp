@@ -0,0 +1,182 @@
+#include "bench.h"
+#include "typed_bus.h"
+
+#include <iostream>
+#include <tuple>
+
+/*
+ * Marshalling cost only, no message is sent: the varargs sd_bus_message_append/read with a format string
+ * against the typed_bus.h path (one append_basic/read_basic per field, signature known at compile time).
+ * Messages are created on a private bus connection since sd-bus needs one, but never leave this process.
+ * Creating a message costs more than marshalling a few fields, so append cases put itemsPerMessage
+ * items in each message and report the time per item.
+ */
+
+static const unsigned itemsPerMessage = 64;
+
+using UnitEntry = std::tuple<const char*, const char*, const char*, const char*, const char*, const char*,
+                             typed_bus::ObjectPath, uint32_t, const char*, typed_bus::ObjectPath>;
+
+static int new_signal(sd_bus *bus, const char *member, sd_bus_message **m) {
+    return sd_bus_message_new_signal(bus, m, "/org/nicolas/PublisherExample", "org.nicolas.PublisherExample", member);
+}
+
+/* runs op until the deadline, checking the clock every 256 iterations, returns ns per op */
+template<typename Op>
+static double measure(double duration, uint64_t& ops, Op op) {
+    Clock::time_point begin = Clock::now();
+    Clock::time_point deadline = deadline_after(duration);
+    int r = 0;
+
+    ops = 0;
+    do {
+        for(unsigned i = 0; i < 256 && r >= 0; i++, ops++)
+            r = op(ops);
+    } while(r >= 0 && Clock::now() < deadline);
+    if(r < 0)
+        return r;
+
+    return std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / double(ops);
+}
+
+static int heartbeat_varargs(sd_bus *bus, uint64_t i) {
+    sd_bus_message *m = NULL;
+    int r = new_signal(bus, "HeartBeat", &m);
+    for(unsigned j = 0; j < itemsPerMessage && r >= 0; j++)
+        r = sd_bus_message_append(m, "tx", i, int64_t(j));
+    sd_bus_message_unref(m);
+    return r;
+}
+
+static int heartbeat_typed(sd_bus *bus, uint64_t i) {
+    sd_bus_message *m = NULL;
+    int r = new_signal(bus, "HeartBeat", &m);
+    for(unsigned j = 0; j < itemsPerMessage && r >= 0; j++)
+        r = typed_bus::append(m, i, int64_t(j));
+    sd_bus_message_unref(m);
+    return r;
+}
+
+static int unit_varargs(sd_bus *bus, uint64_t i) {
+    sd_bus_message *m = NULL;
+    int r = new_signal(bus, "UnitEntry", &m);
+    for(unsigned j = 0; j < itemsPerMessage && r >= 0; j++)
+        r = sd_bus_message_append(m, "(ssssssouso)", "cups.service", "CUPS Scheduler", "loaded", "active", "running", "",
+                                  "/org/freedesktop/systemd1/unit/cups_2eservice", uint32_t(i), "", "/");
+    sd_bus_message_unref(m);
+    return r;
+}
+
+static int unit_typed(sd_bus *bus, uint64_t i) {
+    sd_bus_message *m = NULL;
+    int r = new_signal(bus, "UnitEntry", &m);
+    for(unsigned j = 0; j < itemsPerMessage && r >= 0; j++)
+        r = typed_bus::append(m, UnitEntry{"cups.service", "CUPS Scheduler", "loaded", "active", "running", "",
+                                           {"/org/freedesktop/systemd1/unit/cups_2eservice"}, uint32_t(i), "", {"/"}});
+    sd_bus_message_unref(m);
+    return r;
+}
+
+/* a sealed message with one of each, to measure reading alone */
+static int sealed_sample(sd_bus *bus, sd_bus_message **ret) {
+    sd_bus_message *m = NULL;
+    int r = new_signal(bus, "Sample", &m);
+    if(r >= 0)
+        r = sd_bus_message_append(m, "tx(ssssssouso)", uint64_t(1), int64_t(2),
+                                  "cups.service", "CUPS Scheduler", "loaded", "active", "running", "",
+                                  "/org/freedesktop/systemd1/unit/cups_2eservice", uint32_t(0), "", "/");
+    if(r >= 0)
+        r = sd_bus_message_seal(m, 1, 0);
+    if(r < 0) {
+        sd_bus_message_unref(m);
+        return r;
+    }
+    *ret = m;
+    return 0;
+}
+
+static int read_varargs(sd_bus_message *m) {
+    const char *s[8], *path, *jobPath;
+    uint64_t index;
+    int64_t time;
+    uint32_t job;
+
+    int r = sd_bus_message_rewind(m, 1);
+    if(r >= 0)
+        r = sd_bus_message_read(m, "tx(ssssssouso)", &index, &time,
+                                &s[0], &s[1], &s[2], &s[3], &s[4], &s[5], &path, &job, &s[6], &jobPath);
+    return r;
+}
+
+static int read_typed(sd_bus_message *m) {
+    uint64_t index;
+    int64_t time;
+    UnitEntry entry;
+
+    int r = sd_bus_message_rewind(m, 1);
+    if(r >= 0)
+        r = typed_bus::read(m, index, time, entry);
+    return r;
+}
+
+int bench_marshal(BenchContext& context) {
+    struct Case {
+        const char *name;
+        const char *mode;
+        int (*op)(sd_bus *bus, uint64_t i);
+    };
+    static const Case cases[] = {
+        {"heartbeat_append", "varargs", heartbeat_varargs},
+        {"heartbeat_append", "typed",   heartbeat_typed},
+        {"unit_append",      "varargs", unit_varargs},
+        {"unit_append",      "typed",   unit_typed},
+    };
+    sd_bus *bus = NULL;
+    sd_bus_message *sample = NULL;
+    uint64_t ops;
+    double ns;
+
+    int r = context.bus.connect(&bus);
+    if(r < 0)
+        return r;
+
+    for(const Case& c : cases) {
+        std::cerr << "marshal: " << c.name << " " << c.mode << std::endl;
+        ns = measure(context.options.duration, ops, [&](uint64_t i) { return c.op(bus, i); });
+        if(ns < 0) {
+            r = int(ns);
+            break;
+        }
+
+        JsonObject result;
+        result.add("workload", "marshal").add("case", c.name).add("mode", c.mode)
+              .add("ops", ops * itemsPerMessage).add("ns_per_op", ns / itemsPerMessage);
+        context.results.push_back(result);
+    }
+
+    if(r >= 0)
+        r = sealed_sample(bus, &sample);
+    for(bool typed : {false, true}) {
+        if(r < 0)
+            break;
+
+        std::cerr << "marshal: read " << (typed ? "typed" : "varargs") << std::endl;
+        ns = measure(context.options.duration, ops, [&](uint64_t) { return typed ? read_typed(sample) : read_varargs(sample); });
+        if(ns < 0) {
+            r = int(ns);
+            break;
+        }
+
+        JsonObject result;
+        result.add("workload", "marshal").add("case", "sample_read").add("mode", typed ? "typed" : "varargs")
+              .add("ops", ops).add("ns_per_op", ns);
+        context.results.push_back(result);
+    }
+
+    if(r < 0)
+        std::cerr << "Failed to marshal message: " << strerror(-r) << std::endl;
+
+    sd_bus_message_unref(sample);
+    sd_bus_flush_close_unref(bus);
+    return r < 0 ? r : 0;
+}
@@ -0,0 +1,123 @@
+#include "bench.h"
+
+#include <iostream>
+#include <cstring>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Same Greating server reached through the private broker, then through a direct peer to peer
+ * connection on a unix socket (what dbus_server --listen does), for each pipeline depth in --depths.
+ */
+
+static int connect_direct(int *listenFd, sd_bus **client, sd_bus **server) {
+    struct sockaddr_un address = {};
+    char directory[] = "/tmp/dbus-bench-p2p-XXXXXX";
+    sd_id128_t id;
+    int r;
+
+    if(!mkdtemp(directory))
+        return -errno;
+
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s/server.sock", directory);
+
+    *listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(*listenFd < 0 || bind(*listenFd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(*listenFd, 1) < 0) {
+        r = -errno;
+        goto cleanup;
+    }
+
+    /* the unix connect completes right away thanks to the backlog, authentication happens on the first call */
+    r = sd_bus_new(client);
+    if(r >= 0)
+        r = sd_bus_set_address(*client, ("unix:path=" + std::string(address.sun_path)).c_str());
+    if(r >= 0)
+        r = sd_bus_start(*client);
+    if(r < 0)
+        goto cleanup;
+
+    {
+        int fd = accept4(*listenFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if(fd < 0) {
+            r = -errno;
+            goto cleanup;
+        }
+        r = sd_bus_new(server);
+        if(r >= 0)
+            r = sd_bus_set_fd(*server, fd, fd);
+        else
+            close(fd);
+    }
+    if(r >= 0)
+        r = sd_id128_randomize(&id);
+    if(r >= 0)
+        r = sd_bus_set_server(*server, 1, id);
+    if(r >= 0)
+        r = sd_bus_start(*server);
+
+cleanup:
+    unlink(address.sun_path);
+    rmdir(directory);
+    return r;
+}
+
+static int measure(BenchContext& context, sd_bus *bus, const char *path, unsigned depth) {
+    LatencyHistogram latency;
+
+    std::cerr << "peer_to_peer: " << path << " depth " << depth << std::endl;
+
+    CpuSample cpuBegin = CpuSample::take(context.bus);
+    Clock::time_point begin = Clock::now();
+    int64_t calls = run_pipelined_greating(bus, depth, context.options.duration, latency);
+    double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+    CpuSample cpuEnd = CpuSample::take(context.bus);
+    if(calls < 0)
+        return int(calls);
+
+    JsonObject result;
+    result.add("workload", "peer_to_peer")
+          .add("path", path)
+          .add("depth", depth)
+          .add("calls", uint64_t(calls))
+          .add("elapsed_s", elapsed)
+          .add("calls_per_s", double(calls) / elapsed)
+          .add("latency_ns", latency_json(latency));
+    add_cpu_json(result, cpuBegin, cpuEnd);
+    context.results.push_back(result);
+    return 0;
+}
+
+int bench_peer_to_peer(BenchContext& context) {
+    BusThread brokeredServer, directServer;
+    sd_bus *brokered = NULL, *direct = NULL, *serverSide = NULL;
+    int listenFd = -1;
+    int r;
+
+    r = brokeredServer.start(context.bus, add_server_object);
+    if(r >= 0)
+        r = context.bus.connect(&brokered);
+    if(r >= 0)
+        r = connect_direct(&listenFd, &direct, &serverSide);
+    if(r >= 0) {
+        r = directServer.start(serverSide, add_server_vtable);
+        serverSide = NULL;
+    }
+
+    for(uint64_t depth : context.options.depths) {
+        if(r >= 0)
+            r = measure(context, brokered, "brokered", unsigned(depth));
+        if(r >= 0)
+            r = measure(context, direct, "direct", unsigned(depth));
+    }
+
+    if(listenFd >= 0)
+        close(listenFd);
+    sd_bus_unref(serverSide);
+    sd_bus_flush_close_unref(direct);
+    sd_bus_flush_close_unref(brokered);
+    return r < 0 ? r : 0;
+}
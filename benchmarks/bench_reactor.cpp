@@ -0,0 +1,260 @@
+#include "bench.h"
+
+#include <iostream>
+#include <memory>
+#include <cstring>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "bus_reactor.h"
+
+/*
+ * N Greating server connections served by N threads (one BusThread each, what one sd_bus_wait loop per
+ * connection gives) against the same N connections in one BusReactor thread, for each count in --clients
+ * and each pipeline depth in --depths.
+ * Connections are peer to peer socket pairs so the broker is not part of the picture, and the client side is
+ * the same in both cases: one thread, its own reactor, depth async calls in flight on every connection.
+ */
+
+struct ClientSide;
+
+struct ClientCall {
+    ClientSide *side;
+    uint64_t start;
+};
+
+struct ClientSide {
+    sd_bus *bus = NULL;
+    std::vector<ClientCall> calls;
+    LatencyHistogram *latency = nullptr;
+    Clock::time_point deadline;
+    uint64_t completed = 0;
+    unsigned inFlight = 0;
+    int error = 0;
+};
+
+static int issue_call(ClientCall *call);
+
+static int on_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    ClientCall *call = static_cast<ClientCall*>(userdata);
+    ClientSide *side = call->side;
+
+    side->latency->record(now_ns() - call->start);
+    side->inFlight--;
+    if(sd_bus_message_is_method_error(m, NULL))
+        side->error = -sd_bus_message_get_errno(m);
+    else
+        side->completed++;
+
+    if(side->error == 0 && Clock::now() < side->deadline) {
+        int r = issue_call(call);
+        if(r < 0)
+            side->error = r;
+    }
+    return 0;
+}
+
+static int issue_call(ClientCall *call) {
+    call->start = now_ns();
+    int r = sd_bus_call_method_async(call->side->bus, NULL,
+                                     "org.nicolas.ServerExample", "/org/nicolas/ServerExample",
+                                     "org.nicolas.ServerExample", "Greating",
+                                     on_reply, call, "s", "client");
+    if(r >= 0)
+        call->side->inFlight++;
+    return r;
+}
+
+/* both ends of a socket pair, the server one in server mode like dbus_server --listen does */
+static int connect_pair(sd_bus **client, sd_bus **server) {
+    int fds[2];
+    sd_id128_t id;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, fds) < 0)
+        return -errno;
+
+    int r = sd_bus_new(client);
+    if(r >= 0)
+        r = sd_bus_set_fd(*client, fds[0], fds[0]);
+    if(r >= 0)
+        r = sd_bus_start(*client);
+    if(r < 0) {
+        close(fds[1]);
+        return r;
+    }
+
+    r = sd_bus_new(server);
+    if(r >= 0)
+        r = sd_bus_set_fd(*server, fds[1], fds[1]);
+    else
+        close(fds[1]);
+    if(r >= 0)
+        r = sd_id128_randomize(&id);
+    if(r >= 0)
+        r = sd_bus_set_server(*server, 1, id);
+    if(r >= 0)
+        r = sd_bus_start(*server);
+    return r;
+}
+
+static uint64_t context_switches() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return uint64_t(usage.ru_nvcsw + usage.ru_nivcsw);
+}
+
+/* the server connections of the reactor case, in their own thread, stopped through an eventfd */
+class ReactorThread {
+public:
+    ~ReactorThread() { stop(); }
+
+    int start(const std::vector<sd_bus*>& servers) {
+        int r = reactor.open();
+        for(size_t i = 0; i < servers.size() && r >= 0; i++)
+            r = add_server_vtable(servers[i]);
+        for(size_t i = 0; i < servers.size() && r >= 0; i++)
+            r = reactor.add(servers[i]);
+        if(r >= 0) {
+            wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            r = wakeFd < 0 ? -errno : reactor.addFd(wakeFd, EPOLLIN, [this](uint32_t) { reactor.exit(0); return 0; });
+        }
+        if(r < 0)
+            return r;
+
+        thread = std::thread([this]() {
+            int r = reactor.run();
+            if(r < 0)
+                std::cerr << "Failed to run reactor: " << strerror(-r) << std::endl;
+        });
+        return 0;
+    }
+
+    void stop() {
+        if(thread.joinable()) {
+            uint64_t one = 1;
+            if(write(wakeFd, &one, sizeof(one)) < 0)
+                std::cerr << "Failed to wake reactor thread: " << strerror(errno) << std::endl;
+            thread.join();
+        }
+        if(wakeFd >= 0) {
+            close(wakeFd);
+            wakeFd = -1;
+        }
+    }
+
+private:
+    BusReactor reactor;
+    std::thread thread;
+    int wakeFd = -1;
+};
+
+static int measure(BenchContext& context, bool useReactor, unsigned connections, unsigned depth) {
+    std::vector<std::unique_ptr<ClientSide>> clients;
+    std::vector<sd_bus*> servers;
+    std::vector<std::unique_ptr<BusThread>> threads;
+    ReactorThread reactorThread;
+    BusReactor clientReactor;
+    LatencyHistogram latency;
+    const char *mode = useReactor ? "reactor" : "threads";
+    int r;
+
+    std::cerr << "reactor: " << connections << " connections, " << mode << ", depth " << depth << std::endl;
+
+    r = clientReactor.open();
+    for(unsigned i = 0; i < connections && r >= 0; i++) {
+        auto client = std::make_unique<ClientSide>();
+        sd_bus *server = NULL;
+
+        r = connect_pair(&client->bus, &server);
+        if(server)
+            servers.push_back(server);
+        if(r >= 0)
+            r = clientReactor.add(client->bus);
+        client->latency = &latency;
+        client->calls.resize(depth, ClientCall{client.get(), 0});
+        clients.push_back(std::move(client));
+    }
+
+    if(r >= 0 && useReactor)
+        r = reactorThread.start(servers);
+    else if(r >= 0) {
+        /* BusThread takes ownership of its connection */
+        for(sd_bus *server : servers) {
+            threads.push_back(std::make_unique<BusThread>());
+            r = threads.back()->start(sd_bus_ref(server), add_server_vtable);
+            if(r < 0)
+                break;
+        }
+    }
+
+    CpuSample cpuBegin = CpuSample::take(context.bus);
+    uint64_t switchesBegin = context_switches();
+    Clock::time_point begin = Clock::now();
+    Clock::time_point deadline = deadline_after(context.options.duration);
+    for(auto& client : clients) {
+        client->deadline = deadline;
+        for(ClientCall& call : client->calls)
+            if(r >= 0)
+                r = issue_call(&call);
+    }
+
+    unsigned inFlight = 1;
+    while(r >= 0 && inFlight > 0) {
+        r = clientReactor.runOnce(UINT64_MAX);
+        inFlight = 0;
+        for(auto& client : clients) {
+            inFlight += client->inFlight;
+            if(client->error < 0)
+                r = client->error;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+    uint64_t switches = context_switches() - switchesBegin;
+    CpuSample cpuEnd = CpuSample::take(context.bus);
+
+    reactorThread.stop();
+    threads.clear();
+    for(sd_bus *server : servers)
+        sd_bus_flush_close_unref(server);
+    for(auto& client : clients)
+        sd_bus_flush_close_unref(client->bus);
+    if(r < 0)
+        return r;
+
+    uint64_t calls = 0;
+    for(auto& client : clients)
+        calls += client->completed;
+
+    JsonObject result;
+    result.add("workload", "reactor")
+          .add("mode", mode)
+          .add("connections", connections)
+          .add("server_threads", useReactor ? 1u : connections)
+          .add("depth", depth)
+          .add("calls", calls)
+          .add("elapsed_s", elapsed)
+          .add("calls_per_s", double(calls) / elapsed)
+          .add("context_switches", switches)
+          .add("latency_ns", latency_json(latency));
+    add_cpu_json(result, cpuBegin, cpuEnd);
+    context.results.push_back(result);
+    return 0;
+}
+
+int bench_reactor(BenchContext& context) {
+    int r = 0;
+
+    for(uint64_t connections : context.options.clients)
+        for(uint64_t depth : context.options.depths) {
+            if(r >= 0)
+                r = measure(context, false, unsigned(connections), unsigned(depth));
+            if(r >= 0)
+                r = measure(context, true, unsigned(connections), unsigned(depth));
+        }
+
+    return r < 0 ? r : 0;
+}
@@ -0,0 +1,235 @@
+#include "bench.h"
+
+#include <iostream>
+#include <memory>
+#include <cstring>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+/*
+ * 100 listeners, each one interested in one of 100 topics of TopicHeartBeat(s topic, t index, x timestamp)
+ * (dbus_publisher --topics), for each aggregate message rate in --topic-rates:
+ * - arg0: the match rule has arg0='topicN', the broker only routes a listener its own topic
+ * - member: the match rule only has the member, every listener gets every topic and drops the others
+ * We count the messages each listener got, the ones it wanted, how often its thread woke up from poll,
+ * and the cpu of the listener threads and of the broker.
+ */
+
+static const unsigned topicCount = 100;
+static const unsigned listenerCount = 100;
+
+struct TopicListener {
+    std::string topic;
+    sd_bus *bus = NULL;
+    std::thread thread;
+    int wakeFd = -1;
+    std::atomic_bool stopping = false;
+
+    std::atomic<uint64_t> delivered = 0;
+    std::atomic<uint64_t> wanted = 0;
+    uint64_t wakeups = 0;
+    double cpuSeconds = 0.0;
+
+    ~TopicListener() {
+        stop();
+        sd_bus_flush_close_unref(bus);
+        if(wakeFd >= 0)
+            close(wakeFd);
+    }
+
+    void stop() {
+        if(!thread.joinable())
+            return;
+        stopping = true;
+        uint64_t one = 1;
+        if(write(wakeFd, &one, sizeof(one)) < 0)
+            std::cerr << "Failed to wake listener thread: " << strerror(errno) << std::endl;
+        thread.join();
+    }
+};
+
+static int on_topic_beat(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    TopicListener *listener = static_cast<TopicListener*>(userdata);
+    const char *topic;
+
+    listener->delivered.fetch_add(1, std::memory_order_relaxed);
+    if(sd_bus_message_read_basic(m, 's', &topic) > 0 && listener->topic == topic)
+        listener->wanted.fetch_add(1, std::memory_order_relaxed);
+    return 1;
+}
+
+static double thread_cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return double(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)
+         + double(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/* like BusThread, but counting the times poll returned */
+static void listen(TopicListener *listener) {
+    double cpuBegin = thread_cpu_seconds();
+
+    while(!listener->stopping) {
+        int r = sd_bus_process(listener->bus, NULL);
+        if(r > 0)
+            continue;
+        if(r >= 0)
+            r = bus_wait_with_fd(listener->bus, listener->wakeFd, UINT64_MAX);
+        if(r < 0) {
+            std::cerr << "Failed to process listener bus: " << strerror(-r) << std::endl;
+            break;
+        }
+        listener->wakeups++;
+    }
+
+    listener->cpuSeconds = thread_cpu_seconds() - cpuBegin;
+}
+
+/* AddMatch is synchronous, done here before the bus moves to its thread */
+static int start_listener(BenchContext& context, TopicListener *listener, bool brokerFilter) {
+    std::string rule = "type='signal',path='/org/nicolas/PublisherExample',"
+                       "interface='org.nicolas.PublisherExample',member='TopicHeartBeat'";
+    if(brokerFilter)
+        rule += ",arg0='" + listener->topic + "'";
+
+    listener->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(listener->wakeFd < 0)
+        return -errno;
+
+    int r = context.bus.connect(&listener->bus);
+    if(r >= 0)
+        r = sd_bus_add_match(listener->bus, NULL, rule.c_str(), on_topic_beat, listener);
+    if(r < 0)
+        return r;
+
+    listener->thread = std::thread(listen, listener);
+    return 0;
+}
+
+static int run_topics(BenchContext& context, sd_bus *publisher, bool brokerFilter, uint64_t rate) {
+    std::vector<std::unique_ptr<TopicListener>> listeners;
+    const char *mode = brokerFilter ? "arg0" : "member";
+    uint64_t sent = 0;
+    int r = 0;
+
+    std::cerr << "topics: " << listenerCount << " listeners, " << topicCount << " topics, " << mode
+              << " match, " << rate << " messages/s" << std::endl;
+
+    for(unsigned i = 0; i < listenerCount && r >= 0; i++) {
+        listeners.push_back(std::make_unique<TopicListener>());
+        listeners.back()->topic = "topic" + std::to_string(i % topicCount);
+        r = start_listener(context, listeners.back().get(), brokerFilter);
+    }
+    if(r < 0)
+        return r;
+
+    CpuSample cpuBegin = CpuSample::take(context.bus);
+    Clock::time_point begin = Clock::now();
+    Clock::time_point deadline = deadline_after(context.options.duration);
+    for(Clock::time_point now = begin; now < deadline && r >= 0; now = Clock::now()) {
+        double elapsed = std::chrono::duration<double>(now - begin).count();
+        uint64_t due = uint64_t(elapsed * double(rate)) + 1;
+
+        /* message k is beat k / topicCount on topic k % topicCount */
+        while(sent < due && r >= 0) {
+            std::string topic = "topic" + std::to_string(sent % topicCount);
+            r = sd_bus_emit_signal(publisher,
+                                   "/org/nicolas/PublisherExample",
+                                   "org.nicolas.PublisherExample",
+                                   "TopicHeartBeat",
+                                   "stx",
+                                   topic.c_str(),
+                                   sent / topicCount,
+                                   int64_t(now_ns()));
+            sent++;
+        }
+
+        while(r >= 0 && (r = sd_bus_process(publisher, NULL)) > 0)
+            ;
+
+        uint64_t queued = 0;
+        sd_bus_get_n_queued_write(publisher, &queued);
+        if(queued > 1024)
+            r = sd_bus_flush(publisher);
+        else
+            std::this_thread::sleep_until(begin + std::chrono::duration_cast<Clock::duration>(
+                                              std::chrono::duration<double>(double(sent) / double(rate))));
+    }
+    double elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+    if(r >= 0)
+        r = sd_bus_flush(publisher);
+
+    /* every listener gets its share, and with a member match everything else too */
+    uint64_t expectedWanted = sent / topicCount * listenerCount;
+    uint64_t expected = brokerFilter ? expectedWanted : sent * listenerCount;
+
+    /* let the listeners catch up, give up after one second without progress */
+    uint64_t delivered = 0, lastDelivered = 0;
+    Clock::time_point lastProgress = Clock::now();
+    for(;;) {
+        delivered = 0;
+        for(auto& listener : listeners)
+            delivered += listener->delivered;
+        if(delivered >= expected || Clock::now() - lastProgress > std::chrono::seconds(1))
+            break;
+        if(delivered != lastDelivered) {
+            lastDelivered = delivered;
+            lastProgress = Clock::now();
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    double drained = std::chrono::duration<double>(Clock::now() - begin).count();
+    CpuSample cpuEnd = CpuSample::take(context.bus);
+
+    uint64_t wanted = 0, wakeups = 0;
+    double listenerCpu = 0.0;
+    for(auto& listener : listeners) {
+        listener->stop();
+        wanted += listener->wanted;
+        wakeups += listener->wakeups;
+        listenerCpu += listener->cpuSeconds;
+    }
+    if(r < 0)
+        return r;
+
+    JsonObject result;
+    result.add("workload", "topics")
+          .add("match", mode)
+          .add("listeners", listenerCount)
+          .add("topics", topicCount)
+          .add("target_rate", rate)
+          .add("sent", sent)
+          .add("delivered", delivered)
+          .add("wanted", wanted)
+          .add("lost", expectedWanted - std::min(wanted, expectedWanted))
+          .add("wakeups", wakeups)
+          .add("wakeups_per_wanted", wanted ? double(wakeups) / double(wanted) : 0.0)
+          .add("elapsed_s", elapsed)
+          .add("drained_s", drained)
+          .add("listener_cpu_s", listenerCpu);
+    add_cpu_json(result, cpuBegin, cpuEnd);
+    context.results.push_back(result);
+    return 0;
+}
+
+int bench_topics(BenchContext& context) {
+    sd_bus *publisher = NULL;
+    int r;
+
+    r = context.bus.connect(&publisher);
+    if(r < 0)
+        return r;
+
+    for(uint64_t rate : context.options.topicRates) {
+        if(r >= 0 && rate > 0)
+            r = run_topics(context, publisher, false, rate);
+        if(r >= 0 && rate > 0)
+            r = run_topics(context, publisher, true, rate);
+    }
+
+    sd_bus_flush_close_unref(publisher);
+    return r < 0 ? r : 0;
+}
@@ -0,0 +1,180 @@
+#include "bench.h"
+#include "mock_manager.h"
+#include "unit_list_reader.h"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include <malloc.h>
+
+/*
+ * ListUnits replies with --unit-counts synthetic units from a MockManager running on a bus thread,
+ * parsed either the naive way (sd_bus_message_read of each "(ssssssouso)" into a vector of std::string structs)
+ * or with read_unit_list (string_views into the message, nothing allocated per entry). Both count active units.
+ *
+ * Parse time does not include the call, which is reported apart. Peak RSS is read from VmHWM after resetting it
+ * through /proc/self/clear_refs once the reply is received, so it is the memory the parsing itself needed.
+ */
+
+struct MaterializedUnit {
+    std::string name;
+    std::string description;
+    std::string loadState;
+    std::string activeState;
+    std::string subState;
+    std::string following;
+    std::string path;
+    uint32_t jobId;
+    std::string jobType;
+    std::string jobPath;
+};
+
+/* kB, from /proc/self/status */
+static long proc_status_kb(const char *field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t length = strlen(field);
+
+    while(std::getline(status, line))
+        if(line.compare(0, length, field) == 0 && line[length] == ':')
+            return strtol(line.c_str() + length + 1, NULL, 10);
+    return -1;
+}
+
+/* "5" resets the peak RSS of the process to its current RSS */
+static bool reset_peak_rss() {
+    std::ofstream clearRefs("/proc/self/clear_refs");
+    clearRefs << "5" << std::endl;
+    return bool(clearRefs);
+}
+
+static int64_t parse_materialized(sd_bus_message *m, uint64_t *active) {
+    std::vector<MaterializedUnit> units;
+    const char *s[9];
+    uint32_t jobId;
+
+    int r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(ssssssouso)");
+    while(r > 0) {
+        r = sd_bus_message_read(m, "(ssssssouso)", &s[0], &s[1], &s[2], &s[3], &s[4], &s[5], &s[6], &jobId, &s[7], &s[8]);
+        if(r > 0)
+            units.push_back(MaterializedUnit{s[0], s[1], s[2], s[3], s[4], s[5], s[6], jobId, s[7], s[8]});
+    }
+    if(r >= 0)
+        r = sd_bus_message_exit_container(m);
+    if(r < 0)
+        return r;
+
+    for(const MaterializedUnit& unit : units)
+        *active += unit.activeState == "active";
+    return int64_t(units.size());
+}
+
+static int64_t parse_streaming(sd_bus_message *m, uint64_t *active) {
+    return read_unit_list(m, [active](const UnitListEntry& entry) {
+        *active += entry.activeState == "active";
+        return true;
+    });
+}
+
+static int list_units(sd_bus *bus, sd_bus_message **reply) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+
+    int r = sd_bus_call_method(bus, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+                               "org.freedesktop.systemd1.Manager", "ListUnits", &error, reply, "");
+    if(r < 0)
+        std::cerr << "Failed to list units: " << (error.message ? error.message : strerror(-r)) << std::endl;
+
+    sd_bus_error_free(&error);
+    return r;
+}
+
+int bench_unit_list(BenchContext& context) {
+    sd_bus *bus = NULL;
+    int r = context.bus.connect(&bus);
+    if(r < 0)
+        return r;
+
+    for(uint64_t count : context.options.unitCounts) {
+        MockManager manager;
+        BusThread server;
+
+        /* no event loop, jobs are not used here */
+        r = server.start(context.bus, [&manager, count](sd_bus *serverBus) {
+            for(uint64_t i = 0; i < count; i++)
+                manager.addUnit("mock-" + std::to_string(i) + ".service", "Synthetic unit " + std::to_string(i), i % 2 == 0);
+            int r = manager.attach(serverBus, NULL, MockManager::Options());
+            if(r >= 0)
+                r = sd_bus_request_name(serverBus, "org.freedesktop.systemd1", 0);
+            return r;
+        });
+        if(r < 0)
+            break;
+
+        for(bool streaming : {false, true}) {
+            LatencyHistogram parseTime, callTime;
+            long peakKb = 0;
+            uint64_t active = 0;
+            int64_t parsed = 0;
+            unsigned iterations = 0;
+
+            std::cerr << "unit_list: " << count << " units, " << (streaming ? "streaming" : "materialized") << std::endl;
+
+            Clock::time_point deadline = deadline_after(context.options.duration);
+            while(r >= 0 && (iterations < 3 || Clock::now() < deadline)) {
+                sd_bus_message *reply = NULL;
+
+                uint64_t start = now_ns();
+                r = list_units(bus, &reply);
+                callTime.record(now_ns() - start);
+                if(r < 0)
+                    break;
+
+                /* give back what the previous iteration freed, so it does not hide this one's peak */
+                malloc_trim(0);
+                long rssBefore = proc_status_kb("VmRSS");
+                bool reset = reset_peak_rss();
+
+                active = 0;
+                start = now_ns();
+                parsed = streaming ? parse_streaming(reply, &active) : parse_materialized(reply, &active);
+                parseTime.record(now_ns() - start);
+
+                if(reset)
+                    peakKb = std::max(peakKb, proc_status_kb("VmHWM") - rssBefore);
+                else
+                    peakKb = -1;
+                sd_bus_message_unref(reply);
+                iterations++;
+
+                if(parsed < 0)
+                    r = int(parsed);
+                else if(uint64_t(parsed) != count)
+                    r = -EBADMSG;
+            }
+            if(r < 0)
+                break;
+
+            JsonObject result;
+            result.add("workload", "unit_list")
+                  .add("mode", streaming ? "streaming" : "materialized")
+                  .add("units", count)
+                  .add("active", active)
+                  .add("iterations", iterations)
+                  .add("parse_ns_per_unit", parseTime.mean() / double(count))
+                  .add("parse_ns", latency_json(parseTime))
+                  .add("call_ns", latency_json(callTime))
+                  .add("peak_rss_delta_kb", int64_t(peakKb));
+            context.results.push_back(result);
+        }
+
+        server.stop();
+        if(r < 0)
+            break;
+    }
+
+    sd_bus_flush_close_unref(bus);
+    return r < 0 ? r : 0;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <errno.h>
+
+/*
+ * File written by dbus_capture and read by dbus_replay:
+ *   "DBUSCAP1"                         8 bytes of magic
+ *   then records until the end:
+ *   u64 time                           nanoseconds since the start of the capture
+ *   u32 size                           of the message
+ *   size bytes                         the message as it was on the wire, header and body
+ * The two integers are in host byte order, the messages carry their own.
+ */
+
+static const char captureMagic[8] = {'D', 'B', 'U', 'S', 'C', 'A', 'P', '1'};
+
+class CaptureWriter {
+public:
+    ~CaptureWriter() { close(); }
+
+    int open(const std::string& path) {
+        file = fopen(path.c_str(), "wbe");
+        if(!file)
+            return -errno;
+        return fwrite(captureMagic, sizeof(captureMagic), 1, file) == 1 ? 0 : -EIO;
+    }
+
+    int write(uint64_t timeNs, const std::string& message) {
+        uint32_t size = uint32_t(message.size());
+        if(fwrite(&timeNs, sizeof(timeNs), 1, file) != 1
+           || fwrite(&size, sizeof(size), 1, file) != 1
+           || fwrite(message.data(), 1, size, file) != size)
+            return -EIO;
+        return 0;
+    }
+
+    int close() {
+        if(!file)
+            return 0;
+        int r = fclose(file) == 0 ? 0 : -errno;
+        file = NULL;
+        return r;
+    }
+
+private:
+    FILE *file = NULL;
+};
+
+class CaptureReader {
+public:
+    ~CaptureReader() {
+        if(file)
+            fclose(file);
+    }
+
+    int open(const std::string& path) {
+        char magic[sizeof(captureMagic)];
+
+        file = fopen(path.c_str(), "rbe");
+        if(!file)
+            return -errno;
+        if(fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, captureMagic, sizeof(magic)) != 0)
+            return -EBADMSG;
+        return 0;
+    }
+
+    /* 1 with the next record, 0 at the end of the file */
+    int next(uint64_t& timeNs, std::string& message) {
+        uint32_t size;
+
+        if(fread(&timeNs, sizeof(timeNs), 1, file) != 1)
+            return feof(file) ? 0 : -EIO;
+        if(fread(&size, sizeof(size), 1, file) != 1)
+            return -EBADMSG;
+        message.resize(size);
+        if(fread(message.data(), 1, size, file) != size)
+            return -EBADMSG;
+        return 1;
+    }
+
+private:
+    FILE *file = NULL;
+};
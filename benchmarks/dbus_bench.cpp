@@ -0,0 +1,145 @@
+#include <iostream>
+#include <algorithm>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include "bench.h"
+
+/*
+ * Self contained benchmark suite: we start a private dbus-daemon on a temporary socket,
+ * run the example server / publisher / listener logic in threads of this process,
+ * and write the results as JSON (stdout, or --output FILE). Progress goes to stderr.
+ *
+ * This runs on any Linux box with dbus-daemon installed, no session bus required:
+ * dbus_bench --duration 1 --workload greating_payload --payload-sizes 16,65536
+ */
+
+struct Workload {
+    const char *name;
+    int (*run)(BenchContext& context);
+    const char *description;
+};
+
+static const Workload workloads[] = {
+    {"greating_payload",   bench_greating_payload,   "Greating round trips, sweeping --payload-sizes"},
+    {"heartbeat_rate",     bench_heartbeat_rate,     "HeartBeat signals to one listener, sweeping --rates (0 = unbounded)"},
+    {"concurrent_clients", bench_concurrent_clients, "Greating from many connections at once, sweeping --clients"},
+    {"bulk_transfer",      bench_bulk_transfer,      "sealed memfd against ay buffers, sweeping --bulk-sizes"},
+    {"peer_to_peer",       bench_peer_to_peer,       "Greating through the broker against a direct connection, sweeping --depths"},
+    {"marshal",            bench_marshal,            "varargs format strings against typed_bus.h append/read, no message sent"},
+    {"unit_list",          bench_unit_list,          "ListUnits from a mock manager, materialized against streaming parsing, sweeping --unit-counts"},
+    {"reactor",            bench_reactor,            "--clients server connections, one thread each against one BusReactor thread, sweeping --depths"},
+    {"topics",             bench_topics,             "100 listeners on 100 topics, arg0 match against member match, sweeping --topic-rates"},
+    {"activation",         bench_activation,         "--cold-starts bus activations of dbus_server, first call latency against warm calls"},
+};
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [options]\n"
+              << "  --workload NAME         run only this workload, can be repeated\n"
+              << "  --duration SECONDS      duration of each measurement point (default 2)\n"
+              << "  --payload-sizes LIST    comma separated Greating payload sizes in bytes\n"
+              << "  --rates LIST            comma separated HeartBeat rates per second\n"
+              << "  --clients LIST          comma separated numbers of concurrent clients\n"
+              << "  --bulk-sizes LIST       comma separated bulk transfer sizes in bytes (ay is limited to 64 MiB)\n"
+              << "  --depths LIST           comma separated numbers of calls kept in flight\n"
+              << "  --unit-counts LIST      comma separated numbers of units listed by the mock manager\n"
+              << "  --topic-rates LIST      comma separated TopicHeartBeat messages per second, all topics together\n"
+              << "  --cold-starts N         number of times dbus_server is activated (default 10)\n"
+              << "  --dbus-daemon PATH      dbus-daemon binary to use\n"
+              << "  --output FILE           write JSON results to FILE instead of stdout\n"
+              << "workloads:\n";
+    for(const Workload& workload : workloads)
+        std::cerr << "  " << workload.name << ": " << workload.description << "\n";
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longOptions[] = {
+        {"workload",      required_argument, NULL, 'w'},
+        {"duration",      required_argument, NULL, 'd'},
+        {"payload-sizes", required_argument, NULL, 'p'},
+        {"rates",         required_argument, NULL, 'r'},
+        {"clients",       required_argument, NULL, 'c'},
+        {"bulk-sizes",    required_argument, NULL, 'b'},
+        {"depths",        required_argument, NULL, 'P'},
+        {"unit-counts",   required_argument, NULL, 'U'},
+        {"topic-rates",   required_argument, NULL, 'T'},
+        {"cold-starts",   required_argument, NULL, 'C'},
+        {"dbus-daemon",   required_argument, NULL, 'D'},
+        {"output",        required_argument, NULL, 'o'},
+        {"help",          no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    std::vector<std::string> selected;
+    std::vector<JsonObject> results;
+    std::string daemonPath;
+    std::string outputPath;
+    BenchOptions options;
+    PrivateBus bus;
+    int c, r = 0;
+
+    while((c = getopt_long(argc, argv, "w:d:p:r:c:b:P:U:T:C:D:o:h", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'w': selected.push_back(optarg); break;
+        case 'd': options.duration = strtod(optarg, NULL); break;
+        case 'p': parse_size_list(optarg, options.payloadSizes); break;
+        case 'r': parse_size_list(optarg, options.rates); break;
+        case 'c': parse_size_list(optarg, options.clients); break;
+        case 'b': parse_size_list(optarg, options.bulkSizes); break;
+        case 'P': parse_size_list(optarg, options.depths); break;
+        case 'U': parse_size_list(optarg, options.unitCounts); break;
+        case 'T': parse_size_list(optarg, options.topicRates); break;
+        case 'C': options.coldStarts = unsigned(strtoul(optarg, NULL, 10)); break;
+        case 'D': daemonPath = optarg; break;
+        case 'o': outputPath = optarg; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    for(const std::string& name : selected) {
+        bool known = false;
+        for(const Workload& workload : workloads)
+            known |= name == workload.name;
+        if(!known) {
+            std::cerr << "Unknown workload: " << name << std::endl;
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    r = bus.start(daemonPath);
+    if(r < 0) {
+        std::cerr << "Failed to start private bus: " << strerror(-r) << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cerr << "private bus: " << bus.address() << std::endl;
+
+    BenchContext context{bus, options, results};
+    for(const Workload& workload : workloads) {
+        if(!selected.empty() && std::find(selected.begin(), selected.end(), workload.name) == selected.end())
+            continue;
+        r = workload.run(context);
+        if(r < 0) {
+            std::cerr << "Workload " << workload.name << " failed: " << strerror(-r) << std::endl;
+            break;
+        }
+    }
+
+    bus.stop();
+
+    std::ofstream file;
+    if(!outputPath.empty())
+        file.open(outputPath);
+    std::ostream& out = outputPath.empty() ? std::cout : file;
+
+    out << "{\"benchmark\": \"dbus_bench\", \"duration_s\": " << options.duration << ", \"results\": [\n";
+    for(size_t i = 0; i < results.size(); i++)
+        out << "  " << results[i].str() << (i + 1 < results.size() ? ",\n" : "\n");
+    out << "]}" << std::endl;
+
+    return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,181 @@
+#include <iostream>
+#include <fstream>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+
+#include "bench.h"
+#include "capture_file.h"
+#include "raw_bus.h"
+
+/*
+ * Records the traffic of the example services on a running bus, to replay it later with dbus_replay.
+ * We become a monitor (org.freedesktop.DBus.Monitoring.BecomeMonitor) for the method calls to
+ * org.nicolas.ServerExample and the signals of org.nicolas.PublisherExample, or the --match rules given,
+ * and write each message the broker copies to us as it was on the wire, with the time it arrived
+ * (see capture_file.h for the format). Replies are not recorded, the replay gets its own.
+ *
+ * dbus_capture --output greating.cap --duration 60
+ * dbus_capture --output heartbeat.cap --match "type='signal',member='HeartBeat'"
+ *
+ * Stops after --duration seconds, --count messages or on SIGINT/SIGTERM.
+ * On the user bus monitoring is allowed for our own uid, other buses may need a policy allowing eavesdrop.
+ */
+
+struct CaptureOptions {
+    std::string address;
+    std::string outputPath;
+    std::vector<std::string> rules;
+    double duration = 0.0;
+    uint64_t count = 0;
+};
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " --output FILE [options]\n"
+              << "  --output FILE           capture file to write\n"
+              << "  --match RULE            match rule of the messages to record, can be repeated\n"
+              << "                          (default: calls to org.nicolas.ServerExample, signals of org.nicolas.PublisherExample)\n"
+              << "  --duration SECONDS      stop after that long (default: until interrupted)\n"
+              << "  --count N               stop after N messages\n"
+              << "  --address ADDRESS       bus address (default $DBUS_SESSION_BUS_ADDRESS)" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longOptions[] = {
+        {"output",   required_argument, NULL, 'o'},
+        {"match",    required_argument, NULL, 'm'},
+        {"duration", required_argument, NULL, 'd'},
+        {"count",    required_argument, NULL, 'n'},
+        {"address",  required_argument, NULL, 'a'},
+        {"help",     no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    CaptureOptions options;
+    CaptureWriter writer;
+    RawBus bus;
+    WireWriter body;
+    sigset_t mask;
+    int signalFd = -1;
+    uint64_t captured = 0, bytes = 0;
+    int c, r;
+
+    while((c = getopt_long(argc, argv, "o:m:d:n:a:h", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'o': options.outputPath = optarg; break;
+        case 'm': options.rules.push_back(optarg); break;
+        case 'd': options.duration = strtod(optarg, NULL); break;
+        case 'n': options.count = strtoull(optarg, NULL, 10); break;
+        case 'a': options.address = optarg; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(optind != argc || options.outputPath.empty()) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(options.rules.empty())
+        options.rules = {"type='method_call',destination='org.nicolas.ServerExample'",
+                         "type='signal',sender='org.nicolas.PublisherExample'"};
+    if(options.address.empty())
+        options.address = default_bus_address();
+    if(options.address.empty()) {
+        std::cerr << "No bus address, set DBUS_SESSION_BUS_ADDRESS or use --address" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    r = writer.open(options.outputPath);
+    if(r < 0) {
+        std::cerr << "Failed to create " << options.outputPath << ": " << strerror(-r) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    r = bus.connect(options.address);
+    if(r < 0) {
+        std::cerr << "Failed to connect to " << options.address << ": " << strerror(-r) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    /* BecomeMonitor(as rules, u flags), the broker sends us copies from now on and ignores what we send */
+    body.stringArray(options.rules);
+    body.u32(0);
+    r = bus.callBroker("BecomeMonitor", "asu", body, nullptr, "org.freedesktop.DBus.Monitoring");
+    if(r < 0) {
+        std::cerr << "Failed to become a monitor: " << (r == -EREMOTEIO ? bus.lastError() : strerror(-r)) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signalFd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if(signalFd < 0) {
+        std::cerr << "Failed to watch signals: " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    uint64_t start = now_ns();
+    uint64_t end = options.duration > 0 ? start + uint64_t(options.duration * 1e9) : UINT64_MAX;
+    std::string message;
+    for(;;) {
+        /* messages read along with the BecomeMonitor reply are already there */
+        while((r = bus.nextMessage(message)) > 0) {
+            WireHeader header;
+            r = wire_parse_header(message, header);
+            if(r < 0)
+                break;
+            /* NameLost and such, for us and not for the capture */
+            if(header.destination == bus.uniqueName())
+                continue;
+
+            r = writer.write(now_ns() - start, message);
+            if(r < 0)
+                break;
+            captured++;
+            bytes += message.size();
+            if(options.count > 0 && captured >= options.count)
+                break;
+        }
+        if(r < 0 || (options.count > 0 && captured >= options.count))
+            break;
+
+        uint64_t now = now_ns();
+        if(now >= end)
+            break;
+
+        struct pollfd fds[2] = {{bus.fd(), POLLIN, 0}, {signalFd, POLLIN, 0}};
+        int timeout = end == UINT64_MAX ? -1 : int((end - now) / 1000000 + 1);
+        if(poll(fds, 2, timeout) < 0 && errno != EINTR) {
+            r = -errno;
+            break;
+        }
+        if(fds[1].revents & POLLIN)
+            break;
+        if(fds[0].revents) {
+            r = bus.receive();
+            if(r < 0)
+                break;
+        }
+    }
+    double elapsed = double(now_ns() - start) / 1e9;
+
+    if(signalFd >= 0)
+        close(signalFd);
+    if(r < 0)
+        std::cerr << "Failed to capture: " << strerror(-r) << std::endl;
+    int closed = writer.close();
+    if(closed < 0)
+        std::cerr << "Failed to write " << options.outputPath << ": " << strerror(-closed) << std::endl;
+
+    std::cerr << "captured " << captured << " messages, " << bytes << " bytes in " << elapsed << " s" << std::endl;
+    return r < 0 || closed < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
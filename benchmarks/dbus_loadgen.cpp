@@ -0,0 +1,366 @@
+#include <iostream>
+#include <fstream>
+#include <memory>
+#include <latch>
+#include <cstdlib>
+#include <cstring>
+
+#include <errno.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+#include "bus_reactor.h"
+
+/*
+ * Load generator for a running dbus_server: for each count in --connections, open that many bus connections
+ * spread over --threads threads, drive Greating at --rate calls per second in total for --duration seconds,
+ * and write one JSON result per count (stdout, or --output FILE), progress on stderr.
+ *
+ * Arrivals are open loop: call k of a thread is due at start + k / (rate / threads), whether or not earlier
+ * calls were answered, and latency is measured from that due time, not from when we managed to send it.
+ * A server (or broker) that stalls shows up as the latency of every call that should have been sent
+ * during the stall, not as fewer samples (coordinated omission). max_send_lag_ns tells how far behind
+ * its own schedule the generator got, if that is large the generator was the bottleneck.
+ *
+ * Also reported for each count:
+ * - connection setup time, sd_bus_start to the Hello reply (auth + Hello), all threads connecting at once
+ * - server and broker RSS (VmRSS from /proc, pids from GetConnectionUnixProcessID), before connecting,
+ *   once connected and after the load, so it has to run on the same machine as the server
+ *
+ * dbus_server &
+ * dbus_loadgen --connections 1,10,100,500 --threads 4 --rate 20000 --duration 5
+ */
+
+struct LoadOptions {
+    std::vector<uint64_t> connections = {1, 10, 100, 500};
+    unsigned threads = 4;
+    double rate = 10000.0;
+    double duration = 5.0;
+    double drain = 5.0;
+    std::string address;
+    const char *service = "org.nicolas.ServerExample";
+    const char *name = "loadgen";
+};
+
+struct Worker;
+
+struct PendingCall {
+    Worker *worker;
+    uint64_t due;
+};
+
+/* one thread, its connections in a BusReactor */
+struct Worker {
+    const LoadOptions *options;
+    unsigned threads = 0;
+    unsigned connectionCount = 0;
+    std::vector<sd_bus*> buses;
+    BusReactor reactor;
+    std::thread thread;
+
+    LatencyHistogram setup;
+    LatencyHistogram latency;
+    uint64_t sent = 0;
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    uint64_t maxLag = 0;
+    unsigned inFlight = 0;
+    int error = 0;
+
+    ~Worker() {
+        for(sd_bus *bus : buses)
+            sd_bus_flush_close_unref(bus);
+    }
+};
+
+static int on_greating_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    std::unique_ptr<PendingCall> call(static_cast<PendingCall*>(userdata));
+    Worker *worker = call->worker;
+
+    worker->latency.record(now_ns() - call->due);
+    worker->inFlight--;
+    if(sd_bus_message_is_method_error(m, NULL)) {
+        /* only the first one, a saturated server fails thousands of them */
+        if(worker->errors++ == 0)
+            std::cerr << "Method call failed: " << sd_bus_message_get_error(m)->message << std::endl;
+    }
+    else
+        worker->completed++;
+
+    return 0;
+}
+
+static int issue_call(Worker *worker, sd_bus *bus, uint64_t due) {
+    PendingCall *call = new PendingCall{worker, due};
+
+    int r = sd_bus_call_method_async(bus, NULL, worker->options->service, "/org/nicolas/ServerExample",
+                                     "org.nicolas.ServerExample", "Greating", on_greating_reply, call,
+                                     "s", worker->options->name);
+    if(r < 0) {
+        delete call;
+        return r;
+    }
+
+    worker->sent++;
+    worker->inFlight++;
+    return 0;
+}
+
+/* sd_bus_get_unique_name waits for the Hello reply, so this is auth + Hello */
+static int connect_all(Worker *worker) {
+    int r = worker->reactor.open();
+
+    for(unsigned i = 0; i < worker->connectionCount && r >= 0; i++) {
+        const char *unique;
+        sd_bus *bus = NULL;
+        uint64_t begin = now_ns();
+
+        r = bus_connect_address(worker->options->address, &bus);
+        if(r >= 0) {
+            worker->buses.push_back(bus);
+            r = sd_bus_get_unique_name(bus, &unique);
+        }
+        if(r >= 0) {
+            worker->setup.record(now_ns() - begin);
+            r = worker->reactor.add(bus);
+        }
+    }
+
+    return r;
+}
+
+static int drive(Worker *worker, uint64_t start) {
+    const LoadOptions& options = *worker->options;
+    uint64_t interval = uint64_t(1e9 * worker->threads / options.rate);
+    uint64_t end = start + uint64_t(options.duration * 1e9);
+    uint64_t giveUp = end + uint64_t(options.drain * 1e9);
+    uint64_t due = start;
+    size_t next = 0;
+
+    for(;;) {
+        uint64_t now = now_ns();
+
+        for(; due <= now && due < end; due += interval) {
+            worker->maxLag = std::max(worker->maxLag, now - due);
+            int r = issue_call(worker, worker->buses[next++ % worker->buses.size()], due);
+            if(r < 0)
+                return r;
+        }
+
+        if(due >= end && (worker->inFlight == 0 || now >= giveUp))
+            return 0;
+
+        uint64_t wakeUp = due < end ? due : giveUp;
+        int r = worker->reactor.runOnce(wakeUp > now ? (wakeUp - now) / 1000 : 0);
+        if(r < 0)
+            return r;
+    }
+}
+
+struct Memory {
+    int64_t server = -1;
+    int64_t broker = -1;
+};
+
+static Memory sample_memory(pid_t server, pid_t broker) {
+    Memory memory;
+    if(server > 0)
+        memory.server = rss_kb(server);
+    if(broker > 0)
+        memory.broker = rss_kb(broker);
+    return memory;
+}
+
+static int measure(const LoadOptions& options, unsigned connections, pid_t serverPid, pid_t brokerPid,
+                   std::vector<JsonObject>& results) {
+    unsigned threads = std::min(options.threads, connections);
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::latch connected(threads);
+    std::latch go(1);
+    std::atomic<uint64_t> start = 0;
+    int r = 0;
+
+    std::cerr << "loadgen: " << connections << " connections, " << threads << " threads, " << options.rate << " calls/s" << std::endl;
+
+    Memory idle = sample_memory(serverPid, brokerPid);
+
+    for(unsigned i = 0; i < threads; i++) {
+        workers.push_back(std::make_unique<Worker>());
+        workers.back()->options = &options;
+        workers.back()->threads = threads;
+        workers.back()->connectionCount = connections / threads + (i < connections % threads ? 1 : 0);
+    }
+
+    uint64_t setupBegin = now_ns();
+    for(auto& worker : workers) {
+        Worker *w = worker.get();
+        w->thread = std::thread([w, &connected, &go, &start]() {
+            w->error = connect_all(w);
+            connected.count_down();
+            go.wait();
+            if(w->error >= 0)
+                w->error = drive(w, start);
+        });
+    }
+    connected.wait();
+    double setupWall = double(now_ns() - setupBegin) / 1e9;
+
+    Memory loaded = sample_memory(serverPid, brokerPid);
+
+    start = now_ns();
+    go.count_down();
+    for(auto& worker : workers)
+        worker->thread.join();
+    double elapsed = double(now_ns() - start) / 1e9;
+
+    Memory after = sample_memory(serverPid, brokerPid);
+
+    LatencyHistogram setup, latency;
+    uint64_t sent = 0, completed = 0, errors = 0, lost = 0, maxLag = 0;
+    for(auto& worker : workers) {
+        if(worker->error < 0 && r == 0)
+            r = worker->error;
+        setup.merge(worker->setup);
+        latency.merge(worker->latency);
+        sent += worker->sent;
+        completed += worker->completed;
+        errors += worker->errors;
+        lost += worker->inFlight;
+        maxLag = std::max(maxLag, worker->maxLag);
+    }
+    workers.clear();
+    if(r < 0) {
+        std::cerr << "Failed to run " << connections << " connections: " << strerror(-r) << std::endl;
+        /* LimitsExceeded from Hello */
+        if(r == -ENOBUFS)
+            std::cerr << "The broker refused a connection, see max_connections_per_user and max_completed_connections in its config" << std::endl;
+        return r;
+    }
+
+    std::cerr << "loadgen: " << double(completed) / options.duration << " calls/s, p99 " << latency.percentile(99) / 1e3
+              << " us, setup p99 " << setup.percentile(99) / 1e3 << " us, server rss " << after.server << " kB" << std::endl;
+
+    JsonObject result;
+    result.add("workload", "loadgen")
+          .add("connections", connections)
+          .add("threads", threads)
+          .add("target_rate", options.rate)
+          .add("sent", sent)
+          .add("calls", completed)
+          .add("errors", errors)
+          .add("unanswered", lost)
+          .add("elapsed_s", elapsed)
+          .add("calls_per_s", double(completed) / options.duration)
+          .add("max_send_lag_ns", maxLag)
+          .add("latency_ns", latency_json(latency))
+          .add("setup_ns", latency_json(setup))
+          .add("setup_wall_s", setupWall)
+          .add("server_rss_kb_idle", idle.server)
+          .add("server_rss_kb_connected", loaded.server)
+          .add("server_rss_kb_after", after.server)
+          .add("broker_rss_kb_idle", idle.broker)
+          .add("broker_rss_kb_connected", loaded.broker)
+          .add("broker_rss_kb_after", after.broker);
+    results.push_back(result);
+    return 0;
+}
+
+/* every connection is an fd here and in the broker, the default soft limit of 1024 is easy to hit */
+static void raise_fd_limit() {
+    struct rlimit limit;
+
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [options]\n"
+              << "  --connections LIST      comma separated numbers of connections (default 1,10,100,500)\n"
+              << "  --threads N             threads sharing the connections (default 4)\n"
+              << "  --rate CALLS            aggregate Greating calls per second (default 10000)\n"
+              << "  --duration SECONDS      duration of each measurement point (default 5)\n"
+              << "  --address ADDRESS       bus address (default $DBUS_SESSION_BUS_ADDRESS)\n"
+              << "  --service NAME          service to call (default org.nicolas.ServerExample)\n"
+              << "  --output FILE           write JSON results to FILE instead of stdout" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longOptions[] = {
+        {"connections", required_argument, NULL, 'n'},
+        {"threads",     required_argument, NULL, 't'},
+        {"rate",        required_argument, NULL, 'r'},
+        {"duration",    required_argument, NULL, 'd'},
+        {"address",     required_argument, NULL, 'a'},
+        {"service",     required_argument, NULL, 's'},
+        {"output",      required_argument, NULL, 'o'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    std::vector<JsonObject> results;
+    std::string outputPath;
+    LoadOptions options;
+    sd_bus *bus = NULL;
+    pid_t serverPid, brokerPid;
+    int c, r = 0;
+
+    while((c = getopt_long(argc, argv, "n:t:r:d:a:s:o:h", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'n': parse_size_list(optarg, options.connections); break;
+        case 't': options.threads = unsigned(strtoul(optarg, NULL, 10)); break;
+        case 'r': options.rate = strtod(optarg, NULL); break;
+        case 'd': options.duration = strtod(optarg, NULL); break;
+        case 'a': options.address = optarg; break;
+        case 's': options.service = optarg; break;
+        case 'o': outputPath = optarg; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(optind != argc || options.threads == 0 || options.rate <= 0 || options.duration <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(options.address.empty())
+        options.address = default_bus_address();
+    if(options.address.empty()) {
+        std::cerr << "No bus address, set DBUS_SESSION_BUS_ADDRESS or use --address" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    raise_fd_limit();
+
+    r = bus_connect_address(options.address, &bus);
+    if(r < 0) {
+        std::cerr << "Failed to connect to " << options.address << ": " << strerror(-r) << std::endl;
+        return EXIT_FAILURE;
+    }
+    serverPid = owner_pid(bus, options.service);
+    brokerPid = owner_pid(bus, "org.freedesktop.DBus");
+
+    for(uint64_t connections : options.connections) {
+        if(connections == 0)
+            continue;
+        r = measure(options, unsigned(connections), serverPid, brokerPid, results);
+        if(r < 0)
+            break;
+    }
+
+    sd_bus_flush_close_unref(bus);
+
+    std::ofstream file;
+    if(!outputPath.empty())
+        file.open(outputPath);
+    std::ostream& out = outputPath.empty() ? std::cout : file;
+
+    out << "{\"benchmark\": \"dbus_loadgen\", \"duration_s\": " << options.duration << ", \"results\": [\n";
+    for(size_t i = 0; i < results.size(); i++)
+        out << "  " << results[i].str() << (i + 1 < results.size() ? ",\n" : "\n");
+    out << "]}" << std::endl;
+
+    return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,305 @@
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+#include <cstdlib>
+#include <cstring>
+
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+
+#include "bench.h"
+#include "capture_file.h"
+#include "raw_bus.h"
+
+/*
+ * Sends the messages of a dbus_capture file to a bus and reports how it went, so a recorded traffic mix can be
+ * run against dbus_server or dbus_listener on any box, for example on the private bus of a test:
+ * dbus_replay --input greating.cap --speed 0
+ * dbus_replay --input heartbeat.cap --own org.nicolas.PublisherExample
+ *
+ * --speed 1 (the default) keeps the recorded pace, --speed N is N times faster, --speed 0 sends as fast as
+ * the bus takes it. Messages go out as recorded, only the serial is renumbered and the broker puts our name as
+ * sender, so signals only reach matches with sender= when we own that name (--own, can be repeated).
+ * Calls expecting a reply are matched with it by serial, latency is from handing the call to the socket to
+ * reading the reply. At most --window calls wait for a reply (the broker allows 128 per connection by default),
+ * the next ones wait for a slot and the delay shows in max_send_lag_ms. Messages with unix fds can not be
+ * replayed and are skipped, so are calls to unique names, they belong to the bus of the recording.
+ * elapsed_s and the rates stop at the last message written or reply received, the up to 5 s we wait for
+ * replies that never come are not counted.
+ */
+
+struct ReplayOptions {
+    std::string address;
+    std::string inputPath;
+    std::string outputPath;
+    std::vector<std::string> names;
+    double speed = 1.0;
+    unsigned window = 64;
+};
+
+struct Record {
+    uint64_t timeNs;
+    std::string message;
+    WireHeader header;
+};
+
+struct ReplayStats {
+    uint64_t calls = 0;
+    uint64_t signals = 0;
+    uint64_t skipped = 0;
+    uint64_t replies = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    uint64_t maxLagNs = 0;
+    LatencyHistogram latency;
+};
+
+static int load(const std::string& path, std::vector<Record>& records) {
+    CaptureReader reader;
+    Record record;
+    int r;
+
+    r = reader.open(path);
+    while(r >= 0 && (r = reader.next(record.timeNs, record.message)) > 0) {
+        r = wire_parse_header(record.message, record.header);
+        if(r >= 0)
+            records.push_back(record);
+    }
+    return r;
+}
+
+static bool replayable(const WireHeader& header) {
+    if(header.unixFds > 0)
+        return false;
+    if(header.type == WireHeader::Signal)
+        return true;
+    return header.type == WireHeader::MethodCall && header.destination.compare(0, 1, ":") != 0;
+}
+
+static void on_message(const std::string& message, std::unordered_map<uint32_t, uint64_t>& pending, ReplayStats& stats) {
+    WireHeader header;
+
+    if(wire_parse_header(message, header) < 0)
+        return;
+    if(header.type != WireHeader::MethodReturn && header.type != WireHeader::Error)
+        return;
+
+    auto it = pending.find(header.replySerial);
+    if(it == pending.end())
+        return;
+
+    stats.latency.record(now_ns() - it->second);
+    stats.replies++;
+    if(header.type == WireHeader::Error)
+        stats.errors++;
+    pending.erase(it);
+}
+
+static int replay(const ReplayOptions& options, RawBus& bus, std::vector<Record>& records, ReplayStats& stats, double& elapsed) {
+    std::unordered_map<uint32_t, uint64_t> pending;
+    std::string message;
+    size_t next = 0;
+    int r = 0;
+
+    uint64_t start = now_ns();
+    uint64_t last = start;      /* last message written or reply received */
+    uint64_t giveUp = UINT64_MAX;
+    for(;;) {
+        uint64_t now = now_ns();
+        uint64_t wakeUp = UINT64_MAX;
+
+        while(next < records.size() && !bus.wantsWrite()) {
+            Record& record = records[next];
+            if(!replayable(record.header)) {
+                stats.skipped++;
+                next++;
+                continue;
+            }
+
+            uint64_t due = options.speed > 0 ? start + uint64_t(double(record.timeNs) / options.speed) : now;
+            if(due > now) {
+                wakeUp = due;
+                break;
+            }
+
+            bool expectsReply = record.header.type == WireHeader::MethodCall
+                                && !(record.header.flags & WireHeader::flagNoReplyExpected);
+            if(expectsReply && pending.size() >= options.window)
+                break;
+
+            uint32_t serial = bus.nextSerial();
+            wire_set_serial(record.message, serial);
+            r = bus.send(record.message);
+            if(r < 0)
+                return r;
+
+            if(!bus.wantsWrite())
+                last = now;
+            if(expectsReply)
+                pending.emplace(serial, now);
+            if(record.header.type == WireHeader::Signal)
+                stats.signals++;
+            else
+                stats.calls++;
+            stats.bytes += record.message.size();
+            stats.maxLagNs = std::max(stats.maxLagNs, now - due);
+            next++;
+        }
+        /* everything is sent, wait for the socket to take it and for the last replies, 5 s at most */
+        if(next == records.size()) {
+            if(pending.empty() && !bus.wantsWrite())
+                break;
+            if(giveUp == UINT64_MAX)
+                giveUp = now_ns() + 5000000000ull;
+            else if(now_ns() >= giveUp)
+                break;
+        }
+
+        /* sleep until the next message is due, unless a reply or the socket unblocks something first */
+        if(next == records.size())
+            wakeUp = giveUp;
+        now = now_ns();
+        struct timespec timeout = {0, 0};
+        if(wakeUp > now) {
+            timeout.tv_sec = time_t((wakeUp - now) / 1000000000);
+            timeout.tv_nsec = long((wakeUp - now) % 1000000000);
+        }
+        struct pollfd pfd = {bus.fd(), short(POLLIN | (bus.wantsWrite() ? POLLOUT : 0)), 0};
+        if(ppoll(&pfd, 1, wakeUp == UINT64_MAX ? NULL : &timeout, NULL) < 0 && errno != EINTR)
+            return -errno;
+
+        if(pfd.revents & POLLOUT) {
+            r = bus.flush();
+            if(r < 0)
+                return r;
+            if(!bus.wantsWrite())
+                last = now_ns();
+        }
+        if(pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            r = bus.receive();
+            if(r < 0)
+                return r;
+            uint64_t replies = stats.replies;
+            while((r = bus.nextMessage(message)) > 0)
+                on_message(message, pending, stats);
+            if(r < 0)
+                return r;
+            if(stats.replies != replies)
+                last = now_ns();
+        }
+    }
+    elapsed = double(last - start) / 1e9;
+
+    if(!pending.empty())
+        std::cerr << pending.size() << " calls got no reply" << std::endl;
+    return 0;
+}
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " --input FILE [options]\n"
+              << "  --input FILE            capture file written by dbus_capture\n"
+              << "  --speed FACTOR          1 for the recorded pace (default), 0 for as fast as possible\n"
+              << "  --own NAME              request NAME before sending, can be repeated\n"
+              << "  --window N              calls waiting for a reply at most (default 64)\n"
+              << "  --address ADDRESS       bus address (default $DBUS_SESSION_BUS_ADDRESS)\n"
+              << "  --output FILE           write JSON results to FILE instead of stdout" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longOptions[] = {
+        {"input",   required_argument, NULL, 'i'},
+        {"speed",   required_argument, NULL, 's'},
+        {"own",     required_argument, NULL, 'n'},
+        {"window",  required_argument, NULL, 'w'},
+        {"address", required_argument, NULL, 'a'},
+        {"output",  required_argument, NULL, 'o'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    std::vector<Record> records;
+    ReplayOptions options;
+    ReplayStats stats;
+    RawBus bus;
+    double elapsed = 0.0;
+    int c, r;
+
+    while((c = getopt_long(argc, argv, "i:s:n:w:a:o:h", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'i': options.inputPath = optarg; break;
+        case 's': options.speed = strtod(optarg, NULL); break;
+        case 'n': options.names.push_back(optarg); break;
+        case 'w': options.window = unsigned(strtoul(optarg, NULL, 10)); break;
+        case 'a': options.address = optarg; break;
+        case 'o': options.outputPath = optarg; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if(optind != argc || options.inputPath.empty() || options.speed < 0 || options.window == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if(options.address.empty())
+        options.address = default_bus_address();
+    if(options.address.empty()) {
+        std::cerr << "No bus address, set DBUS_SESSION_BUS_ADDRESS or use --address" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    r = load(options.inputPath, records);
+    if(r < 0) {
+        std::cerr << "Failed to read " << options.inputPath << ": " << strerror(-r) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    r = bus.connect(options.address);
+    if(r < 0) {
+        std::cerr << "Failed to connect to " << options.address << ": " << strerror(-r) << std::endl;
+        return EXIT_FAILURE;
+    }
+    for(const std::string& name : options.names) {
+        r = bus.requestName(name);
+        if(r != 1) {
+            std::cerr << "Failed to acquire " << name << ": "
+                      << (r == -EREMOTEIO ? bus.lastError() : r < 0 ? strerror(-r) : "owned by someone else") << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    r = replay(options, bus, records, stats, elapsed);
+    if(r < 0) {
+        std::cerr << "Failed to replay: " << strerror(-r) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    uint64_t sent = stats.calls + stats.signals;
+    JsonObject result;
+    result.add("input", options.inputPath)
+          .add("speed", options.speed)
+          .add("records", uint64_t(records.size()))
+          .add("calls", stats.calls)
+          .add("signals", stats.signals)
+          .add("skipped", stats.skipped)
+          .add("replies", stats.replies)
+          .add("errors", stats.errors)
+          .add("elapsed_s", elapsed)
+          .add("messages_per_s", elapsed > 0 ? double(sent) / elapsed : 0.0)
+          .add("mb_per_s", elapsed > 0 ? double(stats.bytes) / elapsed / 1e6 : 0.0)
+          .add("max_send_lag_ms", double(stats.maxLagNs) / 1e6)
+          .add("latency_us_p50", double(stats.latency.percentile(50)) / 1000.0)
+          .add("latency_us_p90", double(stats.latency.percentile(90)) / 1000.0)
+          .add("latency_us_p99", double(stats.latency.percentile(99)) / 1000.0)
+          .add("latency_us_max", double(stats.latency.max()) / 1000.0);
+
+    std::ofstream file;
+    if(!options.outputPath.empty())
+        file.open(options.outputPath);
+    std::ostream& out = options.outputPath.empty() ? std::cout : file;
+
+    out << "{\"benchmark\": \"dbus_replay\", \"results\": [\n  " << result.str() << "\n]}" << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+#include "private_bus.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static const char busConfig[] =
+    "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\"\n"
+    " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+    "<busconfig>\n"
+    "  <type>session</type>\n"
+    "  <listen>unix:path=@DIR@/bus</listen>\n"
+    "  <auth>EXTERNAL</auth>\n"
+    "  <servicedir>@DIR@/services</servicedir>\n"
+    "  <policy context=\"default\">\n"
+    "    <allow send_destination=\"*\" eavesdrop=\"true\"/>\n"
+    "    <allow eavesdrop=\"true\"/>\n"
+    "    <allow own=\"*\"/>\n"
+    "  </policy>\n"
+    "  <limit name=\"max_incoming_bytes\">1000000000</limit>\n"
+    "  <limit name=\"max_incoming_unix_fds\">250000000</limit>\n"
+    "  <limit name=\"max_outgoing_bytes\">1000000000</limit>\n"
+    "  <limit name=\"max_outgoing_unix_fds\">250000000</limit>\n"
+    "  <limit name=\"max_message_size\">1000000000</limit>\n"
+    "  <limit name=\"max_completed_connections\">100000</limit>\n"
+    "  <limit name=\"max_incomplete_connections\">10000</limit>\n"
+    "  <limit name=\"max_connections_per_user\">100000</limit>\n"
+    "  <limit name=\"max_names_per_connection\">50000</limit>\n"
+    "  <limit name=\"max_match_rules_per_connection\">50000</limit>\n"
+    "  <limit name=\"max_replies_per_connection\">50000</limit>\n"
+    "</busconfig>\n";
+
+PrivateBus::~PrivateBus() {
+    stop();
+}
+
+int PrivateBus::start(const std::string& daemonPath) {
+    char dirTemplate[] = "/tmp/dbus-bench-XXXXXX";
+    int pipeFds[2];
+    std::string daemon = daemonPath;
+
+    if(daemon.empty()) {
+        const char *env = getenv("DBUS_DAEMON");
+        daemon = env ? env : "dbus-daemon";
+    }
+
+    if(!mkdtemp(dirTemplate))
+        return -errno;
+    directory = dirTemplate;
+
+    std::string config = busConfig;
+    for(size_t at; (at = config.find("@DIR@")) != std::string::npos; )
+        config.replace(at, 5, directory);
+    std::string configPath = directory + "/bus.conf";
+    std::ofstream(configPath) << config;
+    if(mkdir(serviceDirectory().c_str(), 0700) < 0)
+        return -errno;
+
+    if(pipe2(pipeFds, O_CLOEXEC) < 0)
+        return -errno;
+
+    daemonPid = fork();
+    if(daemonPid < 0) {
+        int r = -errno;
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        return r;
+    }
+
+    if(daemonPid == 0) {
+        /* dup2 clears O_CLOEXEC, so only fd 3 survives the exec */
+        dup2(pipeFds[1], 3);
+        std::string configArg = "--config-file=" + configPath;
+        execlp(daemon.c_str(), daemon.c_str(), configArg.c_str(), "--nofork", "--print-address=3", (char*) NULL);
+        std::cerr << "Failed to execute " << daemon << ": " << strerror(errno) << std::endl;
+        _exit(127);
+    }
+
+    close(pipeFds[1]);
+
+    /* the daemon prints its address once it is listening */
+    struct pollfd pfd = {pipeFds[0], POLLIN, 0};
+    char buffer[512];
+    size_t len = 0;
+    while(len < sizeof(buffer) - 1 && !memchr(buffer, '\n', len)) {
+        int n = poll(&pfd, 1, 5000);
+        if(n <= 0)
+            break;
+        ssize_t got = read(pipeFds[0], buffer + len, sizeof(buffer) - 1 - len);
+        if(got <= 0)
+            break;
+        len += size_t(got);
+    }
+    close(pipeFds[0]);
+
+    char *eol = static_cast<char*>(memchr(buffer, '\n', len));
+    if(!eol) {
+        std::cerr << "dbus-daemon did not report its address" << std::endl;
+        stop();
+        return -EIO;
+    }
+    busAddress.assign(buffer, eol);
+
+    return 0;
+}
+
+void PrivateBus::stop() {
+    if(daemonPid > 0) {
+        kill(daemonPid, SIGTERM);
+        waitpid(daemonPid, NULL, 0);
+        daemonPid = -1;
+    }
+    if(!directory.empty()) {
+        unlink((directory + "/bus").c_str());
+        unlink((directory + "/bus.conf").c_str());
+        remove_service_files();
+        rmdir(directory.c_str());
+        directory.clear();
+    }
+    busAddress.clear();
+}
+
+/* whatever workloads left in the servicedir, then the directory itself */
+void PrivateBus::remove_service_files() {
+    std::string services = serviceDirectory();
+    DIR *dir = opendir(services.c_str());
+    if(!dir)
+        return;
+
+    while(struct dirent *entry = readdir(dir))
+        if(entry->d_name[0] != '.')
+            unlink((services + "/" + entry->d_name).c_str());
+    closedir(dir);
+    rmdir(services.c_str());
+}
+
+int PrivateBus::connect(sd_bus **ret) const {
+    return bus_connect_address(busAddress, ret);
+}
+
+double PrivateBus::cpuSeconds() const {
+    std::ifstream stat("/proc/" + std::to_string(daemonPid) + "/stat");
+    std::string line;
+    if(daemonPid <= 0 || !std::getline(stat, line))
+        return 0.0;
+
+    /* the command name can contain spaces, fields are counted from the closing parenthesis */
+    std::istringstream fields(line.substr(line.rfind(')') + 2));
+    std::string field;
+    unsigned long utime = 0, stime = 0;
+    for(int i = 3; fields >> field; i++) {
+        if(i == 14)
+            utime = std::stoul(field);
+        else if(i == 15) {
+            stime = std::stoul(field);
+            break;
+        }
+    }
+
+    return double(utime + stime) / double(sysconf(_SC_CLK_TCK));
+}
+
+int bus_connect_address(const std::string& address, sd_bus **ret) {
+    sd_bus *bus = NULL;
+    int r;
+
+    r = sd_bus_new(&bus);
+    if(r < 0)
+        return r;
+
+    r = sd_bus_set_address(bus, address.c_str());
+    if(r >= 0)
+        r = sd_bus_set_bus_client(bus, 1);
+    if(r >= 0)
+        r = sd_bus_start(bus);
+    if(r < 0) {
+        sd_bus_unref(bus);
+        return r;
+    }
+
+    *ret = bus;
+    return 0;
+}
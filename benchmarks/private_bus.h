@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+#include <sys/types.h>
+#include <systemd/sd-bus.h>
+
+/*
+ * Run our own dbus-daemon on a unix socket in a temporary directory, so benchmarks do not need
+ * (and do not disturb) the user session bus. The daemon gets session bus policy with the same
+ * "essentially infinite" limits as the stock session.conf, we want to measure the bus, not hit quotas.
+ *
+ * The daemon binary is looked up in PATH, or taken from $DBUS_DAEMON when set.
+ * Service files put in serviceDirectory() are used for bus activation (after ReloadConfig).
+ */
+class PrivateBus {
+public:
+    PrivateBus() = default;
+    PrivateBus(const PrivateBus&) = delete;
+    PrivateBus& operator=(const PrivateBus&) = delete;
+    ~PrivateBus();
+
+    /* returns a negative errno style value on failure, like sd-bus */
+    int start(const std::string& daemonPath = "");
+    void stop();
+
+    /* open a new bus client connection (auth + Hello) to the private daemon */
+    int connect(sd_bus **ret) const;
+
+    const std::string& address() const { return busAddress; }
+    std::string serviceDirectory() const { return directory + "/services"; }
+    pid_t pid() const { return daemonPid; }
+
+    /* user + system cpu time consumed so far by the daemon, in seconds */
+    double cpuSeconds() const;
+
+private:
+    void remove_service_files();
+
+    std::string directory;
+    std::string busAddress;
+    pid_t daemonPid = -1;
+};
+
+/* connect to an arbitrary address as a bus client, also used for the user bus tools */
+int bus_connect_address(const std::string& address, sd_bus **ret);
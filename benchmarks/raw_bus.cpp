@@ -0,0 +1,446 @@
+#include "raw_bus.h"
+
+#include <cstring>
+#include <cstdio>
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const size_t maxMessageSize = size_t(1) << 27;
+
+static uint32_t read32(const char *p, bool little) {
+    const unsigned char *b = reinterpret_cast<const unsigned char*>(p);
+    if(little)
+        return uint32_t(b[0]) | uint32_t(b[1]) << 8 | uint32_t(b[2]) << 16 | uint32_t(b[3]) << 24;
+    return uint32_t(b[3]) | uint32_t(b[2]) << 8 | uint32_t(b[1]) << 16 | uint32_t(b[0]) << 24;
+}
+
+static size_t align8(size_t n) {
+    return (n + 7) & ~size_t(7);
+}
+
+void WireWriter::u32(uint32_t value) {
+    align(4);
+    for(int i = 0; i < 4; i++)
+        data.push_back(char(value >> (8 * i)));
+}
+
+void WireWriter::string(const std::string& value) {
+    u32(uint32_t(value.size()));
+    data.append(value);
+    data.push_back('\0');
+}
+
+void WireWriter::signature(const std::string& value) {
+    byte(uint8_t(value.size()));
+    data.append(value);
+    data.push_back('\0');
+}
+
+void WireWriter::stringArray(const std::vector<std::string>& values) {
+    u32(0);
+    size_t lengthAt = data.size() - 4;
+    /* the length does not count the padding before the first element */
+    align(4);
+    size_t start = data.size();
+    for(const std::string& value : values)
+        string(value);
+
+    uint32_t length = uint32_t(data.size() - start);
+    for(int i = 0; i < 4; i++)
+        data[lengthAt + i] = char(length >> (8 * i));
+}
+
+int64_t wire_message_size(const char *data, size_t available) {
+    if(available < 16)
+        return 0;
+    if(data[0] != 'l' && data[0] != 'B')
+        return -EBADMSG;
+
+    bool little = data[0] == 'l';
+    size_t size = align8(16 + size_t(read32(data + 12, little))) + read32(data + 4, little);
+    return size > maxMessageSize ? -EBADMSG : int64_t(size);
+}
+
+int wire_parse_header(const std::string& message, WireHeader& header) {
+    int64_t size = wire_message_size(message.data(), message.size());
+    if(size <= 0 || size_t(size) > message.size())
+        return -EBADMSG;
+
+    bool little = message[0] == 'l';
+    header = WireHeader();
+    header.type = WireHeader::Type(message[1]);
+    header.flags = uint8_t(message[2]);
+    header.serial = read32(message.data() + 8, little);
+
+    /* array of (byte code, variant value), each struct 8 aligned */
+    size_t pos = 16;
+    size_t end = 16 + read32(message.data() + 12, little);
+    while(pos < end) {
+        pos = align8(pos);
+        if(pos + 4 > end || message[pos + 1] != 1 || message[pos + 3] != '\0')
+            return -EBADMSG;
+        uint8_t code = uint8_t(message[pos]);
+        char type = message[pos + 2];
+        pos += 4;
+
+        std::string text;
+        uint32_t number = 0;
+        if(type == 's' || type == 'o') {
+            pos = (pos + 3) & ~size_t(3);
+            if(pos + 4 > end)
+                return -EBADMSG;
+            uint32_t length = read32(message.data() + pos, little);
+            if(pos + 4 + length + 1 > end)
+                return -EBADMSG;
+            text.assign(message, pos + 4, length);
+            pos += 4 + length + 1;
+        }
+        else if(type == 'g') {
+            if(pos + 1 > end)
+                return -EBADMSG;
+            uint8_t length = uint8_t(message[pos]);
+            if(pos + 1 + length + 1 > end)
+                return -EBADMSG;
+            text.assign(message, pos + 1, length);
+            pos += 1 + length + 1;
+        }
+        else if(type == 'u') {
+            pos = (pos + 3) & ~size_t(3);
+            if(pos + 4 > end)
+                return -EBADMSG;
+            number = read32(message.data() + pos, little);
+            pos += 4;
+        }
+        else
+            return -EBADMSG;
+
+        switch(code) {
+        case 1: header.path = text; break;
+        case 2: header.interface = text; break;
+        case 3: header.member = text; break;
+        case 4: header.errorName = text; break;
+        case 5: header.replySerial = number; break;
+        case 6: header.destination = text; break;
+        case 7: header.sender = text; break;
+        case 9: header.unixFds = number; break;
+        default: break;
+        }
+    }
+
+    return 0;
+}
+
+void wire_set_serial(std::string& message, uint32_t serial) {
+    for(int i = 0; i < 4; i++) {
+        int shift = message[0] == 'l' ? 8 * i : 8 * (3 - i);
+        message[8 + i] = char(serial >> shift);
+    }
+}
+
+/* the first uint32 of the body, for RequestName */
+static int64_t wire_body_u32(const std::string& message) {
+    bool little = message[0] == 'l';
+    size_t body = align8(16 + size_t(read32(message.data() + 12, little)));
+    if(body + 4 > message.size())
+        return -EBADMSG;
+    return read32(message.data() + body, little);
+}
+
+/* the first string of the body, for Hello */
+static std::string wire_body_string(const std::string& message) {
+    bool little = message[0] == 'l';
+    size_t body = align8(16 + size_t(read32(message.data() + 12, little)));
+    if(body + 4 > message.size())
+        return {};
+
+    uint32_t length = read32(message.data() + body, little);
+    if(body + 4 + length > message.size())
+        return {};
+    return message.substr(body + 4, length);
+}
+
+static void add_field(WireWriter& fields, uint8_t code, char type, const std::string& value) {
+    fields.align(8);
+    fields.byte(code);
+    fields.signature(std::string(1, type));
+    if(type == 'g')
+        fields.signature(value);
+    else
+        fields.string(value);
+}
+
+RawBus::~RawBus() {
+    if(sock >= 0)
+        close(sock);
+}
+
+/* %XX escapes are allowed in address values */
+static std::string unescape(const std::string& value) {
+    std::string out;
+    for(size_t i = 0; i < value.size(); i++) {
+        unsigned byte;
+        if(value[i] == '%' && i + 2 < value.size() && sscanf(value.c_str() + i + 1, "%2x", &byte) == 1) {
+            out.push_back(char(byte));
+            i += 2;
+        }
+        else
+            out.push_back(value[i]);
+    }
+    return out;
+}
+
+int RawBus::connect(const std::string& address) {
+    struct sockaddr_un sa = {};
+    socklen_t length = 0;
+
+    for(size_t begin = 0; begin <= address.size() && length == 0; ) {
+        size_t end = address.find(';', begin);
+        if(end == std::string::npos)
+            end = address.size();
+        std::string entry = address.substr(begin, end - begin);
+        begin = end + 1;
+
+        if(entry.compare(0, 5, "unix:") != 0)
+            continue;
+
+        for(size_t pos = 5; pos < entry.size(); ) {
+            size_t comma = entry.find(',', pos);
+            if(comma == std::string::npos)
+                comma = entry.size();
+            std::string pair = entry.substr(pos, comma - pos);
+            pos = comma + 1;
+
+            bool abstract = pair.compare(0, 9, "abstract=") == 0;
+            if(!abstract && pair.compare(0, 5, "path=") != 0)
+                continue;
+
+            std::string path = unescape(pair.substr(abstract ? 9 : 5));
+            if(path.size() + 1 >= sizeof(sa.sun_path))
+                return -ENAMETOOLONG;
+            sa.sun_family = AF_UNIX;
+            memcpy(sa.sun_path + (abstract ? 1 : 0), path.data(), path.size());
+            length = socklen_t(offsetof(struct sockaddr_un, sun_path) + path.size() + 1);
+        }
+    }
+    if(length == 0)
+        return -EAFNOSUPPORT;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if(sock < 0)
+        return -errno;
+    if(::connect(sock, reinterpret_cast<struct sockaddr*>(&sa), length) < 0 && errno != EINPROGRESS)
+        return -errno;
+
+    int r = authenticate();
+    if(r < 0)
+        return r;
+
+    std::string reply;
+    r = callBroker("Hello", "", WireWriter(), &reply);
+    if(r < 0)
+        return r;
+
+    name = wire_body_string(reply);
+    return name.empty() ? -EBADMSG : 0;
+}
+
+/* AUTH EXTERNAL with our uid in hex, the broker checks it against SO_PEERCRED */
+int RawBus::authenticate() {
+    std::string uid = std::to_string(getuid());
+    std::string hex;
+    char digits[3];
+    for(char c : uid) {
+        snprintf(digits, sizeof(digits), "%02x", (unsigned char) c);
+        hex += digits;
+    }
+
+    /* the protocol starts with a nul byte */
+    out.assign(1, '\0');
+    out += "AUTH EXTERNAL " + hex + "\r\n";
+    int r;
+    while((r = flush()) > 0) {
+        struct pollfd pfd = {sock, POLLOUT, 0};
+        poll(&pfd, 1, 5000);
+    }
+    if(r < 0)
+        return r;
+
+    std::string line;
+    r = readLine(line);
+    if(r < 0)
+        return r;
+    if(line.compare(0, 3, "OK ") != 0)
+        return -EACCES;
+
+    out = "BEGIN\r\n";
+    while((r = flush()) > 0) {
+        struct pollfd pfd = {sock, POLLOUT, 0};
+        poll(&pfd, 1, 5000);
+    }
+    return r;
+}
+
+int RawBus::readLine(std::string& line) {
+    for(;;) {
+        size_t eol = in.find("\r\n", inPos);
+        if(eol != std::string::npos) {
+            line = in.substr(inPos, eol - inPos);
+            inPos = eol + 2;
+            return 0;
+        }
+
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if(poll(&pfd, 1, 5000) <= 0)
+            return -ETIMEDOUT;
+        int r = receive();
+        if(r < 0)
+            return r;
+    }
+}
+
+int RawBus::callBroker(const char *member, const char *signature, const WireWriter& body, std::string *reply,
+                       const char *interface) {
+    uint32_t callSerial = nextSerial();
+
+    WireWriter fields;
+    add_field(fields, 1, 'o', "/org/freedesktop/DBus");
+    add_field(fields, 2, 's', interface);
+    add_field(fields, 3, 's', member);
+    add_field(fields, 6, 's', "org.freedesktop.DBus");
+    if(signature[0])
+        add_field(fields, 8, 'g', signature);
+
+    WireWriter message;
+    message.byte('l');
+    message.byte(WireHeader::MethodCall);
+    message.byte(0);
+    message.byte(1);
+    message.u32(uint32_t(body.data.size()));
+    message.u32(callSerial);
+    message.u32(uint32_t(fields.data.size()));
+    /* fields start at 16, 8 aligned like in their own buffer */
+    message.data += fields.data;
+    message.align(8);
+    message.data += body.data;
+
+    int r = send(message.data);
+    while(r > 0) {
+        struct pollfd pfd = {sock, POLLOUT, 0};
+        poll(&pfd, 1, 5000);
+        r = flush();
+    }
+    if(r < 0)
+        return r;
+
+    /* whatever comes before the reply stays queued, in order. receive() can move inPos, count from it */
+    size_t skipped = 0;
+    for(;;) {
+        for(size_t scan = inPos + skipped; scan < in.size(); scan = inPos + skipped) {
+            int64_t size = wire_message_size(in.data() + scan, in.size() - scan);
+            if(size < 0)
+                return int(size);
+            if(size == 0 || size_t(size) > in.size() - scan)
+                break;
+
+            std::string candidate = in.substr(scan, size_t(size));
+            WireHeader header;
+            r = wire_parse_header(candidate, header);
+            if(r < 0)
+                return r;
+            if((header.type == WireHeader::MethodReturn || header.type == WireHeader::Error) && header.replySerial == callSerial) {
+                in.erase(scan, size_t(size));
+                if(header.type == WireHeader::Error) {
+                    error = header.errorName;
+                    return -EREMOTEIO;
+                }
+                if(reply)
+                    *reply = candidate;
+                return 0;
+            }
+            skipped += size_t(size);
+        }
+
+        struct pollfd pfd = {sock, POLLIN, 0};
+        if(poll(&pfd, 1, 25000) <= 0)
+            return -ETIMEDOUT;
+        r = receive();
+        if(r < 0)
+            return r;
+    }
+}
+
+int RawBus::requestName(const std::string& name) {
+    WireWriter body;
+    std::string reply;
+
+    body.string(name);
+    body.u32(0);
+    int r = callBroker("RequestName", "su", body, &reply);
+    return r < 0 ? r : int(wire_body_u32(reply));
+}
+
+int RawBus::send(const std::string& message) {
+    out += message;
+    return flush();
+}
+
+int RawBus::flush() {
+    while(outPos < out.size()) {
+        ssize_t n = ::send(sock, out.data() + outPos, out.size() - outPos, MSG_NOSIGNAL);
+        if(n < 0) {
+            if(errno == EAGAIN)
+                return 1;
+            if(errno == EINTR)
+                continue;
+            return -errno;
+        }
+        outPos += size_t(n);
+    }
+
+    out.clear();
+    outPos = 0;
+    return 0;
+}
+
+int RawBus::receive() {
+    char buffer[65536];
+    int got = 0;
+
+    /* drop what was consumed before it grows */
+    if(inPos > 0 && inPos >= in.size() / 2) {
+        in.erase(0, inPos);
+        inPos = 0;
+    }
+
+    for(;;) {
+        ssize_t n = read(sock, buffer, sizeof(buffer));
+        if(n < 0) {
+            if(errno == EAGAIN)
+                return got;
+            if(errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if(n == 0)
+            return -ECONNRESET;
+        in.append(buffer, size_t(n));
+        got += int(n);
+        if(size_t(n) < sizeof(buffer))
+            return got;
+    }
+}
+
+int RawBus::nextMessage(std::string& message) {
+    int64_t size = wire_message_size(in.data() + inPos, in.size() - inPos);
+    if(size <= 0 || size_t(size) > in.size() - inPos)
+        return int(size < 0 ? size : 0);
+
+    message.assign(in, inPos, size_t(size));
+    inPos += size_t(size);
+    return 1;
+}
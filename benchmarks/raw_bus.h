@@ -0,0 +1,98 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/*
+ * Just enough of the D-Bus wire protocol for dbus_capture and dbus_replay, which work on serialized
+ * messages: sd-bus only gives us parsed messages and builds its own headers when sending.
+ * A RawBus connection to a unix socket broker does the EXTERNAL auth and Hello, then reads and writes
+ * whole messages as bytes. Broker calls are marshalled by hand with WireWriter.
+ *
+ * Everything returns a negative errno style value on failure, like sd-bus.
+ */
+
+/* builds a message body or header, little endian, alignment relative to the start of the message */
+class WireWriter {
+public:
+    std::string data;
+
+    void align(size_t n) { data.resize((data.size() + n - 1) / n * n, '\0'); }
+    void byte(uint8_t value) { data.push_back(char(value)); }
+    void u32(uint32_t value);
+    void string(const std::string& value);
+    void signature(const std::string& value);
+    void stringArray(const std::vector<std::string>& values);
+};
+
+/* fields of a message header we care about, see wire_parse_header */
+struct WireHeader {
+    enum Type : uint8_t { Invalid = 0, MethodCall = 1, MethodReturn = 2, Error = 3, Signal = 4 };
+    static const uint8_t flagNoReplyExpected = 0x1;
+
+    Type type = Invalid;
+    uint8_t flags = 0;
+    uint32_t serial = 0;
+    uint32_t replySerial = 0;
+    uint32_t unixFds = 0;
+    std::string path;
+    std::string interface;
+    std::string member;
+    std::string errorName;
+    std::string destination;
+    std::string sender;
+};
+
+/* size of the message starting at data, 0 when fewer than 16 bytes are available, -EBADMSG when it makes no sense */
+int64_t wire_message_size(const char *data, size_t available);
+int wire_parse_header(const std::string& message, WireHeader& header);
+/* the serial is at offset 8, in the byte order of the message */
+void wire_set_serial(std::string& message, uint32_t serial);
+
+class RawBus {
+public:
+    RawBus() = default;
+    RawBus(const RawBus&) = delete;
+    RawBus& operator=(const RawBus&) = delete;
+    ~RawBus();
+
+    /* unix:path= and unix:abstract= addresses, the first usable one of a ';' separated list */
+    int connect(const std::string& address);
+
+    int fd() const { return sock; }
+    const std::string& uniqueName() const { return name; }
+    uint32_t nextSerial() { return ++serial; }
+
+    /* blocking call to org.freedesktop.DBus, messages read meanwhile are kept for nextMessage().
+     * -EREMOTEIO when it replied with an error, named by lastError() */
+    int callBroker(const char *member, const char *signature, const WireWriter& body, std::string *reply = nullptr,
+                   const char *interface = "org.freedesktop.DBus");
+    const std::string& lastError() const { return error; }
+    /* RequestName without flags, returns its result: 1 when we are the primary owner */
+    int requestName(const std::string& name);
+
+    /* queues message and writes what the socket takes, flush() writes the rest, > 0 while some is left */
+    int send(const std::string& message);
+    int flush();
+    bool wantsWrite() const { return outPos < out.size(); }
+
+    /* reads what is available, -ECONNRESET on end of file */
+    int receive();
+    /* pops the next complete message read so far, 0 when there is none */
+    int nextMessage(std::string& message);
+
+private:
+    int authenticate();
+    int readLine(std::string& line);
+
+    int sock = -1;
+    std::string name;
+    std::string error;
+    uint32_t serial = 0;
+    std::string in;
+    size_t inPos = 0;
+    std::string out;
+    size_t outPos = 0;
+};
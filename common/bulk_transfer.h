@@ -0,0 +1,187 @@
+#pragma once
+
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <systemd/sd-bus.h>
+
+/*
+ * Helpers for the BulkTransfer methods of the example server.
+ *
+ * A sealed memfd can be handed to another process as a unix fd ("h" argument), the broker only
+ * passes the descriptor along, the data itself is never copied: the receiver maps the same pages.
+ * The seals make it safe for the receiver: once F_SEAL_WRITE, F_SEAL_SHRINK and F_SEAL_GROW are set,
+ * nobody (the sender included) can modify or truncate the buffer while it is being read.
+ * Sending the same buffer as "ay" copies it into the message, into the broker, and out again.
+ */
+
+static const unsigned bulkRequiredSeals = F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW;
+
+/* cheap checksum touching every byte, so both paths really read the data */
+inline uint64_t bulk_checksum(const void *data, size_t size) {
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    uint64_t sum = 0;
+    size_t i = 0;
+
+    for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        sum = (sum ^ word) * 0x100000001b3ULL;
+    }
+    for(; i < size; i++)
+        sum = (sum ^ bytes[i]) * 0x100000001b3ULL;
+
+    return sum;
+}
+
+/* deterministic content, seed changes it between transfers */
+inline void bulk_fill(void *data, size_t size, uint64_t seed) {
+    unsigned char *bytes = static_cast<unsigned char*>(data);
+    uint64_t value = seed * 0x9e3779b97f4a7c15ULL + 1;
+    size_t i = 0;
+
+    for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t), value += 0x9e3779b97f4a7c15ULL)
+        memcpy(bytes + i, &value, sizeof(value));
+    for(; i < size; i++)
+        bytes[i] = (unsigned char) i;
+}
+
+/* create a memfd of size bytes filled by bulk_fill(seed), and seal it. Returns the fd or -errno */
+inline int bulk_create_sealed_memfd(size_t size, uint64_t seed, uint64_t *checksum) {
+    int fd = memfd_create("bulk-transfer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(fd < 0)
+        return -errno;
+
+    if(ftruncate(fd, off_t(size)) < 0) {
+        int r = -errno;
+        close(fd);
+        return r;
+    }
+
+    if(size > 0) {
+        void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if(data == MAP_FAILED) {
+            int r = -errno;
+            close(fd);
+            return r;
+        }
+        bulk_fill(data, size, seed);
+        if(checksum)
+            *checksum = bulk_checksum(data, size);
+        /* F_SEAL_WRITE is refused while a writable shared mapping exists */
+        munmap(data, size);
+    }
+    else if(checksum)
+        *checksum = bulk_checksum(NULL, 0);
+
+    if(fcntl(fd, F_ADD_SEALS, bulkRequiredSeals | F_SEAL_SEAL) < 0) {
+        int r = -errno;
+        close(fd);
+        return r;
+    }
+
+    return fd;
+}
+
+/* check the seals of a received memfd and checksum its content without copying it */
+inline int bulk_read_sealed_memfd(int fd, uint64_t *size, uint64_t *checksum) {
+    int seals = fcntl(fd, F_GET_SEALS);
+    if(seals < 0)
+        return -errno;
+    if((unsigned(seals) & bulkRequiredSeals) != bulkRequiredSeals)
+        return -EPERM;
+
+    struct stat st;
+    if(fstat(fd, &st) < 0)
+        return -errno;
+
+    *size = uint64_t(st.st_size);
+    if(st.st_size == 0) {
+        *checksum = bulk_checksum(NULL, 0);
+        return 0;
+    }
+
+    void *data = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    if(data == MAP_FAILED)
+        return -errno;
+    *checksum = bulk_checksum(data, size_t(st.st_size));
+    munmap(data, size_t(st.st_size));
+
+    return 0;
+}
+
+/*
+ * Client side: send size bytes to the example server, as a sealed memfd (BulkTransfer)
+ * or as "ay" (BulkTransferArray), and check the size and checksum it replies.
+ */
+inline int bulk_transfer_call(sd_bus *bus, bool asArray, size_t size, uint64_t seed) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *call = NULL;
+    sd_bus_message *reply = NULL;
+    uint64_t expected = 0, readSize, checksum;
+    int fd = -1;
+    int r;
+
+    r = sd_bus_message_new_method_call(bus,
+                                       &call,
+                                       "org.nicolas.ServerExample",
+                                       "/org/nicolas/ServerExample",
+                                       "org.nicolas.ServerExample",
+                                       asArray ? "BulkTransferArray" : "BulkTransfer");
+    if(r < 0)
+        goto finish;
+
+    if(asArray) {
+        void *data;
+
+        /* reserve the array directly in the message and fill it there, that is one copy less than append_array */
+        r = sd_bus_message_append_array_space(call, 'y', size, &data);
+        if(r < 0)
+            goto finish;
+        bulk_fill(data, size, seed);
+        expected = bulk_checksum(data, size);
+    }
+    else {
+        fd = bulk_create_sealed_memfd(size, seed, &expected);
+        if(fd < 0) {
+            r = fd;
+            goto finish;
+        }
+        /* sd-bus duplicates the fd in the message */
+        r = sd_bus_message_append(call, "h", fd);
+        if(r < 0)
+            goto finish;
+    }
+
+    r = sd_bus_call(bus, call, 0, &error, &reply);
+    if(r < 0) {
+        std::cerr << "Failed to issue method call: " << error.message << std::endl;
+        goto finish;
+    }
+
+    r = sd_bus_message_read(reply, "tt", &readSize, &checksum);
+    if(r < 0)
+        goto finish;
+
+    if(readSize != size || checksum != expected) {
+        std::cerr << "Server read " << readSize << " bytes with checksum " << checksum
+                  << ", expected " << size << " bytes with checksum " << expected << std::endl;
+        r = -EIO;
+    }
+
+finish:
+    if(r < 0 && !sd_bus_error_is_set(&error))
+        std::cerr << "Bulk transfer failed: " << strerror(-r) << std::endl;
+    if(fd >= 0)
+        close(fd);
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(call);
+    sd_bus_message_unref(reply);
+    return r;
+}
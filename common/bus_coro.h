@@ -0,0 +1,443 @@
+#pragma once
+
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+#include <systemd/sd-bus.h>
+
+#include "typed_bus.h"
+
+/*
+ * C++20 coroutines over sd-bus, so a multi-step interaction reads as straight-line code:
+ *
+ *   bus_coro::Task<int> greet(bus_coro::Scheduler& scheduler) {
+ *       bus_coro::Message reply = co_await scheduler.call("org.nicolas.ServerExample", "/org/nicolas/ServerExample",
+ *                                                         "org.nicolas.ServerExample", "Greating", "patate");
+ *       if(reply.error() < 0)
+ *           co_return reply.error();
+ *       ...
+ *   }
+ *   scheduler.spawn(greet(scheduler));
+ *   scheduler.run();
+ *
+ * Task<T> is lazy: it starts when awaited, or when spawned on the Scheduler, which then drives the bus
+ * (sd_bus_process / sd_bus_wait on its fd) until every spawned task returned. Thousands of tasks can
+ * wait at the same time, a suspended task is a heap allocated frame and an sd-bus slot, no thread.
+ *
+ * A task waiting for a reply or a signal is resumed right from the sd-bus callback, before sd_bus_process
+ * looks at the next message. So after co_await call(...) returns, a task can start waiting for a signal
+ * keyed on something from the reply (StartUnit -> JobRemoved of that job) without missing it, messages
+ * from one sender arrive in order.
+ *
+ * Signals go through a Match: install() the match (awaitable AddMatch) before triggering what emits them,
+ * then co_await next() for the next one, signals arriving while nobody waits are queued.
+ * With a key function, next(key) waits for the signal with that key, e.g. the job path of JobRemoved,
+ * and signals nobody waits for are dropped instead of queued.
+ *
+ * when_all() runs several tasks at once from a task and waits for all of them, e.g. a fan-out with a bounded
+ * number of workers that all share a Match declared in the parent.
+ *
+ * Errors are negative errno values like in the rest of sd-bus, this does not throw.
+ * Single threaded like sd-bus: tasks, scheduler and bus belong to one thread.
+ */
+
+namespace bus_coro {
+
+/* owns a reference on a reply or signal, or holds the errno of a call that could not be sent */
+class Message {
+public:
+    Message() = default;
+    explicit Message(sd_bus_message *m) : m(sd_bus_message_ref(m)) {}
+    static Message failed(int error) {
+        Message message;
+        message.localError = error;
+        return message;
+    }
+
+    Message(Message&& other) noexcept : m(std::exchange(other.m, nullptr)), localError(other.localError) {}
+    Message& operator=(Message&& other) noexcept {
+        std::swap(m, other.m);
+        localError = other.localError;
+        return *this;
+    }
+    Message(const Message&) = delete;
+    Message& operator=(const Message&) = delete;
+    ~Message() { sd_bus_message_unref(m); }
+
+    sd_bus_message *get() const { return m; }
+
+    /* < 0 when the call could not be sent or the reply is an error */
+    int error() const {
+        if(localError < 0)
+            return localError;
+        if(!m)
+            return -ENOMSG;
+        if(sd_bus_message_is_method_error(m, NULL))
+            return -sd_bus_message_get_errno(m);
+        return 0;
+    }
+
+    /* D-Bus error name and message, or the errno text for local errors */
+    std::string errorText() const {
+        if(m && sd_bus_message_is_method_error(m, NULL)) {
+            const sd_bus_error *e = sd_bus_message_get_error(m);
+            return std::string(e->name) + ": " + (e->message ? e->message : "");
+        }
+        return strerror(-error());
+    }
+
+    template<typename... T>
+    int read(T&... values) const { return typed_bus::read(m, values...); }
+
+private:
+    sd_bus_message *m = nullptr;
+    int localError = 0;
+};
+
+template<typename T>
+class Task;
+
+namespace detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> continuation;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+
+    /* back to whoever awaited us, symmetric transfer so long chains do not grow the stack */
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template<typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+            std::coroutine_handle<> continuation = h.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { std::terminate(); }
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T v) { value = std::move(v); }
+    T result() { return std::move(*value); }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() {}
+};
+
+/* fire and forget coroutine used by Scheduler::spawn, runs right away and frees itself at the end */
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+}
+
+template<typename T = void>
+class [[nodiscard]] Task {
+public:
+    using promise_type = detail::Promise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> h) : h(h) {}
+    Task(Task&& other) noexcept : h(std::exchange(other.h, nullptr)) {}
+    Task& operator=(Task&& other) noexcept {
+        std::swap(h, other.h);
+        return *this;
+    }
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if(h)
+            h.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+        h.promise().continuation = awaiting;
+        return h;
+    }
+    T await_resume() { return h.promise().result(); }
+
+private:
+    std::coroutine_handle<promise_type> h;
+};
+
+template<typename T>
+Task<T> detail::Promise<T>::get_return_object() {
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() {
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+/* co_await when_all(std::move(tasks)): runs the tasks concurrently, resumes once the last one returned */
+class WhenAll {
+public:
+    explicit WhenAll(std::vector<Task<void>> tasks) : tasks(std::move(tasks)) {}
+
+    bool await_ready() const noexcept { return tasks.empty(); }
+    bool await_suspend(std::coroutine_handle<> h) {
+        waiter = h;
+        /* one extra count so a task completing right away can not resume us before we are suspended */
+        remaining = tasks.size() + 1;
+        for(Task<void>& task : tasks)
+            run(this, std::move(task));
+        return --remaining > 0;
+    }
+    void await_resume() noexcept {}
+
+private:
+    static detail::Detached run(WhenAll *all, Task<void> task) {
+        co_await task;
+        if(--all->remaining == 0)
+            all->waiter.resume();
+    }
+
+    std::vector<Task<void>> tasks;
+    size_t remaining = 0;
+    std::coroutine_handle<> waiter;
+};
+
+inline WhenAll when_all(std::vector<Task<void>> tasks) {
+    return WhenAll(std::move(tasks));
+}
+
+/* co_await scheduler.call(...), gives the reply as a Message */
+class CallAwaiter {
+public:
+    CallAwaiter(sd_bus *bus, sd_bus_message *call, int error, uint64_t timeoutUsec)
+        : bus(bus), call(call), buildError(error), timeoutUsec(timeoutUsec) {}
+    CallAwaiter(const CallAwaiter&) = delete;
+    CallAwaiter& operator=(const CallAwaiter&) = delete;
+    ~CallAwaiter() {
+        /* fine from within our own reply callback */
+        sd_bus_slot_unref(slot);
+        sd_bus_message_unref(call);
+    }
+
+    /* a call that could not be built completes right away with the error */
+    bool await_ready() const noexcept { return buildError < 0; }
+    bool await_suspend(std::coroutine_handle<> h) {
+        waiter = h;
+        int r = sd_bus_call_async(bus, &slot, call, on_reply, this, timeoutUsec);
+        if(r < 0) {
+            buildError = r;
+            return false;
+        }
+        return true;
+    }
+    Message await_resume() { return buildError < 0 ? Message::failed(buildError) : std::move(result); }
+
+private:
+    static int on_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        CallAwaiter *awaiter = static_cast<CallAwaiter*>(userdata);
+        awaiter->result = Message(m);
+        /* the awaiter is gone once the task moved on, do not touch it after this */
+        awaiter->waiter.resume();
+        return 0;
+    }
+
+    sd_bus *bus;
+    sd_bus_message *call;
+    int buildError;
+    Message result;
+    uint64_t timeoutUsec;
+    sd_bus_slot *slot = NULL;
+    std::coroutine_handle<> waiter;
+};
+
+class Scheduler {
+public:
+    explicit Scheduler(sd_bus *bus) : bus(sd_bus_ref(bus)) {}
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+    ~Scheduler() { sd_bus_unref(bus); }
+
+    sd_bus *get() const { return bus; }
+
+    /* runs the task until its first co_await, run() then drives it to the end */
+    void spawn(Task<void> task) {
+        running++;
+        detach(this, std::move(task));
+    }
+
+    size_t tasks() const { return running; }
+
+    /* timeoutUsec 0 is the sd-bus default of 25 s */
+    template<typename... Args>
+    CallAwaiter call(const char *destination, const char *path, const char *interface, const char *member, const Args&... args) {
+        return callWithTimeout(0, destination, path, interface, member, args...);
+    }
+
+    template<typename... Args>
+    CallAwaiter callWithTimeout(uint64_t timeoutUsec, const char *destination, const char *path, const char *interface,
+                                const char *member, const Args&... args) {
+        sd_bus_message *m = NULL;
+
+        int r = sd_bus_message_new_method_call(bus, &m, destination, path, interface, member);
+        if(r >= 0 && sizeof...(Args) > 0)
+            r = typed_bus::append(m, args...);
+        return CallAwaiter(bus, m, r < 0 ? r : 0, timeoutUsec);
+    }
+
+    /* process the bus until every spawned task returned */
+    int run() {
+        while(running > 0) {
+            int r = sd_bus_process(bus, NULL);
+            if(r < 0)
+                return r;
+            if(r > 0)
+                continue;
+
+            r = sd_bus_wait(bus, UINT64_MAX);
+            if(r < 0 && r != -EINTR)
+                return r;
+        }
+        return 0;
+    }
+
+private:
+    static detail::Detached detach(Scheduler *scheduler, Task<void> task) {
+        co_await task;
+        scheduler->running--;
+    }
+
+    sd_bus *bus;
+    size_t running = 0;
+};
+
+/* a signal match to co_await on, see the top of the file */
+class Match {
+public:
+    using KeyFunction = std::function<std::string(sd_bus_message*)>;
+
+    Match(Scheduler& scheduler, const char *sender, const char *path, const char *interface, const char *member,
+          KeyFunction key = nullptr)
+        : scheduler(scheduler), sender(sender), path(path), interface(interface), member(member), key(std::move(key)) {}
+    Match(const Match&) = delete;
+    Match& operator=(const Match&) = delete;
+    ~Match() { sd_bus_slot_unref(slot); }
+
+    struct InstallAwaiter {
+        Match *match;
+        int result = 0;
+
+        bool await_ready() const noexcept { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            match->installer = h;
+            result = sd_bus_match_signal_async(match->scheduler.get(), &match->slot, match->sender, match->path,
+                                               match->interface, match->member, on_signal, on_installed, match);
+            return result >= 0;
+        }
+        int await_resume() { return result < 0 ? result : match->installError; }
+    };
+
+    /* AddMatch round trip, the match is active once this returned 0 */
+    InstallAwaiter install() { return InstallAwaiter{this}; }
+
+    struct NextAwaiter {
+        Match *match;
+        std::string key;
+        bool keyed;
+        Message message;
+
+        bool await_ready() {
+            if(keyed || match->queued.empty())
+                return false;
+            message = std::move(match->queued.front());
+            match->queued.pop_front();
+            return true;
+        }
+        void await_suspend(std::coroutine_handle<> h) {
+            waiter = h;
+            if(keyed)
+                match->keyed[key] = this;
+            else
+                match->anyWaiter = this;
+        }
+        Message await_resume() { return std::move(message); }
+
+        std::coroutine_handle<> waiter;
+    };
+
+    /* next signal, the oldest queued one if some arrived meanwhile */
+    NextAwaiter next() { return NextAwaiter{this, {}, false, {}}; }
+    /* next signal whose key function gives key, one waiter per key */
+    NextAwaiter next(std::string key) { return NextAwaiter{this, std::move(key), true, {}}; }
+
+private:
+    static int on_installed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Match *match = static_cast<Match*>(userdata);
+        if(sd_bus_message_is_method_error(m, NULL))
+            match->installError = -sd_bus_message_get_errno(m);
+        match->installer.resume();
+        return 0;
+    }
+
+    static int on_signal(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        Match *match = static_cast<Match*>(userdata);
+        NextAwaiter *waiter = nullptr;
+
+        if(match->key && !match->keyed.empty()) {
+            std::string k = match->key(m);
+            sd_bus_message_rewind(m, 1);
+            auto it = match->keyed.find(k);
+            if(it != match->keyed.end()) {
+                waiter = it->second;
+                match->keyed.erase(it);
+            }
+        }
+        if(!waiter && match->anyWaiter)
+            waiter = std::exchange(match->anyWaiter, nullptr);
+
+        if(waiter) {
+            waiter->message = Message(m);
+            waiter->waiter.resume();
+        }
+        else if(!match->key)
+            match->queued.emplace_back(m);
+
+        return 0;
+    }
+
+    Scheduler& scheduler;
+    const char *sender;
+    const char *path;
+    const char *interface;
+    const char *member;
+    KeyFunction key;
+    sd_bus_slot *slot = NULL;
+    std::coroutine_handle<> installer;
+    int installError = 0;
+    std::deque<Message> queued;
+    NextAwaiter *anyWaiter = nullptr;
+    std::unordered_map<std::string, NextAwaiter*> keyed;
+};
+
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <systemd/sd-bus.h>
+
+/*
+ * Many sd_bus connections (user bus, system bus, peer to peer...) served by one thread.
+ *
+ * Every connection's sd_bus_get_fd is in one epoll set. Before each wait we refresh what sd-bus wants:
+ * sd_bus_get_events (POLLOUT only while the write queue is not empty) and sd_bus_get_timeout
+ * (pending method call timeouts, or 0 when messages are already queued for dispatch),
+ * then only the connections whose fd is ready or whose deadline passed get sd_bus_process.
+ * A connection is processed for at most dispatchBudget messages per iteration, so a busy one
+ * can not starve the others.
+ *
+ * The refresh walks every connection, which costs nothing next to a syscall for the handful of
+ * connections an agent has, and catches sends made on a connection from the callbacks of another one.
+ * Other fds (listening sockets, timerfd, signalfd, eventfd...) can be added with addFd.
+ *
+ * Connections must be started already (sd_bus_open_* or sd_bus_start). A connection that gets closed
+ * is dropped from the reactor after sd-bus dispatched its Disconnected signal. remove() and removeFd()
+ * are fine from callbacks, the entry is only freed at the end of the iteration.
+ * Like sd-bus itself, a reactor and its connections must be used from a single thread.
+ */
+class BusReactor {
+public:
+    using FdCallback = std::function<int(uint32_t events)>;
+
+    static const unsigned dispatchBudget = 64;
+
+    BusReactor() = default;
+    BusReactor(const BusReactor&) = delete;
+    BusReactor& operator=(const BusReactor&) = delete;
+
+    ~BusReactor() {
+        for(auto& watch : watches)
+            sd_bus_unref(watch->bus);
+        if(epollFd >= 0)
+            close(epollFd);
+    }
+
+    int open() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        return epollFd < 0 ? -errno : 0;
+    }
+
+    /* takes a reference on bus */
+    int add(sd_bus *bus) {
+        int fd = sd_bus_get_fd(bus);
+        if(fd < 0)
+            return fd;
+
+        auto watch = std::make_unique<Watch>();
+        watch->fd = fd;
+        int r = arm(watch.get(), uint32_t(EPOLLIN), EPOLL_CTL_ADD);
+        if(r < 0)
+            return r;
+
+        watch->bus = sd_bus_ref(bus);
+        watches.push_back(std::move(watch));
+        return 0;
+    }
+
+    int remove(sd_bus *bus) {
+        for(auto& watch : watches)
+            if(watch->bus == bus && !watch->removed)
+                return drop(watch.get());
+        return -ENOENT;
+    }
+
+    /* events are EPOLLIN/EPOLLOUT..., the callback gets the ready ones, returning < 0 ends run() with that error */
+    int addFd(int fd, uint32_t events, FdCallback callback) {
+        auto watch = std::make_unique<Watch>();
+        watch->fd = fd;
+        watch->callback = std::move(callback);
+        int r = arm(watch.get(), events, EPOLL_CTL_ADD);
+        if(r < 0)
+            return r;
+
+        watches.push_back(std::move(watch));
+        return 0;
+    }
+
+    int removeFd(int fd) {
+        for(auto& watch : watches)
+            if(!watch->bus && watch->fd == fd && !watch->removed)
+                return drop(watch.get());
+        return -ENOENT;
+    }
+
+    size_t connections() const {
+        return size_t(std::count_if(watches.begin(), watches.end(),
+                                    [](const auto& watch) { return watch->bus && !watch->removed; }));
+    }
+
+    void exit(int code = 0) {
+        exiting = true;
+        exitCode = code;
+    }
+
+    int run() {
+        exiting = false;
+        while(!exiting) {
+            int r = runOnce(UINT64_MAX);
+            if(r < 0)
+                return r;
+        }
+        return exitCode;
+    }
+
+    /* one wait and dispatch, timeoutUsec is relative, UINT64_MAX to wait until something happens */
+    int runOnce(uint64_t timeoutUsec) {
+        struct epoll_event events[64];
+        uint64_t deadline = timeoutUsec == UINT64_MAX ? UINT64_MAX : now_usec() + timeoutUsec;
+        int r = 0;
+
+        for(auto& watch : watches) {
+            if(!watch->bus || watch->removed)
+                continue;
+
+            /* POLLIN/POLLOUT have the same values as EPOLLIN/EPOLLOUT */
+            int wanted = sd_bus_get_events(watch->bus);
+            uint64_t busDeadline = UINT64_MAX;
+            if(wanted < 0) {
+                /* closed by sd-bus, fd included, the next sd_bus_process fails and drops it */
+                busDeadline = 0;
+            }
+            else {
+                if(uint32_t(wanted) != watch->events) {
+                    r = arm(watch.get(), uint32_t(wanted), EPOLL_CTL_MOD);
+                    if(r < 0)
+                        return r;
+                }
+                if(watch->ready || sd_bus_get_timeout(watch->bus, &busDeadline) < 0)
+                    busDeadline = 0;
+            }
+            watch->deadline = busDeadline;
+            deadline = std::min(deadline, busDeadline);
+        }
+
+        uint64_t now = now_usec();
+        int timeoutMs = deadline == UINT64_MAX ? -1 : deadline <= now ? 0 : int(std::min<uint64_t>((deadline - now + 999) / 1000, INT32_MAX));
+
+        int n = epoll_wait(epollFd, events, 64, timeoutMs);
+        if(n < 0 && errno != EINTR)
+            return -errno;
+
+        for(int i = 0; i < n && r >= 0; i++) {
+            Watch *watch = static_cast<Watch*>(events[i].data.ptr);
+            if(watch->removed)
+                continue;
+            if(watch->bus)
+                watch->ready = true;
+            else
+                r = watch->callback(events[i].events);
+        }
+
+        now = now_usec();
+        for(size_t i = 0; i < watches.size() && r >= 0; i++) {
+            Watch *watch = watches[i].get();
+            if(!watch->bus || watch->removed || (!watch->ready && watch->deadline > now))
+                continue;
+            watch->ready = false;
+            dispatch(watch);
+        }
+
+        collect();
+        return r < 0 ? r : 0;
+    }
+
+private:
+    struct Watch {
+        sd_bus *bus = NULL;
+        int fd = -1;
+        uint32_t events = 0;
+        uint64_t deadline = UINT64_MAX;
+        bool ready = false;
+        bool removed = false;
+        FdCallback callback;
+    };
+
+    static uint64_t now_usec() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000 + uint64_t(ts.tv_nsec) / 1000;
+    }
+
+    int arm(Watch *watch, uint32_t events, int op) {
+        struct epoll_event event = {};
+        event.events = events;
+        event.data.ptr = watch;
+        if(epoll_ctl(epollFd, op, watch->fd, &event) < 0)
+            return -errno;
+        watch->events = events;
+        return 0;
+    }
+
+    int drop(Watch *watch) {
+        /* once sd-bus closed the connection its fd is closed too and epoll forgot it by itself,
+         * the number may even belong to a new connection already */
+        if(!watch->bus || sd_bus_get_events(watch->bus) >= 0)
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, watch->fd, NULL);
+        watch->removed = true;
+        return 0;
+    }
+
+    void dispatch(Watch *watch) {
+        for(unsigned i = 0; i < dispatchBudget; i++) {
+            int r = sd_bus_process(watch->bus, NULL);
+            if(r < 0) {
+                drop(watch);
+                return;
+            }
+            if(r == 0)
+                return;
+        }
+        /* budget used up, come back right after the next wait */
+        watch->ready = true;
+    }
+
+    void collect() {
+        auto removed = std::stable_partition(watches.begin(), watches.end(), [](const auto& watch) { return !watch->removed; });
+        for(auto it = removed; it != watches.end(); ++it)
+            sd_bus_unref((*it)->bus);
+        watches.erase(removed, watches.end());
+    }
+
+    int epollFd = -1;
+    std::vector<std::unique_ptr<Watch>> watches;
+    bool exiting = false;
+    int exitCode = 0;
+};
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <systemd/sd-bus.h>
+
+/*
+ * Runtime counters exported as properties of an org.nicolas.Stats interface, added next to the
+ * example interface of a program:
+ *
+ * busctl --user introspect org.nicolas.ServerExample /org/nicolas/ServerExample org.nicolas.Stats
+ * .CallCounts       property  a{st}  - calls per method
+ * .ErrorCounts      property  a{st}  - calls per method which ended with an error
+ * .HandlerLatency   property  a{sat} - per method, bucket i counts handler times in [2^i, 2^(i+1)) ns
+ * .SignalsEmitted   property  t      - signal messages sent
+ * .SignalsDropped   property  t      - signals not sent because of flow control
+ * .SignalsCoalesced property  t      - signals replaced by a newer one because of flow control
+ * .WriteQueueSize   property  t      - messages waiting to be written on the connection the Get came in on
+ * .ReadQueueSize    property  t      - messages read but not processed yet on that connection
+ *
+ * Methods are known upfront and indexed by the program (an enum), so the hot path is a few relaxed
+ * atomic increments, no lock and no lookup. Worker threads can record too.
+ * Values are only read when somebody asks for the properties, they change too often for PropertiesChanged
+ * and their vtable flags are 0, which means they never emit it, clients have to Get them.
+ */
+
+class BusStats {
+public:
+    static const unsigned latencyBuckets = 32;
+
+    explicit BusStats(std::initializer_list<const char*> methodNames)
+        : names(methodNames), methods(new MethodStats[methodNames.size()]) {}
+
+    BusStats(const BusStats&) = delete;
+    BusStats& operator=(const BusStats&) = delete;
+
+    static uint64_t now_ns() {
+        return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    void record(unsigned method, uint64_t ns, bool error) {
+        MethodStats& stats = methods[method];
+        stats.calls.fetch_add(1, std::memory_order_relaxed);
+        if(error)
+            stats.errors.fetch_add(1, std::memory_order_relaxed);
+        stats.latency[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void signalsEmitted(uint64_t count = 1) {
+        signals.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    void signalsDropped(uint64_t count = 1) {
+        dropped.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    void signalsCoalesced(uint64_t count = 1) {
+        coalesced.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    uint64_t calls(unsigned method) const { return methods[method].calls.load(std::memory_order_relaxed); }
+    uint64_t errors(unsigned method) const { return methods[method].errors.load(std::memory_order_relaxed); }
+
+    /* adds org.nicolas.Stats at path, slot can be NULL to tie it to the bus lifetime */
+    int attach(sd_bus *bus, sd_bus_slot **slot, const char *path) {
+        return sd_bus_add_object_vtable(bus, slot, path, "org.nicolas.Stats", vtable, this);
+    }
+
+    /* times one handler call, from construction to destruction.
+     * done(r) counts an error when r < 0, defer() leaves the recording to whoever sends the reply later */
+    class CallTimer {
+    public:
+        CallTimer(BusStats& stats, unsigned method) : stats(stats), method(method), start(now_ns()) {}
+        ~CallTimer() {
+            if(!deferred)
+                stats.record(method, now_ns() - start, error);
+        }
+
+        int done(int r) {
+            error = r < 0;
+            return r;
+        }
+
+        uint64_t defer() {
+            deferred = true;
+            return start;
+        }
+
+    private:
+        BusStats& stats;
+        unsigned method;
+        uint64_t start;
+        bool error = false;
+        bool deferred = false;
+    };
+
+private:
+    struct MethodStats {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> latency[latencyBuckets] = {};
+    };
+
+    static unsigned bucket(uint64_t ns) {
+        unsigned b = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+        return b < latencyBuckets ? b : latencyBuckets - 1;
+    }
+
+    static int get_counts(sd_bus *bus, const char *path, const char *interface, const char *property,
+                          sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+        BusStats *stats = static_cast<BusStats*>(userdata);
+        bool errors = property[0] == 'E';
+
+        int r = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "{st}");
+        for(size_t i = 0; i < stats->names.size() && r >= 0; i++)
+            r = sd_bus_message_append(reply, "{st}", stats->names[i], errors ? stats->errors(i) : stats->calls(i));
+        if(r >= 0)
+            r = sd_bus_message_close_container(reply);
+        return r;
+    }
+
+    static int get_latency(sd_bus *bus, const char *path, const char *interface, const char *property,
+                           sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+        BusStats *stats = static_cast<BusStats*>(userdata);
+        uint64_t buckets[latencyBuckets];
+
+        int r = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "{sat}");
+        for(size_t i = 0; i < stats->names.size() && r >= 0; i++) {
+            for(unsigned b = 0; b < latencyBuckets; b++)
+                buckets[b] = stats->methods[i].latency[b].load(std::memory_order_relaxed);
+
+            r = sd_bus_message_open_container(reply, SD_BUS_TYPE_DICT_ENTRY, "sat");
+            if(r >= 0)
+                r = sd_bus_message_append_basic(reply, 's', stats->names[i]);
+            if(r >= 0)
+                r = sd_bus_message_append_array(reply, 't', buckets, sizeof(buckets));
+            if(r >= 0)
+                r = sd_bus_message_close_container(reply);
+        }
+        if(r >= 0)
+            r = sd_bus_message_close_container(reply);
+        return r;
+    }
+
+    static int get_counter(sd_bus *bus, const char *path, const char *interface, const char *property,
+                           sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+        BusStats *stats = static_cast<BusStats*>(userdata);
+        uint64_t value = 0;
+        int r = 0;
+
+        if(strcmp(property, "SignalsEmitted") == 0)
+            value = stats->signals.load(std::memory_order_relaxed);
+        else if(strcmp(property, "SignalsDropped") == 0)
+            value = stats->dropped.load(std::memory_order_relaxed);
+        else if(strcmp(property, "SignalsCoalesced") == 0)
+            value = stats->coalesced.load(std::memory_order_relaxed);
+        else if(property[0] == 'W')
+            r = sd_bus_get_n_queued_write(bus, &value);
+        else
+            r = sd_bus_get_n_queued_read(bus, &value);
+        if(r < 0)
+            return r;
+
+        return sd_bus_message_append_basic(reply, 't', &value);
+    }
+
+    static inline const sd_bus_vtable vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_PROPERTY("CallCounts", "a{st}", get_counts, 0, 0),
+        SD_BUS_PROPERTY("ErrorCounts", "a{st}", get_counts, 0, 0),
+        SD_BUS_PROPERTY("HandlerLatency", "a{sat}", get_latency, 0, 0),
+        SD_BUS_PROPERTY("SignalsEmitted", "t", get_counter, 0, 0),
+        SD_BUS_PROPERTY("SignalsDropped", "t", get_counter, 0, 0),
+        SD_BUS_PROPERTY("SignalsCoalesced", "t", get_counter, 0, 0),
+        SD_BUS_PROPERTY("WriteQueueSize", "t", get_counter, 0, 0),
+        SD_BUS_PROPERTY("ReadQueueSize", "t", get_counter, 0, 0),
+        SD_BUS_VTABLE_END
+    };
+
+    std::vector<const char*> names;
+    std::unique_ptr<MethodStats[]> methods;
+    std::atomic<uint64_t> signals{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> coalesced{0};
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <atomic>
+
+/*
+ * Lock-free multi producer / single consumer queue of intrusive nodes (Node needs a "Node *next" member).
+ * Producers push with a single compare and swap on the head, the consumer takes the whole list
+ * at once with an exchange and reverses it to get the items back in push order.
+ *
+ * push() returns true when the queue was empty, that is when the producer needs to wake up
+ * the consumer (e.g. write to an eventfd). As long as the consumer did not drain the queue,
+ * following producers do not need another wakeup, so under load we do one syscall per batch.
+ */
+template<typename Node>
+class CompletionQueue {
+public:
+    bool push(Node *node) {
+        Node *head = top.load(std::memory_order_relaxed);
+        do {
+            node->next = head;
+        } while(!top.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+        return head == nullptr;
+    }
+
+    /* returns the oldest node, linked to the next ones through next */
+    Node *drain() {
+        Node *node = top.exchange(nullptr, std::memory_order_acquire);
+        Node *fifo = nullptr;
+        while(node) {
+            Node *next = node->next;
+            node->next = fifo;
+            fifo = node;
+            node = next;
+        }
+        return fifo;
+    }
+
+private:
+    std::atomic<Node*> top = nullptr;
+};
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+
+/*
+ * Log-linear latency histogram, in the spirit of HdrHistogram.
+ * Values (nanoseconds) below 128 get their own bucket, above that every power of two
+ * is split in 64 sub-buckets, so any recorded value is reported with less than 1.6% error
+ * while the whole uint64_t range fits in a fixed array of ~3800 counters.
+ * Recording is a couple of integer ops, no allocation, so it is fine to call it from a bus callback.
+ *
+ * Not thread safe, use one histogram per thread and merge() them when reporting.
+ */
+class LatencyHistogram {
+public:
+    static constexpr unsigned subBucketBits = 7;
+    static constexpr uint64_t subBucketCount = uint64_t(1) << subBucketBits;
+    static constexpr uint64_t subBucketHalf = subBucketCount / 2;
+    static constexpr size_t bucketCount = (64 - subBucketBits + 1) * subBucketHalf + subBucketHalf;
+
+    void record(uint64_t value) {
+        counts[indexOf(value)]++;
+        total++;
+        sum += value;
+        minValue = std::min(minValue, value);
+        maxValue = std::max(maxValue, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for(size_t i = 0; i < bucketCount; i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        minValue = std::min(minValue, other.minValue);
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    void reset() {
+        counts.fill(0);
+        total = 0;
+        sum = 0;
+        minValue = std::numeric_limits<uint64_t>::max();
+        maxValue = 0;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? minValue : 0; }
+    uint64_t max() const { return maxValue; }
+    double mean() const { return total ? double(sum) / double(total) : 0.0; }
+
+    /* percentile in [0, 100], returns the highest value equivalent to the bucket holding it */
+    uint64_t percentile(double p) const {
+        if(total == 0)
+            return 0;
+        uint64_t rank = uint64_t(p / 100.0 * double(total) + 0.5);
+        rank = std::clamp<uint64_t>(rank, 1, total);
+        uint64_t seen = 0;
+        for(size_t i = 0; i < bucketCount; i++) {
+            seen += counts[i];
+            if(seen >= rank)
+                return std::min(highestEquivalent(i), maxValue);
+        }
+        return maxValue;
+    }
+
+private:
+    static size_t indexOf(uint64_t value) {
+        if(value < subBucketCount)
+            return size_t(value);
+        unsigned msb = 63 - unsigned(__builtin_clzll(value));
+        unsigned shift = msb - (subBucketBits - 1);
+        return size_t(shift) * subBucketHalf + size_t(value >> shift);
+    }
+
+    static uint64_t highestEquivalent(size_t index) {
+        if(index < subBucketCount)
+            return index;
+        unsigned shift = unsigned(index / subBucketHalf) - 1;
+        uint64_t mantissa = index % subBucketHalf + subBucketHalf;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+    std::array<uint64_t, bucketCount> counts{};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t minValue = std::numeric_limits<uint64_t>::max();
+    uint64_t maxValue = 0;
+};
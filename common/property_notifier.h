@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+/*
+ * Coalesced PropertiesChanged emission. changed() only records which property of which interface changed,
+ * the first change arms a timer and when the window is over we emit one PropertiesChanged per object
+ * and interface for everything that changed in between, on every bus the object is exported on.
+ * sd_bus_emit_properties_changed_strv calls the getters at that point, so listeners get the latest values,
+ * a counter bumped by every call costs one signal per window instead of one per call.
+ *
+ * The properties must be declared with SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE (or _INVALIDATION).
+ * A window of 0 emits right away, one signal per change. Bus thread only.
+ */
+
+class PropertyNotifier {
+public:
+    PropertyNotifier() = default;
+    PropertyNotifier(const PropertyNotifier&) = delete;
+    PropertyNotifier& operator=(const PropertyNotifier&) = delete;
+    ~PropertyNotifier() { stop(); }
+
+    int start(sd_event *e, uint64_t windowUsec) {
+        event = sd_event_ref(e);
+        window = windowUsec;
+        if(window == 0)
+            return 0;
+
+        /* armed by changed(), one shot. Accuracy 0 would mean the default 250 ms slack, longer than most windows */
+        int r = sd_event_add_time(event, &timer, CLOCK_MONOTONIC, 0, 1, on_window, this);
+        if(r >= 0)
+            r = sd_event_source_set_enabled(timer, SD_EVENT_OFF);
+        return r;
+    }
+
+    /* sends what is still pending */
+    void stop() {
+        flush();
+        timer = sd_event_source_unref(timer);
+        event = sd_event_unref(event);
+        buses.clear();
+    }
+
+    void addBus(sd_bus *bus) { buses.insert(bus); }
+    void removeBus(sd_bus *bus) { buses.erase(bus); }
+
+    void changed(const char *path, const char *interface, const char *property) {
+        changes++;
+        bool first = pending.empty();
+        pending[{path, interface}].insert(property);
+
+        if(!timer) {
+            flush();
+            return;
+        }
+        if(!first)
+            return;
+
+        uint64_t now;
+        int r = sd_event_now(event, CLOCK_MONOTONIC, &now);
+        if(r >= 0)
+            r = sd_event_source_set_time(timer, now + window);
+        if(r >= 0)
+            r = sd_event_source_set_enabled(timer, SD_EVENT_ONESHOT);
+        if(r < 0)
+            flush();
+    }
+
+    /* emits everything pending now, returns the first error */
+    int flush() {
+        int ret = 0;
+
+        for(auto& [object, properties] : pending) {
+            std::vector<char*> names;
+            for(const std::string& property : properties)
+                names.push_back(const_cast<char*>(property.c_str()));
+            names.push_back(NULL);
+
+            for(sd_bus *bus : buses) {
+                int r = sd_bus_emit_properties_changed_strv(bus, object.first.c_str(), object.second.c_str(), names.data());
+                if(r >= 0)
+                    emitted++;
+                else if(ret == 0)
+                    ret = r;
+            }
+        }
+        pending.clear();
+
+        return ret;
+    }
+
+    uint64_t changeCount() const { return changes; }
+    uint64_t signalCount() const { return emitted; }
+
+private:
+    static int on_window(sd_event_source *source, uint64_t usec, void *userdata) {
+        PropertyNotifier *notifier = static_cast<PropertyNotifier*>(userdata);
+        /* not fatal for the event loop, a listener will get the next window */
+        notifier->flush();
+        return 0;
+    }
+
+    sd_event *event = NULL;
+    sd_event_source *timer = NULL;
+    uint64_t window = 0;
+    std::set<sd_bus*> buses;
+    /* (path, interface) -> property names, sorted so the emission order does not depend on the calls */
+    std::map<std::pair<std::string, std::string>, std::set<std::string>> pending;
+    uint64_t changes = 0;
+    uint64_t emitted = 0;
+};
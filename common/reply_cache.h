@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include <systemd/sd-bus.h>
+
+/*
+ * Memoization of method replies, for methods whose reply only depends on their arguments.
+ * A bounded LRU: the key is the method name and the serialized arguments (see typed_bus::pure_method),
+ * the value the reply message we sent the first time. On a hit we skip the handler: a new method return
+ * gets the body of the cached one copied in (sd_bus_message_copy) and is sent right away.
+ *
+ * Exported as properties of org.nicolas.ReplyCache:
+ * busctl --user introspect org.nicolas.ServerExample /org/nicolas/ServerExample org.nicolas.ReplyCache
+ * .Hits, .Misses, .Evictions  property t - lookups served from the cache, sent to the handler, entries dropped
+ * .Entries, .Capacity         property t - cached replies now, at most
+ *
+ * maxEntries bounds the number of replies, arguments longer than maxKeyBytes are never cached.
+ * A cached reply keeps a reference on the connection it was first sent on, until it is evicted.
+ * Bus thread only, like the messages it holds. Capacity 0 disables the cache.
+ */
+
+class ReplyCache {
+public:
+    explicit ReplyCache(size_t maxEntries = 0, size_t maxKeyBytes = 4096)
+        : maxEntries(maxEntries), maxKeyBytes(maxKeyBytes) {}
+    ReplyCache(const ReplyCache&) = delete;
+    ReplyCache& operator=(const ReplyCache&) = delete;
+    ~ReplyCache() { clear(); }
+
+    void setCapacity(size_t entries) {
+        maxEntries = entries;
+        while(lru.size() > maxEntries)
+            evict();
+    }
+
+    bool enabled() const { return maxEntries > 0; }
+    bool cacheable(const std::string& key) const { return enabled() && key.size() <= maxKeyBytes; }
+
+    /* > 0 when the cached reply was sent to call, 0 on a miss, < 0 if sending failed */
+    int reply(sd_bus_message *call, const std::string& key) {
+        auto it = index.find(key);
+        if(it == index.end()) {
+            misses++;
+            return 0;
+        }
+        hits++;
+        lru.splice(lru.begin(), lru, it->second);
+
+        sd_bus_message *cached = it->second->reply;
+        sd_bus_message *reply = NULL;
+
+        /* a sent message is sealed, rewinding it lets us read it again */
+        int r = sd_bus_message_new_method_return(call, &reply);
+        if(r >= 0)
+            r = sd_bus_message_rewind(cached, 1);
+        if(r >= 0)
+            r = sd_bus_message_copy(reply, cached, 1);
+        if(r >= 0)
+            r = sd_bus_send(NULL, reply, NULL);
+
+        sd_bus_message_unref(reply);
+        return r < 0 ? r : 1;
+    }
+
+    /* reply has been sent for a call with that key */
+    void store(const std::string& key, sd_bus_message *reply) {
+        if(!cacheable(key) || index.count(key) > 0)
+            return;
+
+        lru.push_front(Entry{key, sd_bus_message_ref(reply)});
+        index.emplace(key, lru.begin());
+        while(lru.size() > maxEntries)
+            evict();
+    }
+
+    /* e.g. when something the replies depend on changed */
+    void clear() {
+        for(Entry& entry : lru)
+            sd_bus_message_unref(entry.reply);
+        lru.clear();
+        index.clear();
+    }
+
+    uint64_t hitCount() const { return hits; }
+    uint64_t missCount() const { return misses; }
+    uint64_t evictionCount() const { return evictions; }
+    size_t size() const { return lru.size(); }
+
+    /* adds org.nicolas.ReplyCache at path, slot can be NULL to tie it to the bus lifetime */
+    int attach(sd_bus *bus, sd_bus_slot **slot, const char *path) {
+        return sd_bus_add_object_vtable(bus, slot, path, "org.nicolas.ReplyCache", vtable, this);
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        sd_bus_message *reply;
+    };
+
+    void evict() {
+        Entry& oldest = lru.back();
+        index.erase(oldest.key);
+        sd_bus_message_unref(oldest.reply);
+        lru.pop_back();
+        evictions++;
+    }
+
+    static int get_counter(sd_bus *bus, const char *path, const char *interface, const char *property,
+                           sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+        ReplyCache *cache = static_cast<ReplyCache*>(userdata);
+        uint64_t value;
+
+        if(strcmp(property, "Hits") == 0)
+            value = cache->hits;
+        else if(strcmp(property, "Misses") == 0)
+            value = cache->misses;
+        else if(strcmp(property, "Evictions") == 0)
+            value = cache->evictions;
+        else if(strcmp(property, "Entries") == 0)
+            value = cache->lru.size();
+        else
+            value = cache->maxEntries;
+
+        return sd_bus_message_append_basic(reply, 't', &value);
+    }
+
+    static inline const sd_bus_vtable vtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_PROPERTY("Hits", "t", get_counter, 0, 0),
+        SD_BUS_PROPERTY("Misses", "t", get_counter, 0, 0),
+        SD_BUS_PROPERTY("Evictions", "t", get_counter, 0, 0),
+        SD_BUS_PROPERTY("Entries", "t", get_counter, 0, 0),
+        SD_BUS_PROPERTY("Capacity", "t", get_counter, 0, 0),
+        SD_BUS_VTABLE_END
+    };
+
+    size_t maxEntries;
+    size_t maxKeyBytes;
+    std::list<Entry> lru;   /* most recently used first */
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+};
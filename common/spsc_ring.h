@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstddef>
+
+/*
+ * Fixed size single producer / single consumer ring buffer.
+ * Each side owns one index and only reads the other one, so pushing or popping is a couple of
+ * loads and one release store, no lock and no syscall. The producer never blocks: when the ring
+ * is full try_push() fails and it is up to the caller to count or drop the item.
+ *
+ * Capacity must be a power of two, indexes run freely and are masked on access.
+ */
+template<typename T, size_t Capacity>
+class SpscRing {
+    static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    bool try_push(const T& item) {
+        size_t tail = writeIndex.load(std::memory_order_relaxed);
+        if(tail - cachedReadIndex == Capacity) {
+            cachedReadIndex = readIndex.load(std::memory_order_acquire);
+            if(tail - cachedReadIndex == Capacity)
+                return false;
+        }
+        items[tail & (Capacity - 1)] = item;
+        writeIndex.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T& item) {
+        size_t head = readIndex.load(std::memory_order_relaxed);
+        if(head == cachedWriteIndex) {
+            cachedWriteIndex = writeIndex.load(std::memory_order_acquire);
+            if(head == cachedWriteIndex)
+                return false;
+        }
+        item = items[head & (Capacity - 1)];
+        readIndex.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    /* producer and consumer indexes on their own cache lines, so they do not bounce between cores */
+    alignas(64) std::atomic<size_t> writeIndex = 0;
+    size_t cachedReadIndex = 0;
+    alignas(64) std::atomic<size_t> readIndex = 0;
+    size_t cachedWriteIndex = 0;
+    alignas(64) std::array<T, Capacity> items;
+};
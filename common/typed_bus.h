@@ -0,0 +1,455 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+#include <systemd/sd-bus.h>
+
+#include "reply_cache.h"
+
+/*
+ * Typed layer over sd-bus, the D-Bus signature is built at compile time from the C++ types
+ * instead of writing "s" or "tx" by hand next to the values.
+ *
+ * sd_bus_message_append(m, "tx", ...) and friends parse the format string and walk the va_list on every call,
+ * and nothing checks that the format matches the vtable or the arguments. Here each type has a Type<T>
+ * specialization knowing its signature and calling sd_bus_message_append_basic/read_basic directly,
+ * the vtable entry is generated from the handler declaration, so both can not disagree,
+ * and an unsupported type is a compile error (incomplete Type<T>).
+ *
+ * Methods: the handler takes a Call<Results...> and the input arguments, e.g.
+ *   static int greating(const typed_bus::Call<std::string>& call, const char *name) { return call.reply(...); }
+ *   typed_bus::method<greating>("Greating", SD_BUS_PARAM(name) SD_BUS_PARAM(response))
+ * The handler can also keep a reference on call.message() and reply later with Call<...>::reply_to().
+ *
+ * A method whose reply only depends on its arguments can be declared with pure_method<greating, cache>(...)
+ * instead, cache being a ReplyCache with static storage (see reply_cache.h): the arguments are serialized
+ * into the cache key and repeated calls get the cached reply without running the handler.
+ * A handler deferring its reply keeps call.cache() and call.cacheKey() and replies with reply_to_cached().
+ * Side effects that must happen on every call, hits included (counters...), do not belong in the handler:
+ * pure_method<greating, cache, on_greating>(...) runs on_greating(name) before the cache lookup.
+ *
+ * Signals: static constexpr typed_bus::Signal<uint64_t, int64_t> heartBeat{"HeartBeat"};
+ *   heartBeat.entry(SD_BUS_PARAM(index) SD_BUS_PARAM(timestamp)) in the vtable, heartBeat.emit(bus, path, interface, ...)
+ *
+ * Supported: bool, uint8_t, int16_t, uint16_t, int32_t, uint32_t, int64_t, uint64_t, double,
+ * const char* and std::string ('s', const char* points into the message when read),
+ * std::string_view (append only), ObjectPath ('o'), UnixFd ('h'), std::vector<T> ('a') and std::tuple<T...> (struct).
+ */
+
+namespace typed_bus {
+
+struct ObjectPath {
+    const char *path;
+};
+
+/* when read, the fd belongs to the message, like with sd_bus_message_read */
+struct UnixFd {
+    int fd;
+};
+
+template<size_t N>
+struct Signature {
+    char text[N + 1];
+
+    constexpr const char *c_str() const { return text; }
+};
+
+template<size_t A, size_t B>
+constexpr Signature<A + B> operator+(const Signature<A>& a, const Signature<B>& b) {
+    Signature<A + B> result{};
+    for(size_t i = 0; i < A; i++)
+        result.text[i] = a.text[i];
+    for(size_t i = 0; i < B; i++)
+        result.text[A + i] = b.text[i];
+    result.text[A + B] = '\0';
+    return result;
+}
+
+template<typename T, typename Enable = void>
+struct Type;
+
+template<typename... T>
+inline constexpr auto signature_v = (Signature<0>{} + ... + Type<std::decay_t<T>>::signature);
+
+/* fixed size basic types, the value is passed by address */
+template<char Code, typename Value>
+struct BasicType {
+    static constexpr Signature<1> signature{{Code, '\0'}};
+    static constexpr char code = Code;
+
+    static int append(sd_bus_message *m, const Value& value) { return sd_bus_message_append_basic(m, Code, &value); }
+    static int read(sd_bus_message *m, Value& value) { return sd_bus_message_read_basic(m, Code, &value); }
+};
+
+template<> struct Type<uint8_t> : BasicType<'y', uint8_t> {};
+template<> struct Type<int16_t> : BasicType<'n', int16_t> {};
+template<> struct Type<uint16_t> : BasicType<'q', uint16_t> {};
+template<> struct Type<int32_t> : BasicType<'i', int32_t> {};
+template<> struct Type<uint32_t> : BasicType<'u', uint32_t> {};
+template<> struct Type<int64_t> : BasicType<'x', int64_t> {};
+template<> struct Type<uint64_t> : BasicType<'t', uint64_t> {};
+template<> struct Type<double> : BasicType<'d', double> {};
+
+/* D-Bus booleans are 32 bits on the wire */
+template<> struct Type<bool> {
+    static constexpr Signature<1> signature{{'b', '\0'}};
+
+    static int append(sd_bus_message *m, bool value) {
+        int b = value;
+        return sd_bus_message_append_basic(m, 'b', &b);
+    }
+    static int read(sd_bus_message *m, bool& value) {
+        int b;
+        int r = sd_bus_message_read_basic(m, 'b', &b);
+        if(r > 0)
+            value = b;
+        return r;
+    }
+};
+
+/* strings are passed by pointer to append_basic, and read_basic gives a pointer into the message */
+template<> struct Type<const char*> {
+    static constexpr Signature<1> signature{{'s', '\0'}};
+
+    static int append(sd_bus_message *m, const char *value) { return sd_bus_message_append_basic(m, 's', value); }
+    static int read(sd_bus_message *m, const char *&value) { return sd_bus_message_read_basic(m, 's', &value); }
+};
+
+template<> struct Type<std::string> {
+    static constexpr Signature<1> signature{{'s', '\0'}};
+
+    static int append(sd_bus_message *m, const std::string& value) { return sd_bus_message_append_basic(m, 's', value.c_str()); }
+    static int read(sd_bus_message *m, std::string& value) {
+        const char *s;
+        int r = sd_bus_message_read_basic(m, 's', &s);
+        if(r > 0)
+            value = s;
+        return r;
+    }
+};
+
+/* not NUL terminated, so the string is copied in place in the message */
+template<> struct Type<std::string_view> {
+    static constexpr Signature<1> signature{{'s', '\0'}};
+
+    static int append(sd_bus_message *m, std::string_view value) {
+        char *space;
+        int r = sd_bus_message_append_string_space(m, value.size(), &space);
+        if(r >= 0)
+            memcpy(space, value.data(), value.size());
+        return r;
+    }
+};
+
+template<> struct Type<ObjectPath> {
+    static constexpr Signature<1> signature{{'o', '\0'}};
+
+    static int append(sd_bus_message *m, const ObjectPath& value) { return sd_bus_message_append_basic(m, 'o', value.path); }
+    static int read(sd_bus_message *m, ObjectPath& value) { return sd_bus_message_read_basic(m, 'o', &value.path); }
+};
+
+template<> struct Type<UnixFd> {
+    static constexpr Signature<1> signature{{'h', '\0'}};
+
+    static int append(sd_bus_message *m, const UnixFd& value) { return sd_bus_message_append_basic(m, 'h', &value.fd); }
+    static int read(sd_bus_message *m, UnixFd& value) { return sd_bus_message_read_basic(m, 'h', &value.fd); }
+};
+
+template<typename T>
+struct Type<std::vector<T>> {
+    static constexpr auto signature = Signature<1>{{'a', '\0'}} + Type<T>::signature;
+
+    /* arrays of fixed size numbers are copied in one go */
+    static constexpr bool trivial = std::is_arithmetic_v<T> && !std::is_same_v<T, bool>;
+
+    static int append(sd_bus_message *m, const std::vector<T>& values) {
+        if constexpr (trivial)
+            return sd_bus_message_append_array(m, Type<T>::code, values.data(), values.size() * sizeof(T));
+
+        int r = sd_bus_message_open_container(m, 'a', Type<T>::signature.c_str());
+        for(size_t i = 0; i < values.size() && r >= 0; i++)
+            r = Type<T>::append(m, values[i]);
+        if(r >= 0)
+            r = sd_bus_message_close_container(m);
+        return r;
+    }
+
+    static int read(sd_bus_message *m, std::vector<T>& values) {
+        values.clear();
+        if constexpr (trivial) {
+            const void *data;
+            size_t size;
+            int r = sd_bus_message_read_array(m, Type<T>::code, &data, &size);
+            if(r > 0)
+                values.assign(static_cast<const T*>(data), static_cast<const T*>(data) + size / sizeof(T));
+            return r;
+        }
+
+        int r = sd_bus_message_enter_container(m, 'a', Type<T>::signature.c_str());
+        if(r <= 0)
+            return r;
+        for(;;) {
+            T value{};
+            r = Type<T>::read(m, value);
+            if(r <= 0)
+                break;
+            values.push_back(std::move(value));
+        }
+        if(r >= 0)
+            r = sd_bus_message_exit_container(m);
+        return r < 0 ? r : 1;
+    }
+};
+
+template<typename... T>
+struct Type<std::tuple<T...>> {
+    static constexpr auto contents = signature_v<T...>;
+    static constexpr auto signature = Signature<1>{{'(', '\0'}} + contents + Signature<1>{{')', '\0'}};
+
+    static int append(sd_bus_message *m, const std::tuple<T...>& value) {
+        int r = sd_bus_message_open_container(m, 'r', contents.c_str());
+        if(r >= 0)
+            r = std::apply([m](const T&... fields) {
+                int r = 0;
+                (void) ((... && ((r = Type<T>::append(m, fields)) >= 0)));
+                return r;
+            }, value);
+        if(r >= 0)
+            r = sd_bus_message_close_container(m);
+        return r;
+    }
+
+    static int read(sd_bus_message *m, std::tuple<T...>& value) {
+        int r = sd_bus_message_enter_container(m, 'r', contents.c_str());
+        if(r <= 0)
+            return r;
+        r = std::apply([m](T&... fields) {
+            int r = 1;
+            (void) ((... && ((r = Type<T>::read(m, fields)) > 0)));
+            return r;
+        }, value);
+        if(r > 0)
+            r = sd_bus_message_exit_container(m);
+        return r < 0 ? r : 1;
+    }
+};
+
+/* like sd_bus_message_append / sd_bus_message_read, returns what the last basic call returned */
+template<typename... T>
+int append(sd_bus_message *m, const T&... values) {
+    int r = 0;
+    (void) ((... && ((r = Type<std::decay_t<T>>::append(m, values)) >= 0)));
+    return r;
+}
+
+template<typename... T>
+int read(sd_bus_message *m, T&... values) {
+    int r = 0;
+    (void) ((... && ((r = Type<std::decay_t<T>>::read(m, values)) > 0)));
+    return r;
+}
+
+/* memoization key of pure_method: the member name, then each argument as its bytes, strings and arrays length first */
+inline void append_key(std::string& key, std::string_view value) {
+    size_t size = value.size();
+    key.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    key.append(value);
+}
+
+inline void append_key(std::string& key, const char *value) { append_key(key, std::string_view(value)); }
+inline void append_key(std::string& key, const std::string& value) { append_key(key, std::string_view(value)); }
+inline void append_key(std::string& key, const ObjectPath& value) { append_key(key, std::string_view(value.path)); }
+
+template<typename T>
+std::enable_if_t<std::is_arithmetic_v<T>> append_key(std::string& key, const T& value) {
+    key.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+void append_key(std::string& key, const std::vector<T>& values) {
+    size_t size = values.size();
+    key.append(reinterpret_cast<const char*>(&size), sizeof(size));
+    for(const T& value : values)
+        append_key(key, value);
+}
+
+template<typename... T>
+void append_key(std::string& key, const std::tuple<T...>& value) {
+    std::apply([&key](const T&... fields) { (append_key(key, fields), ...); }, value);
+}
+
+/* the method call being handled, Results... is the reply signature */
+template<typename... Results>
+class Call {
+public:
+    Call(sd_bus_message *m, void *userdata, sd_bus_error *error, ReplyCache *cache = nullptr, const std::string *key = nullptr)
+        : m(m), data(userdata), err(error), replyCache(cache), key(key) {}
+
+    sd_bus_message *message() const { return m; }
+    void *userdata() const { return data; }
+    sd_bus_error *error() const { return err; }
+
+    /* set for a pure_method, nullptr otherwise */
+    ReplyCache *cache() const { return replyCache; }
+    const std::string& cacheKey() const {
+        static const std::string none;
+        return key ? *key : none;
+    }
+
+    int reply(const Results&... values) const { return reply_to_cached(replyCache, cacheKey(), m, values...); }
+
+    /* for deferred replies, call is the message the handler kept a reference on */
+    static int reply_to(sd_bus_message *call, const Results&... values) {
+        return reply_to_cached(nullptr, {}, call, values...);
+    }
+
+    /* same for a pure_method, the reply is stored in cache when it is not nullptr */
+    static int reply_to_cached(ReplyCache *cache, const std::string& key, sd_bus_message *call, const Results&... values) {
+        sd_bus_message *reply = NULL;
+
+        int r = sd_bus_message_new_method_return(call, &reply);
+        if(r >= 0)
+            r = typed_bus::append<Results...>(reply, values...);
+        if(r >= 0)
+            r = sd_bus_send(NULL, reply, NULL);
+        if(r >= 0 && cache)
+            cache->store(key, reply);
+
+        sd_bus_message_unref(reply);
+        return r;
+    }
+
+private:
+    sd_bus_message *m;
+    void *data;
+    sd_bus_error *err;
+    ReplyCache *replyCache;
+    const std::string *key;
+};
+
+template<typename Handler>
+struct MethodTraits;
+
+template<typename... Results, typename... Args>
+struct MethodTraits<int (*)(const Call<Results...>&, Args...)> {
+    static constexpr auto in = signature_v<Args...>;
+    static constexpr auto out = signature_v<Results...>;
+
+    template<int (*Handler)(const Call<Results...>&, Args...)>
+    static int thunk(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        std::tuple<std::decay_t<Args>...> args;
+
+        int r = std::apply([m](auto&... values) { return typed_bus::read(m, values...); }, args);
+        if(r < 0)
+            return r;
+
+        return std::apply([&](auto&... values) { return Handler(Call<Results...>(m, userdata, ret_error), values...); }, args);
+    }
+
+    template<int (*Handler)(const Call<Results...>&, Args...), ReplyCache& Cache, auto OnCall>
+    static int memoized_thunk(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+        std::tuple<std::decay_t<Args>...> args;
+
+        int r = std::apply([m](auto&... values) { return typed_bus::read(m, values...); }, args);
+        if(r < 0)
+            return r;
+        if constexpr(!std::is_null_pointer_v<decltype(OnCall)>)
+            std::apply([](const auto&... values) { OnCall(values...); }, args);
+        if(!Cache.enabled())
+            return std::apply([&](auto&... values) { return Handler(Call<Results...>(m, userdata, ret_error), values...); }, args);
+
+        std::string key;
+        append_key(key, sd_bus_message_get_member(m));
+        std::apply([&key](const auto&... values) { (append_key(key, values), ...); }, args);
+        if(!Cache.cacheable(key))
+            return std::apply([&](auto&... values) { return Handler(Call<Results...>(m, userdata, ret_error), values...); }, args);
+
+        r = Cache.reply(m, key);
+        if(r != 0)
+            return r;
+
+        return std::apply([&](auto&... values) {
+            return Handler(Call<Results...>(m, userdata, ret_error, &Cache, &key), values...);
+        }, args);
+    }
+};
+
+/* vtable entry for Handler, names are the SD_BUS_PARAM() of the arguments followed by the results */
+template<auto Handler>
+constexpr sd_bus_vtable method(const char *member, const char *names, uint64_t flags = SD_BUS_VTABLE_UNPRIVILEGED) {
+    using Traits = MethodTraits<decltype(Handler)>;
+
+    return {
+        .type = _SD_BUS_VTABLE_METHOD,
+        .flags = flags,
+        .x = { .method = {
+            .member = member,
+            .signature = Traits::in.c_str(),
+            .result = Traits::out.c_str(),
+            .handler = Traits::template thunk<Handler>,
+            .offset = 0,
+            .names = names,
+        }, },
+    };
+}
+
+/* method() for a handler whose reply only depends on its arguments, replies are memoized in Cache,
+ * OnCall(args...) if given runs for every call, cached or not */
+template<auto Handler, ReplyCache& Cache, auto OnCall = nullptr>
+constexpr sd_bus_vtable pure_method(const char *member, const char *names, uint64_t flags = SD_BUS_VTABLE_UNPRIVILEGED) {
+    using Traits = MethodTraits<decltype(Handler)>;
+
+    return {
+        .type = _SD_BUS_VTABLE_METHOD,
+        .flags = flags,
+        .x = { .method = {
+            .member = member,
+            .signature = Traits::in.c_str(),
+            .result = Traits::out.c_str(),
+            .handler = Traits::template memoized_thunk<Handler, Cache, OnCall>,
+            .offset = 0,
+            .names = names,
+        }, },
+    };
+}
+
+template<typename... T>
+struct Signal {
+    const char *member;
+
+    constexpr sd_bus_vtable entry(const char *names, uint64_t flags = 0) const {
+        return {
+            .type = _SD_BUS_VTABLE_SIGNAL,
+            .flags = flags,
+            .x = { .signal = {
+                .member = member,
+                .signature = signature_v<T...>.c_str(),
+                .names = names,
+            }, },
+        };
+    }
+
+    int emit(sd_bus *bus, const char *path, const char *interface, const T&... values) const {
+        sd_bus_message *m = NULL;
+
+        int r = sd_bus_message_new_signal(bus, &m, path, interface, member);
+        if(r >= 0)
+            r = typed_bus::append<T...>(m, values...);
+        if(r >= 0)
+            r = sd_bus_send(bus, m, NULL);
+
+        sd_bus_message_unref(m);
+        return r;
+    }
+
+    static int read(sd_bus_message *m, T&... values) { return typed_bus::read<T...>(m, values...); }
+};
+
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cerrno>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * Listening unix stream socket at path, nonblocking and close on exec, returns the fd or -errno.
+ * A socket file left over from a previous run refuses connections (ECONNREFUSED) and is replaced,
+ * one that accepts belongs to a live process and we fail with -EADDRINUSE instead of taking its path over.
+ * The path is only ours to unlink once this returned an fd, on failure nothing is left behind.
+ */
+inline int listen_unix(const char *path) {
+    struct sockaddr_un address = {};
+
+    if(strlen(path) >= sizeof(address.sun_path))
+        return -ENAMETOOLONG;
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(probe < 0)
+        return -errno;
+    bool live = connect(probe, (struct sockaddr*) &address, sizeof(address)) == 0;
+    bool stale = !live && errno == ECONNREFUSED;
+    close(probe);
+    if(live)
+        return -EADDRINUSE;
+    if(stale)
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if(fd < 0)
+        return -errno;
+
+    if(bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+        int r = -errno;
+        close(fd);
+        return r;
+    }
+    if(listen(fd, SOMAXCONN) < 0) {
+        int r = -errno;
+        close(fd);
+        unlink(path);
+        return r;
+    }
+
+    return fd;
+}
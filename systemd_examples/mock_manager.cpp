@@ -0,0 +1,313 @@
+#include "mock_manager.h"
+
+#include <iostream>
+#include <cstring>
+#include <fnmatch.h>
+
+static const char managerPath[] = "/org/freedesktop/systemd1";
+static const char managerInterface[] = "org.freedesktop.systemd1.Manager";
+static const char unitPrefix[] = "/org/freedesktop/systemd1/unit";
+static const char unitInterface[] = "org.freedesktop.systemd1.Unit";
+
+const sd_bus_vtable MockManager::managerVtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_METHOD_WITH_ARGS("StartUnit",
+            SD_BUS_ARGS("s", name, "s", mode),
+            SD_BUS_RESULT("o", job),
+            method_start_unit,
+            SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD_WITH_ARGS("StopUnit",
+            SD_BUS_ARGS("s", name, "s", mode),
+            SD_BUS_RESULT("o", job),
+            method_stop_unit,
+            SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("Subscribe", "", "", method_subscribe, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD("Unsubscribe", "", "", method_subscribe, SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD_WITH_ARGS("ListUnits",
+            SD_BUS_NO_ARGS,
+            SD_BUS_RESULT("a(ssssssouso)", units),
+            method_list_units,
+            SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_METHOD_WITH_ARGS("ListUnitsByPatterns",
+            SD_BUS_ARGS("as", states, "as", patterns),
+            SD_BUS_RESULT("a(ssssssouso)", units),
+            method_list_units_by_patterns,
+            SD_BUS_VTABLE_UNPRIVILEGED),
+        SD_BUS_SIGNAL_WITH_ARGS("JobNew",
+            SD_BUS_ARGS("u", id, "o", job, "s", unit),
+            0),
+        SD_BUS_SIGNAL_WITH_ARGS("JobRemoved",
+            SD_BUS_ARGS("u", id, "o", job, "s", unit, "s", result),
+            0),
+        SD_BUS_SIGNAL_WITH_ARGS("UnitNew",
+            SD_BUS_ARGS("s", id, "o", unit),
+            0),
+        SD_BUS_SIGNAL_WITH_ARGS("UnitRemoved",
+            SD_BUS_ARGS("s", id, "o", unit),
+            0),
+        SD_BUS_VTABLE_END
+};
+
+const sd_bus_vtable MockManager::unitVtable[] = {
+        SD_BUS_VTABLE_START(0),
+        SD_BUS_PROPERTY("Id", "s", property_get, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("Description", "s", property_get, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("LoadState", "s", property_get, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+        SD_BUS_PROPERTY("ActiveState", "s", property_get, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+        SD_BUS_PROPERTY("SubState", "s", property_get, 0, SD_BUS_VTABLE_PROPERTY_EMITS_CHANGE),
+        SD_BUS_VTABLE_END
+};
+
+std::string bus_label_escape(const std::string& label) {
+    static const char hex[] = "0123456789abcdef";
+    std::string escaped;
+
+    if(label.empty())
+        return "_";
+
+    for(size_t i = 0; i < label.size(); i++) {
+        char c = label[i];
+        bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+        bool digit = c >= '0' && c <= '9';
+        if(alpha || (digit && i > 0))
+            escaped += c;
+        else {
+            escaped += '_';
+            escaped += hex[(unsigned char) c >> 4];
+            escaped += hex[(unsigned char) c & 15];
+        }
+    }
+
+    return escaped;
+}
+
+MockManager::~MockManager() {
+    sd_bus_slot_unref(slot);
+    sd_bus_slot_unref(unitSlot);
+}
+
+int MockManager::attach(sd_bus *b, sd_event *e, const Options& o) {
+    bus = b;
+    event = e;
+    options = o;
+
+    int r = sd_bus_add_object_vtable(bus, &slot, managerPath, managerInterface, managerVtable, this);
+    if(r >= 0)
+        r = sd_bus_add_fallback_vtable(bus, &unitSlot, unitPrefix, unitInterface, unitVtable, find_unit, this);
+    return r;
+}
+
+MockManager::Unit& MockManager::unit(const std::string& name) {
+    auto it = units.find(name);
+    if(it == units.end()) {
+        it = units.emplace(name, Unit()).first;
+        Unit& u = it->second;
+        u.name = name;
+        u.description = "Mock unit " + name;
+        u.path = std::string(unitPrefix) + "/" + bus_label_escape(name);
+        unitsByPath[u.path] = &u;
+
+        if(bus) {
+            int r = sd_bus_emit_signal(bus, managerPath, managerInterface, "UnitNew", "so", name.c_str(), u.path.c_str());
+            if(r < 0)
+                std::cerr << "Failed to emit UnitNew: " << strerror(-r) << std::endl;
+        }
+    }
+    return it->second;
+}
+
+void MockManager::setState(Unit& u, const char *activeState, const char *subState) {
+    u.activeState = activeState;
+    u.subState = subState;
+
+    int r = sd_bus_emit_properties_changed(bus, u.path.c_str(), unitInterface, "ActiveState", "SubState", NULL);
+    if(r < 0)
+        std::cerr << "Failed to emit PropertiesChanged: " << strerror(-r) << std::endl;
+}
+
+void MockManager::removeUnit(const std::string& name) {
+    auto it = units.find(name);
+    if(it == units.end() || it->second.jobId != 0)
+        return;
+
+    int r = sd_bus_emit_signal(bus, managerPath, managerInterface, "UnitRemoved", "so", name.c_str(), it->second.path.c_str());
+    if(r < 0)
+        std::cerr << "Failed to emit UnitRemoved: " << strerror(-r) << std::endl;
+
+    unitsByPath.erase(it->second.path);
+    units.erase(it);
+}
+
+int MockManager::find_unit(sd_bus *bus, const char *path, const char *interface, void *userdata, void **ret_found, sd_bus_error *ret_error) {
+    MockManager *manager = static_cast<MockManager*>(userdata);
+
+    auto it = manager->unitsByPath.find(path);
+    if(it == manager->unitsByPath.end())
+        return 0;
+
+    *ret_found = it->second;
+    return 1;
+}
+
+int MockManager::property_get(sd_bus *bus, const char *path, const char *interface, const char *property,
+                              sd_bus_message *reply, void *userdata, sd_bus_error *ret_error) {
+    const Unit *u = static_cast<const Unit*>(userdata);
+    const char *value = "loaded";
+
+    if(strcmp(property, "Id") == 0)
+        value = u->name.c_str();
+    else if(strcmp(property, "Description") == 0)
+        value = u->description.c_str();
+    else if(strcmp(property, "ActiveState") == 0)
+        value = u->activeState.c_str();
+    else if(strcmp(property, "SubState") == 0)
+        value = u->subState.c_str();
+
+    return sd_bus_message_append(reply, "s", value);
+}
+
+void MockManager::addUnit(const std::string& name, const std::string& description, bool active) {
+    Unit& u = unit(name);
+    u.description = description;
+    u.activeState = active ? "active" : "inactive";
+    u.subState = active ? "running" : "dead";
+}
+
+int MockManager::enqueueJob(sd_bus_message *m, bool start, sd_bus_error *ret_error) {
+    const char *name, *mode;
+
+    int r = sd_bus_message_read(m, "ss", &name, &mode);
+    if(r < 0)
+        return r;
+
+    if(!strchr(name, '.'))
+        return sd_bus_error_setf(ret_error, "org.freedesktop.systemd1.NoSuchUnit", "Unit %s not found.", name);
+
+    Unit& u = unit(name);
+    Job *job = new Job{this, nextJobId++, {}, name, start};
+    job->path = std::string(managerPath) + "/job/" + std::to_string(job->id);
+    u.jobId = job->id;
+    u.jobType = start ? "start" : "stop";
+    u.jobPath = job->path;
+
+    /* floating source, owned by the event loop and freed once it fired */
+    r = sd_event_add_time_relative(event, NULL, CLOCK_MONOTONIC, options.jobDelayUsec, 1, on_job_done, job);
+    if(r < 0) {
+        delete job;
+        return r;
+    }
+
+    r = sd_bus_reply_method_return(m, "o", job->path.c_str());
+    if(r >= 0)
+        r = sd_bus_emit_signal(bus, managerPath, managerInterface, "JobNew", "uos", job->id, job->path.c_str(), name);
+    if(r >= 0)
+        setState(u, start ? "activating" : "deactivating", start ? "start" : "stop");
+    return r;
+}
+
+int MockManager::method_start_unit(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    return static_cast<MockManager*>(userdata)->enqueueJob(m, true, ret_error);
+}
+
+int MockManager::method_stop_unit(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    return static_cast<MockManager*>(userdata)->enqueueJob(m, false, ret_error);
+}
+
+/* PID 1 only sends most signals while a client is subscribed, the mock always does */
+int MockManager::method_subscribe(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    return sd_bus_reply_method_return(m, "");
+}
+
+int MockManager::on_job_done(sd_event_source *source, uint64_t usec, void *userdata) {
+    Job *job = static_cast<Job*>(userdata);
+    MockManager *manager = job->manager;
+    Unit& u = manager->unit(job->unit);
+    bool failed = job->start && job->unit.compare(0, 4, "fail") == 0;
+
+    if(u.jobId == job->id) {
+        u.jobId = 0;
+        u.jobType.clear();
+        u.jobPath = "/";
+    }
+    if(failed)
+        manager->setState(u, "failed", "failed");
+    else
+        manager->setState(u, job->start ? "active" : "inactive", job->start ? "running" : "dead");
+
+    int r = sd_bus_emit_signal(manager->bus, managerPath, managerInterface, "JobRemoved", "uoss",
+                               job->id, job->path.c_str(), job->unit.c_str(), failed ? "failed" : "done");
+    if(r < 0)
+        std::cerr << "Failed to emit JobRemoved: " << strerror(-r) << std::endl;
+
+    if(!job->start)
+        manager->removeUnit(job->unit);
+
+    delete job;
+    return 0;
+}
+
+int MockManager::appendUnits(sd_bus_message *reply, char **states, char **patterns) {
+    int r = sd_bus_message_open_container(reply, SD_BUS_TYPE_ARRAY, "(ssssssouso)");
+
+    for(auto it = units.begin(); it != units.end() && r >= 0; ++it) {
+        const Unit& u = it->second;
+        bool match = !patterns || !*patterns;
+        for(char **p = patterns; p && *p && !match; p++)
+            match = fnmatch(*p, u.name.c_str(), FNM_NOESCAPE) == 0;
+        bool stateMatch = !states || !*states;
+        for(char **s = states; s && *s && !stateMatch; s++)
+            stateMatch = u.activeState == *s || u.subState == *s || strcmp(*s, "loaded") == 0;
+        if(!match || !stateMatch)
+            continue;
+
+        r = sd_bus_message_append(reply, "(ssssssouso)",
+                                  u.name.c_str(), u.description.c_str(), "loaded",
+                                  u.activeState.c_str(), u.subState.c_str(), "",
+                                  u.path.c_str(), u.jobId, u.jobType.c_str(), u.jobPath.c_str());
+    }
+
+    if(r >= 0)
+        r = sd_bus_message_close_container(reply);
+    return r;
+}
+
+static void strv_free(char **l) {
+    for(char **s = l; s && *s; s++)
+        free(*s);
+    free(l);
+}
+
+int MockManager::method_list_units(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    MockManager *manager = static_cast<MockManager*>(userdata);
+    sd_bus_message *reply = NULL;
+
+    int r = sd_bus_message_new_method_return(m, &reply);
+    if(r >= 0)
+        r = manager->appendUnits(reply, NULL, NULL);
+    if(r >= 0)
+        r = sd_bus_send(NULL, reply, NULL);
+
+    sd_bus_message_unref(reply);
+    return r;
+}
+
+int MockManager::method_list_units_by_patterns(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    MockManager *manager = static_cast<MockManager*>(userdata);
+    sd_bus_message *reply = NULL;
+    char **states = NULL, **patterns = NULL;
+
+    int r = sd_bus_message_read_strv(m, &states);
+    if(r >= 0)
+        r = sd_bus_message_read_strv(m, &patterns);
+    if(r >= 0)
+        r = sd_bus_message_new_method_return(m, &reply);
+    if(r >= 0)
+        r = manager->appendUnits(reply, states, patterns);
+    if(r >= 0)
+        r = sd_bus_send(NULL, reply, NULL);
+
+    strv_free(states);
+    strv_free(patterns);
+    sd_bus_message_unref(reply);
+    return r;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <cstdint>
+
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+/*
+ * Small stand-in for org.freedesktop.systemd1.Manager, so the examples can be tried (and benchmarked)
+ * against the user bus or a private bus, without root and without touching real services.
+ *
+ * Implements the subset the examples use, with the same signatures as PID 1:
+ * StartUnit(ss) -> o, StopUnit(ss) -> o, Subscribe(), Unsubscribe(),
+ * ListUnits() -> a(ssssssouso), ListUnitsByPatterns(asas) -> a(ssssssouso),
+ * the JobNew(uos) / JobRemoved(uoss) / UnitNew(so) / UnitRemoved(so) signals,
+ * and unit objects with the Id, Description, LoadState, ActiveState and SubState properties of
+ * org.freedesktop.systemd1.Unit, which emit PropertiesChanged when their state changes.
+ *
+ * Any unit name containing a dot can be started or stopped, units are created on first use.
+ * Jobs complete after a configurable delay, with result "done", or "failed" for units whose name starts with "fail".
+ * Like PID 1 garbage collecting inactive units, a unit is removed (UnitRemoved) once its stop job is done.
+ */
+class MockManager {
+public:
+    struct Options {
+        uint64_t jobDelayUsec = 100000;
+    };
+
+    MockManager() = default;
+    MockManager(const MockManager&) = delete;
+    MockManager& operator=(const MockManager&) = delete;
+    ~MockManager();
+
+    /* registers the Manager object on bus, the caller requests org.freedesktop.systemd1 if needed.
+     * Job completion timers run on event, the bus should be attached to it. event can be NULL if no job is started. */
+    int attach(sd_bus *bus, sd_event *event, const Options& options);
+
+    /* add a unit directly, without going through a job, e.g. to build large ListUnits replies */
+    void addUnit(const std::string& name, const std::string& description, bool active);
+
+    size_t unitCount() const { return units.size(); }
+
+private:
+    struct Unit {
+        std::string name;
+        std::string description;
+        std::string activeState = "inactive";
+        std::string subState = "dead";
+        std::string path;
+        uint32_t jobId = 0;
+        std::string jobType;
+        std::string jobPath = "/";
+    };
+
+    struct Job {
+        MockManager *manager;
+        uint32_t id;
+        std::string path;
+        std::string unit;
+        bool start;
+    };
+
+    static int method_start_unit(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int method_stop_unit(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int method_subscribe(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int method_list_units(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int method_list_units_by_patterns(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int on_job_done(sd_event_source *source, uint64_t usec, void *userdata);
+    static int find_unit(sd_bus *bus, const char *path, const char *interface, void *userdata, void **ret_found, sd_bus_error *ret_error);
+    static int property_get(sd_bus *bus, const char *path, const char *interface, const char *property,
+                            sd_bus_message *reply, void *userdata, sd_bus_error *ret_error);
+
+    static const sd_bus_vtable managerVtable[];
+    static const sd_bus_vtable unitVtable[];
+
+    int enqueueJob(sd_bus_message *m, bool start, sd_bus_error *ret_error);
+    int appendUnits(sd_bus_message *reply, char **states, char **patterns);
+    Unit& unit(const std::string& name);
+    void setState(Unit& u, const char *activeState, const char *subState);
+    void removeUnit(const std::string& name);
+
+    sd_bus *bus = NULL;
+    sd_event *event = NULL;
+    sd_bus_slot *slot = NULL;
+    sd_bus_slot *unitSlot = NULL;
+    Options options;
+    std::map<std::string, Unit> units;
+    std::map<std::string, Unit*> unitsByPath;
+    uint32_t nextJobId = 1;
+};
+
+/* same escaping as systemd for unit object paths: cups.service -> cups_2eservice */
+std::string bus_label_escape(const std::string& label);
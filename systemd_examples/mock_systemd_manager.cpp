@@ -0,0 +1,94 @@
+#include <iostream>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <string>
+
+#include <getopt.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include "mock_manager.h"
+
+/*
+ * Owns org.freedesktop.systemd1 on the user bus and serves MockManager (see mock_manager.h),
+ * to try systemd_service_management --user without root and without a real user manager on that bus.
+ * --units N adds N synthetic units, to get large ListUnits replies.
+ */
+
+int main(int argc, char *argv[]) {
+    static const struct option longOptions[] = {
+        {"job-delay-ms", required_argument, NULL, 'j'},
+        {"units",        required_argument, NULL, 'u'},
+        {"help",         no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    MockManager::Options options;
+    MockManager manager;
+    unsigned long units = 0;
+    sd_event *event = NULL;
+    sd_bus *bus = NULL;
+    sigset_t mask;
+    int c, r;
+
+    while((c = getopt_long(argc, argv, "j:u:h", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'j':
+            options.jobDelayUsec = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'u':
+            units = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [--job-delay-ms MS] [--units N]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    r = sd_event_default(&event);
+    if (r < 0) {
+        std::cerr << "Failed to setup event loop: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+    sd_event_add_signal(event, NULL, SIGINT, NULL, NULL);
+    sd_event_add_signal(event, NULL, SIGTERM, NULL, NULL);
+
+    r = sd_bus_open_user(&bus);
+    if (r < 0) {
+        std::cerr << "Failed to connect to user bus: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+
+    for(unsigned long i = 0; i < units; i++)
+        manager.addUnit("mock-" + std::to_string(i) + ".service", "Synthetic unit " + std::to_string(i), i % 2 == 0);
+
+    r = manager.attach(bus, event, options);
+    if (r < 0) {
+        std::cerr << "Failed to add mock manager object: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+
+    r = sd_bus_request_name(bus, "org.freedesktop.systemd1", 0);
+    if (r < 0) {
+        std::cerr << "Failed to acquire service name: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+
+    r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
+    if(r >= 0)
+        r = sd_event_loop(event);
+    if(r < 0)
+        std::cerr << "Failed to run event loop: " << strerror(-r) << std::endl;
+
+finish:
+    sd_bus_flush(bus);
+    sd_bus_unref(bus);
+    sd_event_unref(event);
+
+    return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,233 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iomanip>
+
+#include <getopt.h>
+#include <systemd/sd-bus.h>
+
+#include "bus_coro.h"
+#include "latency_histogram.h"
+
+/*
+ * systemd_service_management --bulk, written with coroutines (bus_coro.h) instead of callbacks:
+ * start (or --stop) every unit of the command line, at most --concurrency jobs in flight (default 32),
+ * and report the result of each unit, the wall time and the job latency percentiles.
+ *
+ * One job is straight-line code: StartUnit, read the job path from the reply, wait for the JobRemoved
+ * carrying that job path, read its result. The JobRemoved match and Subscribe() happen first, in run_all,
+ * so no job can end before we listen. --concurrency workers take the next unit when theirs is done.
+ * The broker caps pending calls per connection (max_replies_per_connection, 128 unless the bus config
+ * says otherwise), calls over it fail with LimitsExceeded.
+ *
+ * mock_systemd_manager --job-delay-ms 50 --units 10000 &
+ * systemd_coro_jobs --user --concurrency 100 $(seq -f unit%g.service 10000)
+ */
+
+static const char *systemdService = "org.freedesktop.systemd1";
+static const char *managerPath = "/org/freedesktop/systemd1";
+static const char *managerInterface = "org.freedesktop.systemd1.Manager";
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    bool user = false;
+    bool stop = false;
+    const char *mode = "replace";
+    unsigned concurrency = 32;
+    std::vector<std::string> units;
+};
+
+struct UnitResult {
+    std::string unit;
+    std::string job;
+    std::string result;     /* job result from JobRemoved, or "call-failed" */
+    std::string error;
+    uint64_t latencyUsec = 0;
+
+    bool ok() const { return result == "done"; }
+};
+
+struct Run {
+    const Options *options;
+    std::vector<UnitResult> results;
+    size_t next = 0;
+    int error = 0;
+};
+
+/* JobRemoved(u id, o job, s unit, s result), keyed on the job path */
+static std::string job_path_of(sd_bus_message *m) {
+    uint32_t id;
+    const char *job = "";
+
+    sd_bus_message_read(m, "uo", &id, &job);
+    return job;
+}
+
+static bus_coro::Task<UnitResult> run_job(bus_coro::Scheduler& scheduler, bus_coro::Match& jobRemoved,
+                                          const Options& options, const std::string& unit) {
+    UnitResult result;
+    Clock::time_point begin = Clock::now();
+
+    result.unit = unit;
+
+    bus_coro::Message reply = co_await scheduler.call(systemdService, managerPath, managerInterface,
+                                                      options.stop ? "StopUnit" : "StartUnit", unit.c_str(), options.mode);
+    typed_bus::ObjectPath job;
+    if(reply.error() >= 0 && reply.read(job) <= 0)
+        result.error = "unexpected reply";
+    if(reply.error() < 0)
+        result.error = reply.errorText();
+    if(!result.error.empty()) {
+        result.result = "call-failed";
+        result.latencyUsec = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - begin).count();
+        co_return result;
+    }
+
+    result.job = job.path;
+    bus_coro::Message removed = co_await jobRemoved.next(result.job);
+
+    uint32_t id;
+    typed_bus::ObjectPath removedJob;
+    const char *removedUnit, *jobResult;
+    if(removed.read(id, removedJob, removedUnit, jobResult) > 0)
+        result.result = jobResult;
+    else
+        result.result = "unexpected-signal";
+    result.latencyUsec = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - begin).count();
+    co_return result;
+}
+
+static bus_coro::Task<void> worker(bus_coro::Scheduler& scheduler, bus_coro::Match& jobRemoved, Run& run) {
+    while(run.next < run.options->units.size()) {
+        size_t index = run.next++;
+        run.results[index] = co_await run_job(scheduler, jobRemoved, *run.options, run.options->units[index]);
+    }
+}
+
+static bus_coro::Task<void> run_all(bus_coro::Scheduler& scheduler, Run& run) {
+    bus_coro::Match jobRemoved(scheduler, systemdService, managerPath, managerInterface, "JobRemoved", job_path_of);
+
+    run.error = co_await jobRemoved.install();
+    if(run.error < 0) {
+        std::cerr << "Failed to add JobRemoved match: " << strerror(-run.error) << std::endl;
+        co_return;
+    }
+
+    bus_coro::Message subscribed = co_await scheduler.call(systemdService, managerPath, managerInterface, "Subscribe");
+    run.error = subscribed.error();
+    if(run.error < 0) {
+        std::cerr << "Failed to subscribe to systemd signals: " << subscribed.errorText() << std::endl;
+        co_return;
+    }
+
+    std::vector<bus_coro::Task<void>> workers;
+    for(unsigned i = 0; i < run.options->concurrency && i < run.options->units.size(); i++)
+        workers.push_back(worker(scheduler, jobRemoved, run));
+    co_await bus_coro::when_all(std::move(workers));
+}
+
+static bool parse_options(int argc, char *argv[], Options& options) {
+    static const struct option longOptions[] = {
+        {"user",        no_argument,       NULL, 'u'},
+        {"stop",        no_argument,       NULL, 's'},
+        {"mode",        required_argument, NULL, 'm'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+
+    while((c = getopt_long(argc, argv, "usm:c:", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'u':
+            options.user = true;
+            break;
+        case 's':
+            options.stop = true;
+            break;
+        case 'm':
+            options.mode = optarg;
+            break;
+        case 'c':
+            options.concurrency = unsigned(strtoul(optarg, NULL, 10));
+            if(options.concurrency == 0)
+                return false;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    options.units.assign(argv + optind, argv + argc);
+    return !options.units.empty();
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    Run run;
+    sd_bus *bus = NULL;
+    LatencyHistogram latency;
+    size_t failed = 0;
+    double elapsed;
+    int r;
+
+    if(!parse_options(argc, argv, options)) {
+        std::cerr << "usage: " << argv[0] << " [--user] [--stop] [--mode MODE] [--concurrency N] UNIT..." << std::endl;
+        return EXIT_FAILURE;
+    }
+    run.options = &options;
+    run.results.resize(options.units.size());
+
+    r = options.user ? sd_bus_open_user(&bus) : sd_bus_open_system(&bus);
+    if(r < 0) {
+        std::cerr << "Failed to connect to " << (options.user ? "user" : "system") << " bus: " << strerror(-r) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    {
+        bus_coro::Scheduler scheduler(bus);
+        Clock::time_point begin = Clock::now();
+
+        scheduler.spawn(run_all(scheduler, run));
+        r = scheduler.run();
+        elapsed = std::chrono::duration<double>(Clock::now() - begin).count();
+    }
+    if(r < 0)
+        std::cerr << "Failed to process bus: " << strerror(-r) << std::endl;
+    if(r >= 0)
+        r = run.error;
+    if(r < 0)
+        goto finish;
+
+    for(const UnitResult& result : run.results) {
+        std::cout << (options.stop ? "stop " : "start ") << result.unit << ": " << result.result;
+        if(!result.error.empty())
+            std::cout << " (" << result.error << ")";
+        if(!result.job.empty())
+            std::cout << " job " << result.job;
+        std::cout << " in " << result.latencyUsec / 1000.0 << " ms" << std::endl;
+
+        latency.record(result.latencyUsec * 1000);
+        if(!result.ok())
+            failed++;
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << (options.stop ? "stop " : "start ") << options.units.size() << " units, " << failed << " failed, concurrency "
+              << options.concurrency << ", wall time " << std::setprecision(3) << elapsed << " s" << std::endl;
+    std::cout << std::setprecision(1);
+    std::cout << "job latency (ms): p50=" << latency.percentile(50) / 1e6
+              << " p90=" << latency.percentile(90) / 1e6
+              << " p99=" << latency.percentile(99) / 1e6
+              << " max=" << latency.max() / 1e6 << std::endl;
+    if(failed > 0)
+        r = -EIO;
+
+finish:
+    sd_bus_flush_close_unref(bus);
+
+    return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
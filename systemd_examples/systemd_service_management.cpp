@@ -1,9 +1,18 @@
 #include <iostream>
 #include <cstdlib>
 #include <csignal>
-#include <atomic>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <iomanip>
 
+#include <getopt.h>
 #include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include "unit_jobs.h"
+#include "latency_histogram.h"
 
 /* Dbus bus can be monitored and the api(s) are also discoverable.
  * For this example, we want to be able to start and stop service using systemd dbus api.
@@ -122,95 +131,330 @@ o "/org/freedesktop/systemd1/job/3607"
  * 
  * I used the command "systemctl is-active cups" to see if this program start and stop cups service
  * 
+ * The first version waited for the signal with a usleep(1) loop, which keeps a core busy for nothing,
+ * and printed the job path as if the service was started, while the job was only enqueued.
+ * Now everything runs in an sd_event loop: SIGINT and SIGTERM are blocked and delivered through a signalfd
+ * (sd_event_add_signal), so the process sleeps in epoll without using any cpu until something happens.
+ * Following the documentation above, we match JobRemoved and call Subscribe() before StartUnit/StopUnit,
+ * then wait for the JobRemoved carrying our job path, and print its result and how long the job took (unit_jobs.h).
+ *
+ * The unit can be given on the command line (default cups.service). With --user, this talks to the
+ * user bus instead of the system bus, which is handy with mock_systemd_manager to try it without root:
+ * mock_systemd_manager --job-delay-ms 50 &
+ * systemd_service_management --user example.service
+ *
+ * For starting or stopping many units at once, --bulk start|stop takes a list of units and does not wait
+ * for a signal: all the StartUnit/StopUnit calls are issued async, at most --concurrency jobs in flight
+ * (default 32), and we report the result of each unit, the total wall time and job latency percentiles.
+ * systemd_service_management --user --bulk start --concurrency 64 $(seq -f unit%g.service 500)
+ * Exits with failure if any unit did not end with "done".
+ * 
  * */
 
-std::atomic_bool stop_process = false;
 
-void sighandler(int signum) {
-    stop_process = true;
+enum class BulkOperation { None, Start, Stop };
+
+struct Options {
+    bool user = false;
+    const char *mode = "replace";
+    const char *unit = "cups.service";
+    BulkOperation bulk = BulkOperation::None;
+    unsigned concurrency = 32;
+    std::vector<std::string> units;
+};
+
+struct ServiceManager {
+    sd_event *event;
+    JobTracker jobs;
+    const Options *options;
+    bool started = false;
+    bool stopping = false;
+};
+
+static void print_result(const JobResult& result) {
+    std::cout << (result.start ? "start " : "stop ") << result.unit << ": " << result.result;
+    if(!result.error.empty())
+        std::cout << " (" << result.error << ")";
+    if(!result.job.empty())
+        std::cout << " job " << result.job;
+    std::cout << " in " << result.latencyUsec / 1000.0 << " ms" << std::endl;
+}
+
+static void on_stopped(ServiceManager *manager, const JobResult& result) {
+    print_result(result);
+    sd_event_exit(manager->event, result.ok() ? 0 : -EIO);
+}
+
+static int stop_unit(ServiceManager *manager) {
+    manager->stopping = true;
+
+    int r = manager->jobs.submit(false, manager->options->unit, manager->options->mode,
+                                 [manager](const JobResult& result) { on_stopped(manager, result); });
+    if(r < 0) {
+        std::cerr << "Failed to issue method call to stop " << manager->options->unit << ": " << strerror(-r) << std::endl;
+        sd_event_exit(manager->event, r);
+    }
+    return r;
+}
+
+static void on_started(ServiceManager *manager, const JobResult& result) {
+    print_result(result);
+    manager->started = result.ok();
+
+    /* nothing to stop if the start failed, unless we were already asked to stop and the start job got canceled */
+    if(!manager->started && !manager->stopping)
+        sd_event_exit(manager->event, -EIO);
+}
+
+static int on_signal(sd_event_source *source, const struct signalfd_siginfo *si, void *userdata) {
+    ServiceManager *manager = static_cast<ServiceManager*>(userdata);
+
+    /* a second signal while stopping means do not wait any longer */
+    if(manager->stopping) {
+        sd_event_exit(manager->event, -EINTR);
+        return 0;
+    }
+
+    std::cout << "got " << strsignal(si->ssi_signo) << ", stopping " << manager->options->unit << std::endl;
+    stop_unit(manager);
+    return 0;
+}
+
+/* bulk mode: keep up to concurrency jobs in flight, the next unit is submitted when a job completes */
+struct BulkRun {
+    sd_event *event;
+    JobTracker *jobs;
+    const Options *options;
+    std::vector<JobResult> results;
+    size_t next = 0;
+    size_t done = 0;
+    bool interrupted = false;
+    std::chrono::steady_clock::time_point begin;
+};
+
+static void bulk_submit_next(BulkRun *run);
+
+static void bulk_finish(BulkRun *run) {
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - run->begin).count();
+    LatencyHistogram latency;
+    size_t failed = 0;
+
+    for(const JobResult& result : run->results) {
+        if(result.unit.empty())
+            continue;
+        print_result(result);
+        latency.record(result.latencyUsec * 1000);
+        if(!result.ok())
+            failed++;
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << (run->options->bulk == BulkOperation::Start ? "start" : "stop") << " " << run->done << "/"
+              << run->options->units.size() << " units, " << failed << " failed, concurrency "
+              << run->options->concurrency << ", wall time " << std::setprecision(3) << elapsed << " s" << std::endl;
+    std::cout << std::setprecision(1);
+    std::cout << "job latency (ms): p50=" << latency.percentile(50) / 1e6
+              << " p90=" << latency.percentile(90) / 1e6
+              << " p99=" << latency.percentile(99) / 1e6
+              << " max=" << latency.max() / 1e6 << std::endl;
+
+    sd_event_exit(run->event, failed > 0 || run->interrupted ? -EIO : 0);
+}
+
+static void bulk_on_result(BulkRun *run, size_t index, const JobResult& result) {
+    run->results[index] = result;
+    run->done++;
+
+    bulk_submit_next(run);
+    if(run->jobs->pending() == 0)
+        bulk_finish(run);
+}
+
+static void bulk_submit_next(BulkRun *run) {
+    const Options *options = run->options;
+
+    while(!run->interrupted && run->next < options->units.size() && run->jobs->pending() < options->concurrency) {
+        size_t index = run->next++;
+        int r = run->jobs->submit(options->bulk == BulkOperation::Start, options->units[index], options->mode,
+                                  [run, index](const JobResult& result) { bulk_on_result(run, index, result); });
+        if(r < 0) {
+            /* recorded as a failed unit, the others keep going */
+            JobResult& result = run->results[index];
+            result.unit = options->units[index];
+            result.start = options->bulk == BulkOperation::Start;
+            result.result = "send-failed";
+            result.error = strerror(-r);
+            result.latencyUsec = 0;
+            run->done++;
+        }
+    }
+}
+
+static int bulk_on_signal(sd_event_source *source, const struct signalfd_siginfo *si, void *userdata) {
+    BulkRun *run = static_cast<BulkRun*>(userdata);
+
+    /* first signal: no new jobs, wait for the ones in flight. second one: leave now */
+    if(run->interrupted) {
+        sd_event_exit(run->event, -EINTR);
+        return 0;
+    }
+
+    std::cout << "got " << strsignal(si->ssi_signo) << ", waiting for " << run->jobs->pending() << " jobs in flight" << std::endl;
+    run->interrupted = true;
+    if(run->jobs->pending() == 0)
+        bulk_finish(run);
+    return 0;
+}
+
+static int run_bulk(sd_event *event, JobTracker *jobs, const Options& options) {
+    BulkRun run{event, jobs, &options};
+    int r;
+
+    run.results.resize(options.units.size());
+
+    r = sd_event_add_signal(event, NULL, SIGINT, bulk_on_signal, &run);
+    if(r >= 0)
+        r = sd_event_add_signal(event, NULL, SIGTERM, bulk_on_signal, &run);
+    if(r < 0) {
+        std::cerr << "Failed to add signal handlers: " << strerror(-r) << std::endl;
+        return r;
+    }
+
+    run.begin = std::chrono::steady_clock::now();
+    bulk_submit_next(&run);
+    if(jobs->pending() == 0) {
+        bulk_finish(&run);
+        return -EIO;
+    }
+
+    return sd_event_loop(event);
 }
 
+static bool parse_options(int argc, char *argv[], Options& options) {
+    static const struct option longOptions[] = {
+        {"user", no_argument,       NULL, 'u'},
+        {"mode", required_argument, NULL, 'm'},
+        {"bulk", required_argument, NULL, 'b'},
+        {"concurrency", required_argument, NULL, 'c'},
+        {"help", no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+
+    while((c = getopt_long(argc, argv, "um:b:c:h", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'u':
+            options.user = true;
+            break;
+        case 'm':
+            options.mode = optarg;
+            break;
+        case 'b':
+            if(std::string(optarg) == "start")
+                options.bulk = BulkOperation::Start;
+            else if(std::string(optarg) == "stop")
+                options.bulk = BulkOperation::Stop;
+            else
+                return false;
+            break;
+        case 'c':
+            options.concurrency = unsigned(strtoul(optarg, NULL, 10));
+            if(options.concurrency == 0)
+                return false;
+            break;
+        default:
+            return false;
+        }
+    }
 
-int main() {
-    sd_bus_error error = SD_BUS_ERROR_NULL;
-    sd_bus_message *m = NULL;
+    if(options.bulk != BulkOperation::None) {
+        options.units.assign(argv + optind, argv + argc);
+        return !options.units.empty();
+    }
+
+    if(optind < argc)
+        options.unit = argv[optind++];
+
+    return optind == argc;
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    ServiceManager manager;
+    sd_event *event = NULL;
     sd_bus *bus = NULL;
-    const char *response;
+    sigset_t mask;
     int r;
-    
-    signal(SIGINT, sighandler);
-    signal(SIGTERM, sighandler);
 
-    /* Connect to the system bus */
-    r = sd_bus_open_system(&bus);
+    if(!parse_options(argc, argv, options)) {
+        std::cerr << "usage: " << argv[0] << " [--user] [--mode MODE] [UNIT]\n"
+                  << "       " << argv[0] << " [--user] [--mode MODE] --bulk start|stop [--concurrency N] UNIT..." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    /* signals are blocked and read from a signalfd by the event loop */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    r = sd_event_default(&event);
     if (r < 0) {
-        std::cerr << "Failed to connect to user bus: " << strerror(-r) << std::endl;
+        std::cerr << "Failed to setup event loop: " << strerror(-r) << std::endl;
         goto finish;
     }
+    manager.event = event;
+    manager.options = &options;
 
-    /* Call method to start cups service */
-    r = sd_bus_call_method(bus,
-                            "org.freedesktop.systemd1",           /* service to contact */
-                            "/org/freedesktop/systemd1",          /* object path */
-                            "org.freedesktop.systemd1.Manager",   /* interface name */
-                            "StartUnit",                          /* method name */
-                            &error,                               /* object to return error in */
-                            &m,                                   /* return message on success */
-                            "ss",                                 /* input signature */
-                            "cups.service",                       /* first argument */
-                            "replace");                           /* second argument */
+    /* Connect to the system bus, or the user bus for the user manager (or mock_systemd_manager) */
+    r = options.user ? sd_bus_open_user(&bus) : sd_bus_open_system(&bus);
     if (r < 0) {
-        std::cerr << "Failed to issue method call to start cups service: " << error.message << std::endl;
+        std::cerr << "Failed to connect to " << (options.user ? "user" : "system") << " bus: " << strerror(-r) << std::endl;
         goto finish;
     }
 
-    /* Parse the response message */
-    r = sd_bus_message_read(m, "o", &response);
+    /* JobRemoved match and Subscribe first, so we can not miss the end of our job */
+    r = manager.jobs.attach(bus);
     if (r < 0) {
-        std::cerr << "Failed to parse response message for starting cups service: " << strerror(-r) << std::endl;
+        std::cerr << "Failed to watch systemd jobs: " << strerror(-r) << std::endl;
         goto finish;
     }
-    
-    std::cout << "start cups response: " << response << std::endl;
-    
-    sd_bus_error_free(&error);
-    sd_bus_message_unref(m);
-    error = SD_BUS_ERROR_NULL;
-    m = NULL;
-    
-    while(!stop_process) {
-        usleep(1);
-    }
-    
-    r = sd_bus_call_method(bus,
-                        "org.freedesktop.systemd1",           /* service to contact */
-                        "/org/freedesktop/systemd1",          /* object path */
-                        "org.freedesktop.systemd1.Manager",   /* interface name */
-                        "StopUnit",                           /* method name */
-                        &error,                               /* object to return error in */
-                        &m,                                   /* return message on success */
-                        "ss",                                 /* input signature */
-                        "cups.service",                       /* first argument */
-                        "replace");                           /* second argument */
+
+    r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
     if (r < 0) {
-        std::cerr << "Failed to issue method call to stop cups service: " << error.message << std::endl;
+        std::cerr << "Failed to attach bus to event loop: " << strerror(-r) << std::endl;
         goto finish;
     }
 
-    /* Parse the response message */
-    r = sd_bus_message_read(m, "o", &response);
+    if(options.bulk != BulkOperation::None) {
+        r = run_bulk(event, &manager.jobs, options);
+        goto finish;
+    }
+
+    r = sd_event_add_signal(event, NULL, SIGINT, on_signal, &manager);
+    if(r >= 0)
+        r = sd_event_add_signal(event, NULL, SIGTERM, on_signal, &manager);
+    if (r < 0) {
+        std::cerr << "Failed to add signal handlers: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+
+    r = manager.jobs.submit(true, options.unit, options.mode,
+                            [&manager](const JobResult& result) { on_started(&manager, result); });
     if (r < 0) {
-        std::cerr << "Failed to parse response message to stop cups service: " << strerror(-r) << std::endl;
+        std::cerr << "Failed to issue method call to start " << options.unit << ": " << strerror(-r) << std::endl;
         goto finish;
     }
-    
-    std::cout << "stop cups response: " << response << std::endl;
+
+    /* sleeps until the start job is done, a signal arrives, and the stop job is done */
+    r = sd_event_loop(event);
+    if (r < 0 && r != -EIO)
+        std::cerr << "Failed to run event loop: " << strerror(-r) << std::endl;
 
 finish:
-    sd_bus_error_free(&error);
-    sd_bus_message_unref(m);
+    sd_bus_flush(bus);
     sd_bus_unref(bus);
+    sd_event_unref(event);
 
     return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
-
@@ -0,0 +1,184 @@
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <csignal>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <getopt.h>
+#include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+
+#include "unit_cache.h"
+
+/*
+ * Keeps a UnitCache (unit_cache.h) up to date and prints unit state changes as they happen,
+ * only for the units given on the command line if any.
+ *
+ * With --lookups N, once the snapshot is loaded we answer "is UNIT active?" N times from the cache,
+ * then N times with a ListUnitsByPatterns round trip to the manager, which is what the agents used to do:
+ * mock_systemd_manager --units 10000 &
+ * systemd_unit_cache --user --lookups 1000 mock-42.service
+ */
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    bool user = false;
+    unsigned long lookups = 0;
+    std::vector<std::string> units;
+};
+
+static bool watched(const Options& options, const std::string& name) {
+    return options.units.empty() || std::find(options.units.begin(), options.units.end(), name) != options.units.end();
+}
+
+static int query_active(sd_bus *bus, const std::string& name, bool *active) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    sd_bus_message *m = NULL, *reply = NULL;
+    const char *activeState;
+
+    int r = sd_bus_message_new_method_call(bus, &m, "org.freedesktop.systemd1", "/org/freedesktop/systemd1",
+                                           "org.freedesktop.systemd1.Manager", "ListUnitsByPatterns");
+    if(r >= 0)
+        r = sd_bus_message_append_strv(m, NULL);
+    if(r >= 0)
+        r = sd_bus_message_append(m, "as", 1, name.c_str());
+    if(r >= 0)
+        r = sd_bus_call(bus, m, 0, &error, &reply);
+    if(r >= 0)
+        r = sd_bus_message_enter_container(reply, SD_BUS_TYPE_ARRAY, "(ssssssouso)");
+    if(r >= 0) {
+        *active = false;
+        r = sd_bus_message_read(reply, "(ssssssouso)", NULL, NULL, NULL, &activeState, NULL, NULL, NULL, NULL, NULL, NULL);
+        if(r > 0)
+            *active = strcmp(activeState, "active") == 0;
+    }
+
+    sd_bus_error_free(&error);
+    sd_bus_message_unref(m);
+    sd_bus_message_unref(reply);
+    return r;
+}
+
+static void compare_lookups(sd_bus *bus, const UnitCache& cache, const Options& options) {
+    std::string name = options.units.empty() ? std::string("cups.service") : options.units[0];
+    unsigned long active = 0;
+    int r = 0;
+
+    Clock::time_point begin = Clock::now();
+    for(unsigned long i = 0; i < options.lookups; i++)
+        active += cache.isActive(name);
+    double cacheNs = std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / options.lookups;
+
+    begin = Clock::now();
+    for(unsigned long i = 0; i < options.lookups && r >= 0; i++) {
+        bool isActive;
+        r = query_active(bus, name, &isActive);
+        active += isActive;
+    }
+    double busNs = std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / options.lookups;
+    if(r < 0) {
+        std::cerr << "Failed to query " << name << ": " << strerror(-r) << std::endl;
+        return;
+    }
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << name << " is " << (cache.isActive(name) ? "active" : "not active") << ", " << options.lookups
+              << " lookups: cache " << cacheNs << " ns each, ListUnitsByPatterns " << busNs / 1000 << " us each" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option longOptions[] = {
+        {"user",    no_argument,       NULL, 'u'},
+        {"lookups", required_argument, NULL, 'l'},
+        {"help",    no_argument,       NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    Options options;
+    UnitCache cache;
+    Clock::time_point begin;
+    sd_event *event = NULL;
+    sd_bus *bus = NULL;
+    sigset_t mask;
+    int c, r;
+
+    while((c = getopt_long(argc, argv, "ul:h", longOptions, NULL)) >= 0) {
+        switch(c) {
+        case 'u':
+            options.user = true;
+            break;
+        case 'l':
+            options.lookups = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            std::cerr << "usage: " << argv[0] << " [--user] [--lookups N] [UNIT...]" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    options.units.assign(argv + optind, argv + argc);
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    r = sd_event_default(&event);
+    if (r < 0) {
+        std::cerr << "Failed to setup event loop: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+    sd_event_add_signal(event, NULL, SIGINT, NULL, NULL);
+    sd_event_add_signal(event, NULL, SIGTERM, NULL, NULL);
+
+    r = options.user ? sd_bus_open_user(&bus) : sd_bus_open_system(&bus);
+    if (r < 0) {
+        std::cerr << "Failed to connect to " << (options.user ? "user" : "system") << " bus: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+
+    begin = Clock::now();
+    r = cache.attach(bus,
+        [&](int error) {
+            if(error < 0) {
+                sd_event_exit(event, error);
+                return;
+            }
+            std::cout << "loaded " << cache.size() << " units in "
+                      << std::chrono::duration<double, std::milli>(Clock::now() - begin).count() << " ms" << std::endl;
+            for(const std::string& name : options.units) {
+                const UnitState *unit = cache.find(name);
+                std::cout << name << ": " << (unit ? unit->activeState + " (" + unit->subState + ")" : "not loaded") << std::endl;
+            }
+            if(options.lookups > 0)
+                compare_lookups(bus, cache, options);
+        },
+        [&](const UnitState& unit, UnitCache::Change change) {
+            if(!watched(options, unit.name))
+                return;
+            if(change == UnitCache::Change::Removed)
+                std::cout << unit.name << ": removed" << std::endl;
+            else
+                std::cout << unit.name << ": " << unit.activeState << " (" << unit.subState << ")"
+                          << (change == UnitCache::Change::Added ? " new" : "") << std::endl;
+        });
+    if (r < 0) {
+        std::cerr << "Failed to watch units: " << strerror(-r) << std::endl;
+        goto finish;
+    }
+
+    r = sd_bus_attach_event(bus, event, SD_EVENT_PRIORITY_NORMAL);
+    if(r >= 0)
+        r = sd_event_loop(event);
+    if(r < 0)
+        std::cerr << "Failed to run event loop: " << strerror(-r) << std::endl;
+
+finish:
+    sd_bus_unref(bus);
+    sd_event_unref(event);
+
+    return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
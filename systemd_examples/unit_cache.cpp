@@ -0,0 +1,253 @@
+#include "unit_cache.h"
+#include "unit_list_reader.h"
+
+#include <iostream>
+#include <cstring>
+
+static const char managerPath[] = "/org/freedesktop/systemd1";
+static const char managerInterface[] = "org.freedesktop.systemd1.Manager";
+static const char unitInterface[] = "org.freedesktop.systemd1.Unit";
+
+UnitCache::~UnitCache() {
+    for(sd_bus_slot *slot : matchSlots)
+        sd_bus_slot_unref(slot);
+    sd_bus_slot_unref(snapshotSlot);
+    for(Refresh *refresh : refreshes) {
+        sd_bus_slot_unref(refresh->slot);
+        delete refresh;
+    }
+}
+
+int UnitCache::attach(sd_bus *b, std::function<void(int error)> ready, Callback changed) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    int r;
+
+    bus = b;
+    readyCallback = std::move(ready);
+    changedCallback = std::move(changed);
+
+    r = sd_bus_match_signal(bus, &matchSlots[0], "org.freedesktop.systemd1", managerPath, managerInterface,
+                            "UnitNew", on_unit_new, this);
+    if(r >= 0)
+        r = sd_bus_match_signal(bus, &matchSlots[1], "org.freedesktop.systemd1", managerPath, managerInterface,
+                                "UnitRemoved", on_unit_removed, this);
+    /* only the Unit interface of unit objects, not the Service/Socket/... ones which change a lot more */
+    if(r >= 0)
+        r = sd_bus_add_match(bus, &matchSlots[2],
+                             "type='signal',"
+                             "sender='org.freedesktop.systemd1',"
+                             "interface='org.freedesktop.DBus.Properties',"
+                             "member='PropertiesChanged',"
+                             "path_namespace='/org/freedesktop/systemd1/unit',"
+                             "arg0='org.freedesktop.systemd1.Unit'",
+                             on_properties_changed, this);
+    if(r < 0)
+        return r;
+
+    r = sd_bus_call_method(bus, "org.freedesktop.systemd1", managerPath, managerInterface, "Subscribe", &error, NULL, "");
+    if(r < 0) {
+        std::cerr << "Failed to subscribe to systemd signals: " << error.message << std::endl;
+        sd_bus_error_free(&error);
+        return r;
+    }
+
+    return sd_bus_call_method_async(bus, &snapshotSlot, "org.freedesktop.systemd1", managerPath, managerInterface,
+                                    "ListUnits", on_snapshot, this, "");
+}
+
+const UnitState *UnitCache::find(const std::string& name) const {
+    auto it = byName.find(name);
+    return it != byName.end() ? &it->second : nullptr;
+}
+
+const UnitState *UnitCache::findByPath(const std::string& path) const {
+    auto it = byPath.find(path);
+    return it != byPath.end() ? it->second : nullptr;
+}
+
+bool UnitCache::isActive(const std::string& name) const {
+    const UnitState *unit = find(name);
+    return unit && unit->activeState == "active";
+}
+
+UnitState& UnitCache::add(const std::string& name, const std::string& path) {
+    UnitState& unit = byName[name];
+    unit.name = name;
+    unit.path = path;
+    byPath[path] = &unit;
+    return unit;
+}
+
+int UnitCache::on_snapshot(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    UnitCache *cache = static_cast<UnitCache*>(userdata);
+    int64_t r;
+
+    cache->snapshotSlot = sd_bus_slot_unref(cache->snapshotSlot);
+
+    if(sd_bus_message_is_method_error(m, NULL)) {
+        std::cerr << "Failed to list units: " << sd_bus_message_get_error(m)->message << std::endl;
+        r = -sd_bus_message_get_errno(m);
+        goto finish;
+    }
+
+    /* strings are copied once, straight from the message into the cache */
+    r = read_unit_list(m, [cache](const UnitListEntry& entry) {
+        UnitState& unit = cache->add(std::string(entry.name), std::string(entry.path));
+        unit.description = entry.description;
+        unit.loadState = entry.loadState;
+        unit.activeState = entry.activeState;
+        unit.subState = entry.subState;
+        return true;
+    });
+    if(r < 0)
+        std::cerr << "Failed to parse unit list: " << strerror(int(-r)) << std::endl;
+
+finish:
+    cache->loaded = r >= 0;
+    if(cache->readyCallback)
+        cache->readyCallback(r < 0 ? int(r) : 0);
+    return 0;
+}
+
+int UnitCache::on_unit_new(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    UnitCache *cache = static_cast<UnitCache*>(userdata);
+    const char *name, *path;
+
+    /* before the snapshot, it will be in the ListUnits reply */
+    if(!cache->loaded || sd_bus_message_read(m, "so", &name, &path) < 0)
+        return 0;
+
+    if(cache->find(name))
+        return 0;
+
+    cache->add(name, path);
+    cache->refresh(path);
+    return 0;
+}
+
+int UnitCache::on_unit_removed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    UnitCache *cache = static_cast<UnitCache*>(userdata);
+    const char *name, *path;
+
+    if(!cache->loaded || sd_bus_message_read(m, "so", &name, &path) < 0)
+        return 0;
+
+    auto it = cache->byName.find(name);
+    if(it == cache->byName.end())
+        return 0;
+
+    UnitState unit = std::move(it->second);
+    cache->byPath.erase(unit.path);
+    cache->byName.erase(it);
+    if(cache->changedCallback)
+        cache->changedCallback(unit, Change::Removed);
+    return 0;
+}
+
+/* reads an a{sv} of Unit properties, returns 1 if some property we keep was invalidated instead of sent */
+int UnitCache::readProperties(sd_bus_message *m, UnitState& unit) {
+    int r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "{sv}");
+    while(r > 0) {
+        const char *property, *value;
+
+        r = sd_bus_message_enter_container(m, SD_BUS_TYPE_DICT_ENTRY, "sv");
+        if(r <= 0)
+            break;
+
+        r = sd_bus_message_read(m, "s", &property);
+        if(r < 0)
+            break;
+
+        std::string *field = nullptr;
+        if(strcmp(property, "ActiveState") == 0)
+            field = &unit.activeState;
+        else if(strcmp(property, "SubState") == 0)
+            field = &unit.subState;
+        else if(strcmp(property, "LoadState") == 0)
+            field = &unit.loadState;
+        else if(strcmp(property, "Description") == 0)
+            field = &unit.description;
+
+        if(field)
+            r = sd_bus_message_read(m, "v", "s", &value);
+        else
+            r = sd_bus_message_skip(m, "v");
+        if(r < 0)
+            break;
+        if(field)
+            *field = value;
+
+        r = sd_bus_message_exit_container(m);
+    }
+    if(r >= 0)
+        r = sd_bus_message_exit_container(m);
+    return r;
+}
+
+int UnitCache::on_properties_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    UnitCache *cache = static_cast<UnitCache*>(userdata);
+    const char *interface, *property;
+    bool invalidated = false;
+
+    auto it = cache->byPath.find(sd_bus_message_get_path(m));
+    if(!cache->loaded || it == cache->byPath.end())
+        return 0;
+    UnitState& unit = *it->second;
+
+    int r = sd_bus_message_read(m, "s", &interface);
+    if(r >= 0)
+        r = cache->readProperties(m, unit);
+    if(r >= 0)
+        r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "s");
+    while(r > 0) {
+        r = sd_bus_message_read(m, "s", &property);
+        if(r > 0 && (strcmp(property, "ActiveState") == 0 || strcmp(property, "SubState") == 0))
+            invalidated = true;
+    }
+    if(r < 0) {
+        std::cerr << "Failed to parse PropertiesChanged: " << strerror(-r) << std::endl;
+        return 0;
+    }
+
+    /* the new value was not sent with the signal, ask for it.
+     * No LoadState yet means the GetAll of a new unit is pending, it will report the unit as added */
+    if(invalidated)
+        cache->refresh(unit.path);
+    else if(cache->changedCallback && !unit.loadState.empty())
+        cache->changedCallback(unit, Change::Updated);
+    return 0;
+}
+
+int UnitCache::refresh(const std::string& path) {
+    Refresh *refresh = new Refresh{this, path};
+
+    int r = sd_bus_call_method_async(bus, &refresh->slot, "org.freedesktop.systemd1", path.c_str(),
+                                     "org.freedesktop.DBus.Properties", "GetAll", on_get_all, refresh, "s", unitInterface);
+    if(r < 0) {
+        std::cerr << "Failed to get properties of " << path << ": " << strerror(-r) << std::endl;
+        delete refresh;
+        return r;
+    }
+
+    refreshes.insert(refresh);
+    return 0;
+}
+
+int UnitCache::on_get_all(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    Refresh *refresh = static_cast<Refresh*>(userdata);
+    UnitCache *cache = refresh->cache;
+
+    /* replies do not carry the object path, and the unit may be gone from the cache since */
+    auto it = cache->byPath.find(refresh->path);
+    cache->refreshes.erase(refresh);
+    sd_bus_slot_unref(refresh->slot);
+    delete refresh;
+    if(sd_bus_message_is_method_error(m, NULL) || it == cache->byPath.end())
+        return 0;
+
+    UnitState& unit = *it->second;
+    bool added = unit.loadState.empty();
+    if(cache->readProperties(m, unit) >= 0 && cache->changedCallback)
+        cache->changedCallback(unit, added ? Change::Added : Change::Updated);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <set>
+#include <functional>
+
+#include <systemd/sd-bus.h>
+
+/*
+ * Local copy of the state of all the units known to systemd, to answer "is X active?" from memory
+ * instead of asking PID 1 with ListUnitsByPatterns or a property Get every time.
+ *
+ * attach() adds the UnitNew, UnitRemoved and PropertiesChanged matches and calls Subscribe() first,
+ * then asks for one ListUnits snapshot asynchronously. Signals and replies are dispatched in the order
+ * they were sent, so whatever was emitted before the snapshot is older than it (and ignored while we have
+ * no snapshot), and whatever comes after is newer and applied on top of it.
+ * A UnitNew only gives us the name and path, the rest comes from an async GetAll on the unit object.
+ *
+ * Units are indexed by name and by object path (PropertiesChanged only carries the path).
+ */
+
+struct UnitState {
+    std::string name;
+    std::string path;
+    std::string description;
+    std::string loadState;
+    std::string activeState;
+    std::string subState;
+};
+
+class UnitCache {
+public:
+    enum class Change { Added, Updated, Removed };
+    using Callback = std::function<void(const UnitState&, Change)>;
+
+    UnitCache() = default;
+    UnitCache(const UnitCache&) = delete;
+    UnitCache& operator=(const UnitCache&) = delete;
+    ~UnitCache();
+
+    /* ready is called once the snapshot is loaded, changed for every change after that */
+    int attach(sd_bus *bus, std::function<void(int error)> ready, Callback changed = nullptr);
+
+    bool ready() const { return loaded; }
+    size_t size() const { return byName.size(); }
+
+    const UnitState *find(const std::string& name) const;
+    const UnitState *findByPath(const std::string& path) const;
+    bool isActive(const std::string& name) const;
+
+    template<typename F> void forEach(F f) const {
+        for(const auto& entry : byName)
+            f(entry.second);
+    }
+
+private:
+    struct Refresh {
+        UnitCache *cache;
+        std::string path;
+        sd_bus_slot *slot = NULL;
+    };
+
+    static int on_snapshot(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int on_unit_new(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int on_unit_removed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int on_properties_changed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int on_get_all(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+
+    int refresh(const std::string& path);
+    int readProperties(sd_bus_message *m, UnitState& unit);
+    UnitState& add(const std::string& name, const std::string& path);
+
+    sd_bus *bus = NULL;
+    sd_bus_slot *matchSlots[3] = {};
+    sd_bus_slot *snapshotSlot = NULL;
+    bool loaded = false;
+    std::function<void(int)> readyCallback;
+    Callback changedCallback;
+    /* elements of an unordered_map never move, so the path index can point into the name index */
+    std::unordered_map<std::string, UnitState> byName;
+    std::unordered_map<std::string, UnitState*> byPath;
+    std::set<Refresh*> refreshes;
+};
@@ -0,0 +1,143 @@
+#include "unit_jobs.h"
+
+#include <iostream>
+#include <cstring>
+
+JobTracker::~JobTracker() {
+    for(Job *job : jobs) {
+        sd_bus_slot_unref(job->slot);
+        delete job;
+    }
+    sd_bus_slot_unref(matchSlot);
+}
+
+int JobTracker::attach(sd_bus *b) {
+    sd_bus_error error = SD_BUS_ERROR_NULL;
+    int r;
+
+    bus = b;
+
+    r = sd_bus_match_signal(bus,
+                            &matchSlot,
+                            "org.freedesktop.systemd1",
+                            "/org/freedesktop/systemd1",
+                            "org.freedesktop.systemd1.Manager",
+                            "JobRemoved",
+                            on_job_removed,
+                            this);
+    if(r < 0)
+        return r;
+
+    /* systemd only emits JobRemoved when at least one client is subscribed */
+    r = sd_bus_call_method(bus,
+                           "org.freedesktop.systemd1",
+                           "/org/freedesktop/systemd1",
+                           "org.freedesktop.systemd1.Manager",
+                           "Subscribe",
+                           &error,
+                           NULL,
+                           "");
+    if(r < 0)
+        std::cerr << "Failed to subscribe to systemd signals: " << error.message << std::endl;
+
+    sd_bus_error_free(&error);
+    return r;
+}
+
+int JobTracker::submit(bool start, const std::string& unit, const char *mode, Callback callback) {
+    Job *job = new Job{this, {}, std::move(callback), Clock::now()};
+    job->result.unit = unit;
+    job->result.start = start;
+
+    int r = sd_bus_call_method_async(bus,
+                                     &job->slot,
+                                     "org.freedesktop.systemd1",
+                                     "/org/freedesktop/systemd1",
+                                     "org.freedesktop.systemd1.Manager",
+                                     start ? "StartUnit" : "StopUnit",
+                                     on_reply,
+                                     job,
+                                     "ss",
+                                     unit.c_str(),
+                                     mode);
+    if(r < 0) {
+        delete job;
+        return r;
+    }
+
+    jobs.insert(job);
+    awaitingReply++;
+    return 0;
+}
+
+void JobTracker::complete(Job *job, const char *result, const char *error) {
+    job->result.result = result;
+    if(error)
+        job->result.error = error;
+    job->result.latencyUsec = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - job->begin).count();
+
+    jobs.erase(job);
+    if(!job->result.job.empty())
+        byPath.erase(job->result.job);
+
+    /* the callback may submit more jobs, so it runs once the job is out of the maps */
+    job->callback(job->result);
+    sd_bus_slot_unref(job->slot);
+    delete job;
+}
+
+int JobTracker::on_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    Job *job = static_cast<Job*>(userdata);
+    JobTracker *tracker = job->tracker;
+    const char *path;
+
+    tracker->awaitingReply--;
+
+    if(sd_bus_message_is_method_error(m, NULL)) {
+        const sd_bus_error *error = sd_bus_message_get_error(m);
+        tracker->complete(job, error->name, error->message);
+        return 0;
+    }
+
+    int r = sd_bus_message_read(m, "o", &path);
+    if(r < 0) {
+        tracker->complete(job, "invalid-reply", strerror(-r));
+        return 0;
+    }
+    job->result.job = path;
+
+    auto it = tracker->early.find(path);
+    if(it != tracker->early.end()) {
+        std::string result = it->second;
+        tracker->early.erase(it);
+        tracker->complete(job, result.c_str(), NULL);
+    }
+    else
+        tracker->byPath.emplace(path, job);
+
+    if(tracker->awaitingReply == 0)
+        tracker->early.clear();
+
+    return 0;
+}
+
+int JobTracker::on_job_removed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error) {
+    JobTracker *tracker = static_cast<JobTracker*>(userdata);
+    const char *path, *unit, *result;
+    uint32_t id;
+
+    int r = sd_bus_message_read(m, "uoss", &id, &path, &unit, &result);
+    if(r < 0) {
+        std::cerr << "Failed to read JobRemoved signal: " << strerror(-r) << std::endl;
+        return 0;
+    }
+
+    /* most JobRemoved are for jobs from other clients, unless we are still waiting for the path */
+    auto it = tracker->byPath.find(path);
+    if(it != tracker->byPath.end())
+        tracker->complete(it->second, result, NULL);
+    else if(tracker->awaitingReply > 0)
+        tracker->early.emplace(path, result);
+
+    return 0;
+}
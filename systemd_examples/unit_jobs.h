@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <set>
+#include <unordered_map>
+#include <functional>
+#include <chrono>
+#include <cstdint>
+
+#include <systemd/sd-bus.h>
+
+/*
+ * Tracks StartUnit/StopUnit jobs until systemd reports their outcome.
+ *
+ * The job object path returned by StartUnit is only "enqueued", the real result comes later in
+ * the JobRemoved(u id, o job, s unit, s result) signal. As the systemd documentation recommends,
+ * attach() adds the JobRemoved match and calls Subscribe() before any job is submitted, so there is no race,
+ * then each JobRemoved is matched against the job path we got in the method reply.
+ *
+ * Everything runs in the bus event loop, no thread, nothing to poll.
+ */
+
+struct JobResult {
+    std::string unit;
+    bool start;
+    std::string job;        /* job object path, empty if the call itself failed */
+    std::string result;     /* "done", "canceled", "timeout", "failed", "dependency", "skipped", or the D-Bus error name */
+    std::string error;      /* error message when the method call failed */
+    uint64_t latencyUsec;   /* from sending the call to receiving JobRemoved (or the error) */
+
+    bool ok() const { return result == "done"; }
+};
+
+class JobTracker {
+public:
+    using Callback = std::function<void(const JobResult&)>;
+
+    JobTracker() = default;
+    JobTracker(const JobTracker&) = delete;
+    JobTracker& operator=(const JobTracker&) = delete;
+    ~JobTracker();
+
+    /* match JobRemoved then Subscribe, this is blocking and must be called before submit() */
+    int attach(sd_bus *bus);
+
+    /* async StartUnit or StopUnit, callback is called once with the outcome */
+    int submit(bool start, const std::string& unit, const char *mode, Callback callback);
+
+    size_t pending() const { return jobs.size(); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Job {
+        JobTracker *tracker;
+        JobResult result;
+        Callback callback;
+        Clock::time_point begin;
+        sd_bus_slot *slot = NULL;
+    };
+
+    static int on_reply(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+    static int on_job_removed(sd_bus_message *m, void *userdata, sd_bus_error *ret_error);
+
+    void complete(Job *job, const char *result, const char *error);
+
+    sd_bus *bus = NULL;
+    sd_bus_slot *matchSlot = NULL;
+    std::set<Job*> jobs;
+    std::unordered_map<std::string, Job*> byPath;
+    /* JobRemoved seen while some replies were still pending, in case it is dispatched first */
+    std::unordered_map<std::string, std::string> early;
+    unsigned awaitingReply = 0;
+};
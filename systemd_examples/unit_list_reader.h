@@ -0,0 +1,83 @@
+#pragma once
+
+#include <string_view>
+#include <cstdint>
+
+#include <systemd/sd-bus.h>
+
+/*
+ * Streaming reader for the a(ssssssouso) returned by ListUnits and ListUnitsByPatterns.
+ *
+ * On a big host that array has tens of thousands of entries, copying all of them in a vector of
+ * std::string before looking at them costs a lot of allocations and memory for nothing.
+ * Here we walk the array one struct at a time and give each entry to a visitor, strings are
+ * string_views pointing into the message buffer, nothing is allocated per entry.
+ * The views are only valid during the visitor call (and while the message is alive), copy what you keep.
+ *
+ * The visitor returns true to continue, false to stop early (the rest of the array is not read).
+ */
+
+struct UnitListEntry {
+    std::string_view name;
+    std::string_view description;
+    std::string_view loadState;
+    std::string_view activeState;
+    std::string_view subState;
+    std::string_view following;
+    std::string_view path;
+    uint32_t jobId;
+    std::string_view jobType;
+    std::string_view jobPath;
+};
+
+/* returns the number of entries visited, or -errno */
+template<typename Visitor>
+int64_t read_unit_list(sd_bus_message *m, Visitor&& visit) {
+    UnitListEntry entry;
+    int64_t count = 0;
+
+    int r = sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "(ssssssouso)");
+    if(r <= 0)
+        return r;
+
+    for(;;) {
+        r = sd_bus_message_enter_container(m, SD_BUS_TYPE_STRUCT, "ssssssouso");
+        if(r <= 0)
+            break;
+
+        const char *s[9];
+        for(int i = 0; i < 6 && r >= 0; i++)
+            r = sd_bus_message_read_basic(m, 's', &s[i]);
+        if(r >= 0)
+            r = sd_bus_message_read_basic(m, 'o', &s[6]);
+        if(r >= 0)
+            r = sd_bus_message_read_basic(m, 'u', &entry.jobId);
+        if(r >= 0)
+            r = sd_bus_message_read_basic(m, 's', &s[7]);
+        if(r >= 0)
+            r = sd_bus_message_read_basic(m, 'o', &s[8]);
+        if(r >= 0)
+            r = sd_bus_message_exit_container(m);
+        if(r < 0)
+            return r;
+
+        entry.name = s[0];
+        entry.description = s[1];
+        entry.loadState = s[2];
+        entry.activeState = s[3];
+        entry.subState = s[4];
+        entry.following = s[5];
+        entry.path = s[6];
+        entry.jobType = s[7];
+        entry.jobPath = s[8];
+        count++;
+
+        if(!visit(static_cast<const UnitListEntry&>(entry)))
+            return count;
+    }
+    if(r < 0)
+        return r;
+
+    r = sd_bus_message_exit_container(m);
+    return r < 0 ? r : count;
+}